@@ -0,0 +1,32 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Animates the instances: each one orbits around its grid position.
+// Instances are 7 floats, offset.xy, scale, tint.rgb and depth, as laid
+// out by VulkanApp::Instance.
+layout(local_size_x = 64) in;
+
+layout(std430, set = 0, binding = 0) readonly buffer Base {
+    float base[];
+};
+layout(std430, set = 0, binding = 1) writeonly buffer Animated {
+    float animated[];
+};
+
+layout(push_constant) uniform Params {
+    float time;
+    uint count;
+} params;
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= params.count)
+        return;
+    uint b = i * 7;
+    float scale = base[b + 2];
+    float phase = 2.0 * params.time + 0.37 * float(i);
+    animated[b] = base[b] + 0.1 * scale * cos(phase);
+    animated[b + 1] = base[b + 1] + 0.1 * scale * sin(phase);
+    for (uint k = 2; k < 7; ++k)
+        animated[b + k] = base[b + k];
+}
@@ -0,0 +1,55 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Frustum culls the instances and compacts the visible ones, which a single
+// instanced indirect draw then consumes.  The bounds of an instance are the
+// mesh bounding circle scaled and moved like the mesh, then seen through the
+// camera.  The draw command is written before the dispatch with no
+// instance, every visible instance adds one.
+layout(local_size_x = 64) in;
+
+struct DrawCommand {
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    int vertexOffset;
+    uint firstInstance;
+};
+
+// Same layout as VulkanApp::Instance: offset.xy, scale, tint.rgb, depth
+layout(std430, set = 0, binding = 0) readonly buffer Instances {
+    float instances[];
+};
+layout(std430, set = 0, binding = 1) writeonly buffer Visible {
+    float visible[];
+};
+layout(std430, set = 0, binding = 2) buffer Command {
+    DrawCommand command;
+};
+
+// The frame uniforms of the graphics pipelines
+layout(set = 1, binding = 0) uniform Frame {
+    vec2 pan;
+    float zoom;
+    float time;
+} frame;
+
+layout(push_constant) uniform Params {
+    uint count;
+    float radius;
+} params;
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= params.count)
+        return;
+    vec2 center = vec2(instances[i * 7], instances[i * 7 + 1]);
+    center = (center - frame.pan) * frame.zoom;
+    float r = params.radius * instances[i * 7 + 2] * frame.zoom;
+    if (any(lessThanEqual(center + r, vec2(-1.0)))
+     || any(greaterThanEqual(center - r, vec2(1.0))))
+        return;
+    uint j = atomicAdd(command.instanceCount, 1);
+    for (uint k = 0; k < 7; ++k)
+        visible[j * 7 + k] = instances[i * 7 + k];
+}
@@ -2,9 +2,13 @@
 #extension GL_ARB_separate_shader_objects : enable
 
 layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragUv;
+
+// Only the resident mips are in the view, see VulkanApp::Texture
+layout(set = 1, binding = 0) uniform sampler2D tex;
 
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    outColor = vec4(fragColor * texture(tex, fragUv).rgb, 1.0);
 }
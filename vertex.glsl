@@ -4,21 +4,35 @@
 out gl_PerVertex {
     vec4 gl_Position;
 };
-layout (location = 0) out vec3 fragColor;
+layout (location = 0) in vec2 inPosition;
+layout (location = 1) in vec3 inColor;
+// Per instance, fetched with gl_InstanceIndex by the vertex input stage
+layout (location = 2) in vec2 instOffset;
+layout (location = 3) in float instScale;
+layout (location = 4) in vec3 instTint;
+layout (location = 5) in float instDepth;
 
-vec2 positions[3] = vec2[](
-    vec2(0.0, -0.5),
-    vec2(0.5, 0.5),
-    vec2(-0.5, 0.5)
-);
+// Written every frame into the uniform ring, see VulkanApp::FrameUniforms
+layout (set = 0, binding = 0) uniform Frame {
+    vec2 pan;
+    float zoom;
+    float time;
+} frame;
+// One entry per draw, indexed by the push constant
+layout (std430, set = 0, binding = 1) readonly buffer Draws {
+    vec4 drawTint[];
+};
+layout (push_constant) uniform Draw {
+    uint index;
+} draw;
 
-vec3 colors[3] = vec3[](
-    vec3(1.0, 0.0, 0.0),
-    vec3(0.0, 1.0, 0.0),
-    vec3(0.0, 0.0, 1.0)
-);
+layout (location = 0) out vec3 fragColor;
+// The mesh spans [-0.5, 0.5], the texture covers it once
+layout (location = 1) out vec2 fragUv;
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    fragColor = colors[gl_VertexIndex];
+    vec2 pos = inPosition * instScale + instOffset;
+    gl_Position = vec4((pos - frame.pan) * frame.zoom, instDepth, 1.0);
+    fragColor = inColor * instTint * drawTint[draw.index].rgb;
+    fragUv = inPosition + 0.5;
 }
@@ -2,1125 +2,7035 @@
 #include <GLFW/glfw3.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-using namespace std;
-
-#define MSAA 1
-
-class VulkanApp
-{
-    GLFWwindow *window = nullptr;
-    VkInstance instance;
-    VkSurfaceKHR surface;
-
-    struct PhysicalDeviceInfo {
-        VkPhysicalDevice device = VK_NULL_HANDLE;
-        VkPhysicalDeviceFeatures deviceFeatures;
-        VkSurfaceCapabilitiesKHR capabilities;
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-        // idx 0 is graphics, 1 is presentation
-        uint32_t families[2];
-
-        // color depth
-        VkSurfaceFormatKHR format;
-        // how we display images
-        VkPresentModeKHR presentMode;
-        VkExtent2D extent;
-        uint32_t imageCount;
+using namespace std;
 
-        bool hasUniqueFamily() const {
-            return families[0] == families[1];
-        }
-    } devInfo;
-    VkDevice device;
-    VkQueue presentationQueue;
-    VkQueue graphicsQueue;
+// SPIR-V compiled by glslc -mfmt=num at build time, see the Makefile
+static constexpr uint32_t vertexSpirv[] = {
+#include "vertex.spv.inc"
+};
+static constexpr uint32_t fragmentSpirv[] = {
+#include "fragment.spv.inc"
+};
+static constexpr uint32_t computeSpirv[] = {
+#include "compute.spv.inc"
+};
+static constexpr uint32_t cullSpirv[] = {
+#include "cull.spv.inc"
+};
+static_assert(vertexSpirv[0] == 0x07230203 && fragmentSpirv[0] == 0x07230203
+           && computeSpirv[0] == 0x07230203 && cullSpirv[0] == 0x07230203,
+              "embedded shaders are not SPIR-V");
 
-    VkSwapchainKHR vkSwapChain;
-    struct SwapChainEntry {
-        VkImage image;
-        VkImageView view;
+// For posix_spawnp(), not every unistd.h declares it
+extern char **environ;
 
-        // Anti aliasing stuff
-#ifdef MSAA
-        VkImage msaaImage;
-        VkDeviceMemory msaaMemory;
-        VkImageView msaaView;
+// How many frames the CPU may record ahead of the GPU.  This is independent
+// of the number of swap chain images.
+#ifndef MAX_FRAMES_IN_FLIGHT
+#define MAX_FRAMES_IN_FLIGHT 2
 #endif
 
-        // Synchronization
-        VkSemaphore imageAvailableSem;
-        VkSemaphore renderFinishedSem;
-        VkFence fence;
+// Device memory allocator.  Memory types are picked from required and
+// preferred property flags, and allocations are carved out of large blocks
+// with a buddy scheme: every sub-allocation is a power of two sized range
+// aligned to its size, which satisfies any alignment requirement for free.
+// Buffers and optimal tiling images get separate blocks so that we never
+// have to care about bufferImageGranularity.
+class DeviceAllocator
+{
+  public:
+    struct Allocation {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        // Host pointer for host visible memory, nullptr otherwise
+        void *mapped = nullptr;
+        uint32_t memoryType = 0;
+        // Index of the block in its pool, -1 for dedicated allocations
+        int32_t block = -1;
+        uint32_t pool = 0;
+        uint32_t order = 0;
     };
-    vector<SwapChainEntry> swapChain;
-
-    // Shaders
-    VkShaderModule vertexShader;
-    VkShaderModule fragShader;
-
-    VkRenderPass renderPass;
-
-    VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
-
-    vector<VkFramebuffer> frameBuffers;
-
-    VkCommandPool commandPool;
-    vector<VkCommandBuffer> commandBuffers;
-
-   public:
-    VulkanApp() = default;
-    ~VulkanApp() = default;
-
-    VulkanApp(VulkanApp&) = delete;
-    VulkanApp& operator=(const VulkanApp&) = delete;
 
-    void run();
-
-  private:
-    bool readFile(vector<char> *data, const char *filename);
-    VkPresentModeKHR choosePresentMode(const VkPresentModeKHR* modes,
-                                       uint32_t modeCount);
-    VkSurfaceFormatKHR chooseSwapSurfaceFormat(
-                                             const VkSurfaceFormatKHR* formats,
-                                             uint32_t formatCount);
+    struct HeapStats {
+        VkDeviceSize heapSize = 0;
+        // Bytes obtained from vkAllocateMemory
+        VkDeviceSize reservedBytes = 0;
+        // Bytes handed out to resources, rounded up to the buddy size
+        VkDeviceSize usedBytes = 0;
+        uint32_t deviceAllocations = 0;
+        uint32_t subAllocations = 0;
+    };
 
-    static void glfwErrorCallback(int /*error*/, const char* description)
-    {
-        puts(description);
+    static constexpr VkDeviceSize minAllocSize = 256;
+    static constexpr VkDeviceSize defaultBlockSize = 64 * 1024 * 1024;
+
+    bool init(VkPhysicalDevice physicalDevice, VkDevice device);
+    void destroy();
+
+    bool allocate(const VkMemoryRequirements& reqs,
+                  VkMemoryPropertyFlags required,
+                  VkMemoryPropertyFlags preferred,
+                  bool linear, Allocation *alloc);
+    void free(const Allocation& alloc);
+
+    // Convenience wrappers creating the resource and binding its memory
+    bool createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                      VkMemoryPropertyFlags required,
+                      VkMemoryPropertyFlags preferred,
+                      VkBuffer *buffer, Allocation *alloc,
+                      const vector<uint32_t>& families = {});
+    bool createImage(const VkImageCreateInfo& info,
+                     VkMemoryPropertyFlags required,
+                     VkMemoryPropertyFlags preferred,
+                     VkImage *image, Allocation *alloc);
+    void destroyBuffer(VkBuffer buffer, const Allocation& alloc);
+    void destroyImage(VkImage image, const Allocation& alloc);
+
+    HeapStats heapStats(uint32_t heapIndex) const;
+    void printStats() const;
+
+    const VkPhysicalDeviceMemoryProperties& properties() const {
+        return memProps;
     }
 
-    bool init();
-    bool initGlFw();
-    bool initVulkanInstance();
-    bool createSurface();
-    bool choosePhysicalDevice();
-    bool createLogicalDevice();
-    bool createSwapChain();
-    bool loadShaders();
-    bool createRenderPass();
-    bool createPipeline();
-    bool createFrameBuffers();
-    bool createCommandBuffers();
-    bool setupCommandBuffers();
-    void cleanup();
-    void cleanupSwapChain();
-    void waitForIdle();
-    bool recreateSwapChain();
-    void onResize(int width, int height);
-    void updateExtent();
-
-    bool renderFrame(uint32_t renderCount);
+  private:
+    struct Block {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        void *mapped = nullptr;
+        VkDeviceSize size = 0;
+        VkDeviceSize used = 0;
+        uint32_t allocCount = 0;
+        // freeLists[order] holds the offsets of the free ranges of size
+        // minAllocSize << order
+        vector<set<VkDeviceSize>> freeLists;
+    };
+    struct Pool {
+        vector<Block> blocks;
+    };
 
-    // Glfw glue
-    static void glfw_onResize(GLFWwindow * window, int width, int height)
-    {
-        VulkanApp *app = (VulkanApp *) glfwGetWindowUserPointer(window);
-        app->onResize(width, height);
-    }
+    int32_t findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required,
+                           VkMemoryPropertyFlags preferred) const;
+    bool allocateDeviceMemory(uint32_t memoryType, VkDeviceSize size,
+                              VkDeviceMemory *memory, void **mapped);
+    VkDeviceSize blockSize(uint32_t memoryType) const;
+    static uint32_t orderFor(VkDeviceSize size);
+    static bool allocateFromBlock(Block *block, uint32_t order,
+                                  VkDeviceSize *offset);
+    static void freeToBlock(Block *block, VkDeviceSize offset,
+                            uint32_t order);
+
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memProps;
+    // Two pools per memory type: optimal images, then linear resources
+    vector<Pool> pools;
+    HeapStats stats[VK_MAX_MEMORY_HEAPS];
 };
 
-bool VulkanApp::init()
+bool DeviceAllocator::init(VkPhysicalDevice physicalDevice, VkDevice dev)
 {
-    if (!initGlFw()
-     || !initVulkanInstance()
-       // Setup debug cb
-     || !createSurface()
-     || !choosePhysicalDevice()
-     || !createLogicalDevice()
-     || !createSwapChain()
-     || !loadShaders()
-     || !createRenderPass()
-     || !createPipeline()
-     || !createFrameBuffers()
-     || !createCommandBuffers()
-     || !setupCommandBuffers())
-        return false;
+    device = dev;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProps);
+    pools.resize(memProps.memoryTypeCount * 2);
+    for (uint32_t i = 0; i < memProps.memoryHeapCount; ++i) {
+        stats[i] = HeapStats();
+        stats[i].heapSize = memProps.memoryHeaps[i].size;
+    }
     return true;
 }
 
-void VulkanApp::run()
+void DeviceAllocator::destroy()
 {
-    if (!init())
-        return;
-
-    uint32_t renderCount = 0;
-    while(1) {
-        bool running = renderFrame(renderCount++);
+    for (uint32_t i = 0; i < memProps.memoryHeapCount; ++i) {
+        if (stats[i].usedBytes != 0) {
+            printf("allocator: %llu bytes still allocated on heap %u\n",
+                   (unsigned long long) stats[i].usedBytes, i);
+        }
+    }
+    for (auto& pool : pools) {
+        for (auto& block : pool.blocks) {
+            // vkFreeMemory implicitly unmaps
+            vkFreeMemory(device, block.memory, nullptr);
+        }
+    }
+    pools.clear();
+}
 
-        glfwPollEvents();
-        if (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_RELEASE)
-            running = false;
-        if (glfwWindowShouldClose(window))
-            running = false;
-        if (!running) {
-            break;
+int32_t DeviceAllocator::findMemoryType(uint32_t typeBits,
+                                        VkMemoryPropertyFlags required,
+                                        VkMemoryPropertyFlags preferred) const
+{
+    // Among the types that are allowed and have every required flag, take
+    // the one matching the most preferred flags.  Types are ordered by the
+    // driver from best to worst so ties go to the lowest index.
+    int32_t best = -1;
+    int bestScore = -1;
+    for (uint32_t i = 0; i < memProps.memoryTypeCount; ++i) {
+        if (!(typeBits & (1U << i)))
+            continue;
+        const VkMemoryPropertyFlags flags =
+                                        memProps.memoryTypes[i].propertyFlags;
+        if ((flags & required) != required)
+            continue;
+        const int score = __builtin_popcount(flags & preferred);
+        if (score > bestScore) {
+            best = i;
+            bestScore = score;
         }
     }
+    return best;
+}
 
-    waitForIdle();
-    cleanup();
+VkDeviceSize DeviceAllocator::blockSize(uint32_t memoryType) const
+{
+    // Don't grab more than an eighth of small heaps at once
+    const uint32_t heap = memProps.memoryTypes[memoryType].heapIndex;
+    VkDeviceSize size = defaultBlockSize;
+    while (size > minAllocSize && size > memProps.memoryHeaps[heap].size / 8)
+        size /= 2;
+    return size;
 }
 
-void VulkanApp::waitForIdle()
+uint32_t DeviceAllocator::orderFor(VkDeviceSize size)
 {
-    for (auto & swpe : swapChain)
-        vkWaitForFences(device, 1, &swpe.fence, VK_TRUE, UINT64_MAX);
-    vkDeviceWaitIdle(device);
+    uint32_t order = 0;
+    while ((minAllocSize << order) < size)
+        ++order;
+    return order;
 }
 
-bool VulkanApp::readFile(vector<char> *buf, const char *filename)
+bool DeviceAllocator::allocateDeviceMemory(uint32_t memoryType,
+                                           VkDeviceSize size,
+                                           VkDeviceMemory *memory,
+                                           void **mapped)
 {
-    FILE *fd = fopen(filename, "r");
-    if (!fd)
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = memoryType;
+    VkResult vkRet = vkAllocateMemory(device, &allocInfo, nullptr, memory);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkAllocateMemory of %llu bytes failed with %d\n",
+               (unsigned long long) size, vkRet);
         return false;
-    size_t numRead = 0;
-    while (1) {
-        buf->resize(numRead + 4096);
-        size_t ret = fread(buf->data() + numRead, 1, 4096, fd);
-        numRead += ret;
-        if (ret != 4096)
-            break;
     }
-    buf->resize(numRead);
-    fclose(fd);
+
+    // Host visible memory stays mapped for its whole lifetime
+    *mapped = nullptr;
+    if (memProps.memoryTypes[memoryType].propertyFlags &
+                                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkRet = vkMapMemory(device, *memory, 0, VK_WHOLE_SIZE, 0, mapped);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkMapMemory failed with %d\n", vkRet);
+            vkFreeMemory(device, *memory, nullptr);
+            return false;
+        }
+    }
+
+    HeapStats& heap = stats[memProps.memoryTypes[memoryType].heapIndex];
+    heap.reservedBytes += size;
+    heap.deviceAllocations++;
     return true;
 }
 
-VkPresentModeKHR VulkanApp::choosePresentMode(const VkPresentModeKHR* modes,
-                                              uint32_t modeCount)
+bool DeviceAllocator::allocateFromBlock(Block *block, uint32_t order,
+                                        VkDeviceSize *offset)
 {
-    // This is guaranteed to be avail per spec but can be buggy
-    VkPresentModeKHR bestMode = VK_PRESENT_MODE_FIFO_KHR;
-    for (uint32_t i = 0; i < modeCount; ++i) {
-        if (modes[i] == VK_PRESENT_MODE_MAILBOX_KHR)
-            return VK_PRESENT_MODE_MAILBOX_KHR;
-        if (modes[i] == VK_PRESENT_MODE_IMMEDIATE_KHR)
-            bestMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+    // Smallest free range that fits, split down to the requested order
+    uint32_t k = order;
+    while (k < block->freeLists.size() && block->freeLists[k].empty())
+        ++k;
+    if (k >= block->freeLists.size())
+        return false;
+
+    VkDeviceSize off = *block->freeLists[k].begin();
+    block->freeLists[k].erase(block->freeLists[k].begin());
+    while (k > order) {
+        --k;
+        block->freeLists[k].insert(off + (minAllocSize << k));
     }
-    return bestMode;
+    block->used += minAllocSize << order;
+    block->allocCount++;
+    *offset = off;
+    return true;
 }
 
-VkSurfaceFormatKHR VulkanApp::chooseSwapSurfaceFormat(
-                                             const VkSurfaceFormatKHR* formats,
-                                             uint32_t formatCount)
+void DeviceAllocator::freeToBlock(Block *block, VkDeviceSize offset,
+                                  uint32_t order)
 {
-    if (formatCount == 1 && formats[0].format == VK_FORMAT_UNDEFINED) {
-        // Guaranteed to be avail in this case
-        return {VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
-    }
-    for (uint32_t i = 0; i < formatCount; ++i) {
-        if (formats[i].format == VK_FORMAT_B8G8R8A8_UNORM
-         && formats[i].colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
-            return formats[i];
+    block->used -= minAllocSize << order;
+    block->allocCount--;
+    // Merge with the buddy for as long as it is free
+    while (order + 1 < block->freeLists.size()) {
+        const VkDeviceSize buddy = offset ^ (minAllocSize << order);
+        if (block->freeLists[order].erase(buddy) == 0)
+            break;
+        offset = min(offset, buddy);
+        ++order;
     }
-    return formats[0];
+    block->freeLists[order].insert(offset);
 }
 
-bool VulkanApp::initGlFw() {
-    // Init glfw
-    glfwInit();
-    glfwSetErrorCallback(glfwErrorCallback);
-
-    // This prevents glfw from creating a gl context
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
-    window = glfwCreateWindow(800, 600, "Vulkan", nullptr, nullptr);
-    glfwSetWindowUserPointer(window, this);
-    glfwSetWindowSizeCallback(window, &VulkanApp::glfw_onResize);
+bool DeviceAllocator::allocate(const VkMemoryRequirements& reqs,
+                               VkMemoryPropertyFlags required,
+                               VkMemoryPropertyFlags preferred,
+                               bool linear, Allocation *alloc)
+{
+    const int32_t memoryType = findMemoryType(reqs.memoryTypeBits, required,
+                                              preferred);
+    if (memoryType < 0) {
+        printf("allocator: no memory type for bits 0x%x with flags 0x%x\n",
+               reqs.memoryTypeBits, required);
+        return false;
+    }
+    const VkMemoryPropertyFlags flags =
+                            memProps.memoryTypes[memoryType].propertyFlags;
+    HeapStats& heap = stats[memProps.memoryTypes[memoryType].heapIndex];
+
+    *alloc = Allocation();
+    alloc->memoryType = memoryType;
+
+    const VkDeviceSize size = max(reqs.size, reqs.alignment);
+    const VkDeviceSize maxBlock = blockSize(memoryType);
+    // Big resources get their own allocation.  So do lazily allocated
+    // ones: their backing is only committed on demand and sharing a block
+    // would defeat that.
+    if (size > maxBlock / 2
+     || (flags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)) {
+        if (!allocateDeviceMemory(memoryType, reqs.size, &alloc->memory,
+                                  &alloc->mapped))
+            return false;
+        alloc->size = reqs.size;
+        heap.usedBytes += reqs.size;
+        heap.subAllocations++;
+        return true;
+    }
 
-    VkExtensionProperties properties[16];
-    uint32_t extensionCount = 16;
-    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount,
-                                           properties);
+    const uint32_t order = orderFor(size);
+    alloc->pool = memoryType * 2 + (linear ? 1 : 0);
+    alloc->order = order;
+    alloc->size = minAllocSize << order;
+    Pool& pool = pools[alloc->pool];
 
-    printf("%u extensions supported: ", extensionCount);
-    for (unsigned i = 0; i < extensionCount; ++i) {
-        if (i)
-            printf(", ");
-        printf("%s", properties[i].extensionName);
+    VkDeviceSize offset = 0;
+    for (size_t i = 0; i < pool.blocks.size(); ++i) {
+        if (allocateFromBlock(&pool.blocks[i], order, &offset)) {
+            alloc->block = i;
+            break;
+        }
     }
-    puts("");
-    if (glfwVulkanSupported() != GLFW_TRUE) {
-        puts("glfw does not support vulkan! Upgrade to the latest version");
-        return false;
+    if (alloc->block < 0) {
+        Block block;
+        block.size = maxBlock;
+        if (!allocateDeviceMemory(memoryType, block.size, &block.memory,
+                                  &block.mapped))
+            return false;
+        block.freeLists.resize(orderFor(block.size) + 1);
+        block.freeLists.back().insert(0);
+        pool.blocks.push_back(move(block));
+        alloc->block = pool.blocks.size() - 1;
+        allocateFromBlock(&pool.blocks.back(), order, &offset);
     }
+
+    const Block& block = pool.blocks[alloc->block];
+    alloc->memory = block.memory;
+    alloc->offset = offset;
+    if (block.mapped)
+        alloc->mapped = (char *) block.mapped + offset;
+    heap.usedBytes += alloc->size;
+    heap.subAllocations++;
     return true;
 }
 
-bool VulkanApp::initVulkanInstance() {
-    VkApplicationInfo appInfo = {};
-    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-    appInfo.pApplicationName = "Vulkan triangle";
-    appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.pEngineName = "DeadCanard's Engine";
-    appInfo.engineVersion = VK_MAKE_VERSION(0, 0, 1);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
-
-    VkInstanceCreateInfo createInfo = {};
-    createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-    createInfo.pApplicationInfo = &appInfo;
+void DeviceAllocator::free(const Allocation& alloc)
+{
+    if (alloc.memory == VK_NULL_HANDLE)
+        return;
+    HeapStats& heap = stats[memProps.memoryTypes[alloc.memoryType].heapIndex];
+    heap.usedBytes -= alloc.size;
+    heap.subAllocations--;
+
+    if (alloc.block < 0) {
+        vkFreeMemory(device, alloc.memory, nullptr);
+        heap.reservedBytes -= alloc.size;
+        heap.deviceAllocations--;
+        return;
+    }
 
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions = glfwGetRequiredInstanceExtensions(
-                                                          &glfwExtensionCount);
-    createInfo.enabledExtensionCount = glfwExtensionCount;
-    createInfo.ppEnabledExtensionNames = glfwExtensions;
-    createInfo.enabledLayerCount = 0;
+    Pool& pool = pools[alloc.pool];
+    Block& block = pool.blocks[alloc.block];
+    freeToBlock(&block, alloc.offset, alloc.order);
+    // Give back empty blocks, but keep the last one around to avoid
+    // thrashing vkAllocateMemory.  Only the tail block can go since indices
+    // are stored in the allocations.
+    while (pool.blocks.size() > 1 && pool.blocks.back().allocCount == 0) {
+        vkFreeMemory(device, pool.blocks.back().memory, nullptr);
+        heap.reservedBytes -= pool.blocks.back().size;
+        heap.deviceAllocations--;
+        pool.blocks.pop_back();
+    }
+}
 
-    VkResult vkRet = vkCreateInstance(&createInfo, nullptr, &instance);
+bool DeviceAllocator::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                                   VkMemoryPropertyFlags required,
+                                   VkMemoryPropertyFlags preferred,
+                                   VkBuffer *buffer, Allocation *alloc,
+                                   const vector<uint32_t>& families)
+{
+    VkBufferCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    info.size = size;
+    info.usage = usage;
+    // Shared between queue families if more than one will touch it
+    info.sharingMode = families.size() > 1 ? VK_SHARING_MODE_CONCURRENT
+                                           : VK_SHARING_MODE_EXCLUSIVE;
+    info.queueFamilyIndexCount = families.size() > 1 ? families.size() : 0;
+    info.pQueueFamilyIndices = families.size() > 1 ? families.data() : nullptr;
+
+    VkResult vkRet = vkCreateBuffer(device, &info, nullptr, buffer);
     if (vkRet != VK_SUCCESS) {
-        printf("vkCreateInstance failed with %d\n", vkRet);
+        printf("vkCreateBuffer failed with %d\n", vkRet);
         return false;
     }
-    return true;
-}
 
-bool VulkanApp::createSurface() {
-    VkResult vkRet = glfwCreateWindowSurface(instance, window, nullptr,
-                                             &surface);
+    VkMemoryRequirements reqs;
+    vkGetBufferMemoryRequirements(device, *buffer, &reqs);
+    if (!allocate(reqs, required, preferred, true, alloc)) {
+        vkDestroyBuffer(device, *buffer, nullptr);
+        return false;
+    }
+    vkRet = vkBindBufferMemory(device, *buffer, alloc->memory, alloc->offset);
     if (vkRet != VK_SUCCESS) {
-        printf("failed to create surface: glfwCreateWindowSurface() failed "
-               "with %d\n", vkRet);
+        printf("vkBindBufferMemory failed with %d\n", vkRet);
+        destroyBuffer(*buffer, *alloc);
         return false;
     }
     return true;
 }
 
-void VulkanApp::updateExtent()
+bool DeviceAllocator::createImage(const VkImageCreateInfo& info,
+                                  VkMemoryPropertyFlags required,
+                                  VkMemoryPropertyFlags preferred,
+                                  VkImage *image, Allocation *alloc)
 {
-    int width, height;
-    glfwGetWindowSize(window, &width, &height);
-    glfwGetFramebufferSize(window, &width, &height);
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(devInfo.device, surface,
-                                              &devInfo.capabilities);
-    if (devInfo.capabilities.currentExtent.width != UINT_MAX) {
-        devInfo.extent = devInfo.capabilities.currentExtent;
+    VkResult vkRet = vkCreateImage(device, &info, nullptr, image);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateImage failed with %d\n", vkRet);
+        return false;
     }
-    else {
-        devInfo.extent.width =
-            max(devInfo.capabilities.minImageExtent.width,
-                min(devInfo.capabilities.maxImageExtent.width,
-                    (unsigned) width));
-        devInfo.extent.height =
-            max(devInfo.capabilities.minImageExtent.height,
-                min(devInfo.capabilities.maxImageExtent.height,
-                    (unsigned) height));
+
+    VkMemoryRequirements reqs;
+    vkGetImageMemoryRequirements(device, *image, &reqs);
+    const bool linear = info.tiling == VK_IMAGE_TILING_LINEAR;
+    if (!allocate(reqs, required, preferred, linear, alloc)) {
+        vkDestroyImage(device, *image, nullptr);
+        return false;
     }
-    devInfo.extent.width = width;
-    devInfo.extent.height = height;
+    vkRet = vkBindImageMemory(device, *image, alloc->memory, alloc->offset);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkBindImageMemory failed with %d\n", vkRet);
+        destroyImage(*image, *alloc);
+        return false;
+    }
+    return true;
 }
 
-bool VulkanApp::choosePhysicalDevice()
+void DeviceAllocator::destroyBuffer(VkBuffer buffer, const Allocation& alloc)
 {
-    uint32_t deviceCount = 0;
-    vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
-    if (deviceCount == 0) {
-        puts("Found no physical device");
-        return false;
-    }
-    VkPhysicalDevice devices[deviceCount];
-    vkEnumeratePhysicalDevices(instance, &deviceCount, devices);
-    for (unsigned i = 0; i < deviceCount; ++i) {
-        // We're looking for a device that has
-        // * graphics family queue
-        // * presentation family queue
-        // * swap chain khr extension
-        // * valid swap chain format/present mode
-        VkPhysicalDeviceProperties properties;
-        vkGetPhysicalDeviceProperties(devices[i], &properties);
-
-        if (properties.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
-            // Only consider discreate cpu type
-            continue;
-        }
-        vkGetPhysicalDeviceFeatures(devices[i], &devInfo.deviceFeatures);
+    vkDestroyBuffer(device, buffer, nullptr);
+    free(alloc);
+}
 
-        uint32_t extensionCount;
-        vkEnumerateDeviceExtensionProperties(devices[i], nullptr,
-                                             &extensionCount, nullptr);
-        if (extensionCount == 0)
-            continue;
+void DeviceAllocator::destroyImage(VkImage image, const Allocation& alloc)
+{
+    vkDestroyImage(device, image, nullptr);
+    free(alloc);
+}
 
-        VkExtensionProperties extProps[extensionCount];
-        vkEnumerateDeviceExtensionProperties(devices[i], nullptr,
-                                             &extensionCount, extProps);
-        bool hasSwapChain = false;
-        for (unsigned k = 0; k < extensionCount; ++k) {
-            if (0 == strcmp(extProps[k].extensionName,
-                            VK_KHR_SWAPCHAIN_EXTENSION_NAME)) {
-                hasSwapChain = true;
-                break;
-            }
-        }
-        if (!hasSwapChain)
-            continue;
+DeviceAllocator::HeapStats DeviceAllocator::heapStats(uint32_t heapIndex) const
+{
+    return stats[heapIndex];
+}
 
-        uint32_t queueFamilyCount = 0;
-        vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &queueFamilyCount,
-                                                 nullptr);
-        VkQueueFamilyProperties queueProps[queueFamilyCount];
-        vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &queueFamilyCount,
-                                                 queueProps);
-        uint32_t graphicsFamily;
-        uint32_t presentationFamily;
-        bool graphicsFamilySet = false;
-        bool presentationFamilySet = false;
-        for (unsigned j = 0; j != queueFamilyCount; ++j) {
-            if (queueProps[j].queueCount <= 0)
-                continue;
+void DeviceAllocator::printStats() const
+{
+    const double mb = 1024.0 * 1024.0;
+    for (uint32_t i = 0; i < memProps.memoryHeapCount; ++i) {
+        const HeapStats& heap = stats[i];
+        printf("heap %u%s: %.1f MB, reserved %.1f MB in %u allocations, "
+               "used %.1f MB in %u resources, free %.1f MB\n", i,
+               (memProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+                                                     ? " (device local)" : "",
+               heap.heapSize / mb, heap.reservedBytes / mb,
+               heap.deviceAllocations, heap.usedBytes / mb,
+               heap.subAllocations,
+               (heap.reservedBytes - heap.usedBytes) / mb);
+    }
+}
 
-            if (queueProps[j].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-                graphicsFamily = j;
-                graphicsFamilySet = true;
-            }
-            VkBool32 presentSupport = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(devices[i], j, surface,
-                                                 &presentSupport);
-            if (presentSupport) {
-                presentationFamily = j;
-                presentationFamilySet = true;
-            }
+// Descriptor set allocator.  Pools are created on demand, each one twice the
+// size of the previous one of its kind, with room for every descriptor type
+// we use.  There are two kinds of sets:
+// * Transient sets, allocated for one frame in flight from that frame's
+//   pools.  The pools are reset wholesale by beginFrame() once the frame's
+//   fence has signaled, nothing is freed one by one.
+// * Cached sets, whose content never changes.  They are looked up by a
+//   hash of the layout and the bindings, so asking again for the same set
+//   costs a lookup.  They stay until forget() is called on one of their
+//   buffers or views.
+class DescriptorAllocator
+{
+  public:
+    struct BufferBinding {
+        VkDescriptorType type;
+        VkBuffer buffer;
+        VkDeviceSize offset;
+        VkDeviceSize range;
+        bool operator==(const BufferBinding& o) const {
+            return type == o.type && buffer == o.buffer && offset == o.offset
+                && range == o.range;
         }
-        if (!presentationFamilySet || !graphicsFamilySet)
-            continue;
+    };
 
-        uint32_t formatCount;
-        vkGetPhysicalDeviceSurfaceFormatsKHR(devices[i], surface, &formatCount,
-                                             nullptr);
-        if (0 == formatCount) {
-            continue;
-        }
-        uint32_t presentModeCount;
-        vkGetPhysicalDeviceSurfacePresentModesKHR(devices[i], surface,
-                                                  &presentModeCount,
-                                                  nullptr);
-        if (0 == presentModeCount) {
-            continue;
-        }
+    void init(VkDevice device, uint32_t frameCount);
+    void destroy();
+
+    void beginFrame(uint32_t frame);
+    bool allocateTransient(uint32_t frame, VkDescriptorSetLayout layout,
+                           VkDescriptorSet *set);
+    // Binding i of the set is bindings[i]
+    bool cachedSet(VkDescriptorSetLayout layout,
+                   const vector<BufferBinding>& bindings,
+                   VkDescriptorSet *set);
+    // A single combined image sampler at binding 0
+    bool cachedImageSet(VkDescriptorSetLayout layout, VkImageView view,
+                        VkSampler sampler, VkDescriptorSet *set);
+    // Frees the cached sets using buffer, once the GPU is done with them
+    void forget(VkBuffer buffer);
+    void forget(VkImageView view);
 
-        // Ok, we're going to use this device.  Populate devInfo
-        devInfo.device = devices[i];
-        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(devices[i], surface,
-                                                  &devInfo.capabilities);
-        updateExtent();
+  private:
+    struct PoolList {
+        vector<VkDescriptorPool> pools;
+        // Pools before that one are full
+        size_t current = 0;
+        uint32_t nextMaxSets = 64;
+    };
+    struct CachedSet {
+        VkDescriptorSetLayout layout;
+        vector<BufferBinding> bindings;
+        // Image sets have no buffer bindings
+        VkImageView view = VK_NULL_HANDLE;
+        VkSampler sampler = VK_NULL_HANDLE;
+        VkDescriptorSet set;
+        VkDescriptorPool pool;
+    };
+    bool createPool(PoolList *list, VkDescriptorPoolCreateFlags flags);
+    bool allocate(PoolList *list, VkDescriptorPoolCreateFlags flags,
+                  VkDescriptorSetLayout layout, VkDescriptorSet *set,
+                  VkDescriptorPool *pool);
+    static uint64_t hash(VkDescriptorSetLayout layout,
+                         const vector<BufferBinding>& bindings,
+                         VkImageView view = VK_NULL_HANDLE,
+                         VkSampler sampler = VK_NULL_HANDLE);
+    template <typename Pred> void forgetIf(Pred uses);
+
+    VkDevice device = VK_NULL_HANDLE;
+    vector<PoolList> framePools;
+    PoolList cachedPools;
+    unordered_map<uint64_t, vector<CachedSet>> cache;
+};
 
-        VkSurfaceFormatKHR formats[formatCount];
-        vkGetPhysicalDeviceSurfaceFormatsKHR(devices[i], surface,
-                                             &formatCount, formats);
-        devInfo.format = chooseSwapSurfaceFormat(formats, formatCount);
-
-        VkPresentModeKHR presentModes[presentModeCount];
-        vkGetPhysicalDeviceSurfacePresentModesKHR(devices[i], surface,
-                                                  &presentModeCount,
-                                                  presentModes);
-        devInfo.presentMode = choosePresentMode(presentModes,
-                                                presentModeCount);
-
-        uint32_t imgCount = devInfo.capabilities.minImageCount + 1;
-        if (devInfo.capabilities.maxImageCount > 0)
-            imgCount = min(devInfo.capabilities.maxImageCount, imgCount);
-        devInfo.imageCount = imgCount;
-        devInfo.families[0] = graphicsFamily;
-        devInfo.families[1] = presentationFamily;
-        printf("Using device %s\n", properties.deviceName);
-        return true;
+void DescriptorAllocator::init(VkDevice dev, uint32_t frameCount)
+{
+    device = dev;
+    framePools.resize(frameCount);
+}
+
+void DescriptorAllocator::destroy()
+{
+    // Destroying the pools frees the sets
+    for (auto& list : framePools) {
+        for (VkDescriptorPool pool : list.pools)
+            vkDestroyDescriptorPool(device, pool, nullptr);
     }
-    return false;
+    for (VkDescriptorPool pool : cachedPools.pools)
+        vkDestroyDescriptorPool(device, pool, nullptr);
+    framePools.clear();
+    cachedPools = PoolList();
+    cache.clear();
 }
 
-// Create logical device
-bool VulkanApp::createLogicalDevice() {
-    const uint32_t numQueues = devInfo.hasUniqueFamily() ? 1 : 2;
+void DescriptorAllocator::beginFrame(uint32_t frame)
+{
+    // Only the pools used since the last reset
+    PoolList& list = framePools[frame];
+    for (size_t i = 0; i < list.pools.size() && i <= list.current; ++i)
+        vkResetDescriptorPool(device, list.pools[i], 0);
+    list.current = 0;
+}
 
-    VkDeviceQueueCreateInfo queueCreateInfo[numQueues];
-    memset(queueCreateInfo, 0, sizeof(queueCreateInfo));
-    float priority[1] = {1.0f};
-    for (unsigned i = 0; i < numQueues; ++i) {
-        queueCreateInfo[i].sType =
-                                VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        queueCreateInfo[i].queueFamilyIndex = devInfo.families[i];
-        // Only one queue of each type
-        queueCreateInfo[i].queueCount = 1;
-        queueCreateInfo[i].pQueuePriorities = priority;
-    }
+bool DescriptorAllocator::allocateTransient(uint32_t frame,
+                                            VkDescriptorSetLayout layout,
+                                            VkDescriptorSet *set)
+{
+    VkDescriptorPool pool;
+    return allocate(&framePools[frame], 0, layout, set, &pool);
+}
 
-    // Note that we've already verified what we need is supported when
-    // picking the physical device.
-    uint32_t extensionCount;
-    vkEnumerateDeviceExtensionProperties(devInfo.device, nullptr,
-                                         &extensionCount, nullptr);
-    VkExtensionProperties extProps[extensionCount];
-    vkEnumerateDeviceExtensionProperties(devInfo.device, nullptr,
-                                         &extensionCount, extProps);
-    char *extNames[extensionCount];
-    for (unsigned i = 0; i < extensionCount; ++i) {
-        extNames[i] = extProps[i].extensionName;
+bool DescriptorAllocator::cachedSet(VkDescriptorSetLayout layout,
+                                    const vector<BufferBinding>& bindings,
+                                    VkDescriptorSet *set)
+{
+    vector<CachedSet>& bucket = cache[hash(layout, bindings)];
+    for (const auto& entry : bucket) {
+        if (entry.layout == layout && entry.bindings == bindings
+         && entry.view == VK_NULL_HANDLE) {
+            *set = entry.set;
+            return true;
+        }
     }
 
-    VkDeviceCreateInfo createInfo = {};
-    createInfo.pQueueCreateInfos = queueCreateInfo;
-    createInfo.queueCreateInfoCount = numQueues;
-    createInfo.pEnabledFeatures = &devInfo.deviceFeatures;
-    createInfo.enabledExtensionCount = extensionCount;
-    createInfo.ppEnabledExtensionNames = extNames;
-    // FIXME validation here at some point
-    createInfo.enabledLayerCount = 0;
-
-    VkResult vkRet = vkCreateDevice(devInfo.device, &createInfo, nullptr,
-                                    &device);
-    if (vkRet != VK_SUCCESS) {
-        printf("vkCreateDevice failed with %d\n", vkRet);
+    CachedSet entry;
+    entry.layout = layout;
+    entry.bindings = bindings;
+    if (!allocate(&cachedPools,
+                  VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT, layout,
+                  &entry.set, &entry.pool))
         return false;
+
+    vector<VkDescriptorBufferInfo> bufferInfo(bindings.size());
+    vector<VkWriteDescriptorSet> writes(bindings.size());
+    for (size_t i = 0; i < bindings.size(); ++i) {
+        bufferInfo[i] = {};
+        bufferInfo[i].buffer = bindings[i].buffer;
+        bufferInfo[i].offset = bindings[i].offset;
+        bufferInfo[i].range = bindings[i].range;
+        writes[i] = {};
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = entry.set;
+        writes[i].dstBinding = i;
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = bindings[i].type;
+        writes[i].pBufferInfo = &bufferInfo[i];
     }
-    vkGetDeviceQueue(device, devInfo.families[0], 0, &graphicsQueue);
-    vkGetDeviceQueue(device, devInfo.families[1], 0, &presentationQueue);
+    vkUpdateDescriptorSets(device, writes.size(), writes.data(), 0, nullptr);
+    *set = entry.set;
+    bucket.push_back(move(entry));
     return true;
 }
 
-bool VulkanApp::createSwapChain()
+bool DescriptorAllocator::cachedImageSet(VkDescriptorSetLayout layout,
+                                         VkImageView view, VkSampler sampler,
+                                         VkDescriptorSet *set)
 {
-    VkSwapchainCreateInfoKHR createInfo = {};
-    createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-    createInfo.surface = surface;
-    createInfo.minImageCount = devInfo.imageCount;
-    createInfo.imageFormat = devInfo.format.format;
-    createInfo.imageColorSpace = devInfo.format.colorSpace;
-    createInfo.imageExtent = devInfo.extent;
-    createInfo.imageArrayLayers = 1;
-    createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-    createInfo.imageSharingMode = devInfo.hasUniqueFamily()
-                                ? VK_SHARING_MODE_EXCLUSIVE
-                                : VK_SHARING_MODE_CONCURRENT;
-    createInfo.queueFamilyIndexCount = devInfo.hasUniqueFamily() ? 0 : 2;
-    createInfo.pQueueFamilyIndices = devInfo.hasUniqueFamily()
-                                   ? nullptr
-                                   : devInfo.families;
-    createInfo.preTransform = devInfo.capabilities.currentTransform;
-    createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    createInfo.presentMode = devInfo.presentMode;
-    createInfo.clipped = VK_TRUE;
-    createInfo.oldSwapchain = VK_NULL_HANDLE;
-
-    VkResult vkRet = vkCreateSwapchainKHR(device, &createInfo, nullptr,
-                                          &vkSwapChain);
-    if (vkRet != VK_SUCCESS) {
-        printf("vkCreateSwapchainKHR failed with %d\n", vkRet);
-        return false;
+    vector<CachedSet>& bucket = cache[hash(layout, {}, view, sampler)];
+    for (const auto& entry : bucket) {
+        if (entry.layout == layout && entry.view == view
+         && entry.sampler == sampler) {
+            *set = entry.set;
+            return true;
+        }
     }
-    // Vulkan is allowed to create a bigger swap chain than requested so let's
-    // figure out the size
-    uint32_t size;
-    vkGetSwapchainImagesKHR(device, vkSwapChain, &size, nullptr);
 
-    swapChain.resize(size);
+    CachedSet entry;
+    entry.layout = layout;
+    entry.view = view;
+    entry.sampler = sampler;
+    if (!allocate(&cachedPools,
+                  VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT, layout,
+                  &entry.set, &entry.pool))
+        return false;
 
-    // Now get the images
-    VkImage images[size];
-    vkGetSwapchainImagesKHR(device, vkSwapChain, &size, images);
-    for (uint32_t i = 0; i < size; ++i) {
-        swapChain[i].image = images[i];
-    }
+    VkDescriptorImageInfo imageInfo = {};
+    imageInfo.sampler = sampler;
+    imageInfo.imageView = view;
+    // Where the textures are sampled from, see uploadTexture()
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = entry.set;
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &imageInfo;
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+    *set = entry.set;
+    bucket.push_back(move(entry));
+    return true;
+}
 
-    // Initialize the rest of the entries
-    for (auto& swpe : swapChain) {
-        // Image views
-        VkImageViewCreateInfo createInfo = {};
-        createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        createInfo.image = swpe.image;
-        createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        createInfo.format = devInfo.format.format;
+void DescriptorAllocator::forget(VkBuffer buffer)
+{
+    forgetIf([buffer](const CachedSet& entry) {
+        return any_of(entry.bindings.begin(), entry.bindings.end(),
+                      [buffer](const BufferBinding& b) {
+                          return b.buffer == buffer;
+                      });
+    });
+}
 
-        createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        createInfo.subresourceRange.baseMipLevel = 0;
-        createInfo.subresourceRange.levelCount = 1;
-        createInfo.subresourceRange.baseArrayLayer = 0;
-        createInfo.subresourceRange.layerCount = 1;
+void DescriptorAllocator::forget(VkImageView view)
+{
+    forgetIf([view](const CachedSet& entry) { return entry.view == view; });
+}
 
-        VkResult vkRet = vkCreateImageView(device, &createInfo, nullptr,
-                                           &swpe.view);
-        if (vkRet != VK_SUCCESS) {
-            printf("vkCreateImageView failed with %d\n", vkRet);
-            return false;
+template <typename Pred>
+void DescriptorAllocator::forgetIf(Pred uses)
+{
+    for (auto it = cache.begin(); it != cache.end();) {
+        vector<CachedSet>& bucket = it->second;
+        for (size_t i = 0; i < bucket.size();) {
+            if (uses(bucket[i])) {
+                vkFreeDescriptorSets(device, bucket[i].pool, 1,
+                                     &bucket[i].set);
+                bucket[i] = move(bucket.back());
+                bucket.pop_back();
+            }
+            else {
+                ++i;
+            }
         }
+        if (bucket.empty())
+            it = cache.erase(it);
+        else
+            ++it;
+    }
+    // Freed sets make room anywhere, try every pool again
+    cachedPools.current = 0;
+}
 
-        // Synchronization apparatus
-        VkSemaphoreCreateInfo semaphoreInfo = {};
-        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-        vkRet = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-                                  &swpe.imageAvailableSem);
-        if (vkRet != VK_SUCCESS) {
-            printf("vkCreateSemaphore failed with %d\n", vkRet);
-            return false;
-        }
-        vkRet = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-                                  &swpe.renderFinishedSem);
-        if (vkRet != VK_SUCCESS) {
-            printf("vkCreateSemaphore failed with %d\n", vkRet);
+bool DescriptorAllocator::createPool(PoolList *list,
+                                     VkDescriptorPoolCreateFlags flags)
+{
+    // Generous ratios, pools are cheap compared to running out
+    const uint32_t maxSets = list->nextMaxSets;
+    const VkDescriptorPoolSize sizes[] = {
+        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, maxSets},
+        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, maxSets},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * maxSets},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, maxSets},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 * maxSets},
+    };
+    VkDescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.flags = flags;
+    poolInfo.maxSets = maxSets;
+    poolInfo.poolSizeCount = sizeof(sizes) / sizeof(sizes[0]);
+    poolInfo.pPoolSizes = sizes;
+    VkDescriptorPool pool;
+    VkResult vkRet = vkCreateDescriptorPool(device, &poolInfo, nullptr, &pool);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateDescriptorPool failed with %d\n", vkRet);
+        return false;
+    }
+    list->pools.push_back(pool);
+    list->nextMaxSets = min(2 * maxSets, 4096U);
+    return true;
+}
+
+bool DescriptorAllocator::allocate(PoolList *list,
+                                   VkDescriptorPoolCreateFlags flags,
+                                   VkDescriptorSetLayout layout,
+                                   VkDescriptorSet *set,
+                                   VkDescriptorPool *pool)
+{
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &layout;
+    for (;;) {
+        const bool fresh = list->current == list->pools.size();
+        if (fresh && !createPool(list, flags))
             return false;
+        allocInfo.descriptorPool = list->pools[list->current];
+        VkResult vkRet = vkAllocateDescriptorSets(device, &allocInfo, set);
+        if (vkRet == VK_SUCCESS) {
+            *pool = allocInfo.descriptorPool;
+            return true;
         }
-
-        VkFenceCreateInfo fenceCreateInfo = {};
-        fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-        vkRet = vkCreateFence(device, &fenceCreateInfo, nullptr, &swpe.fence);
-        if (vkRet != VK_SUCCESS) {
-            printf("vkCreateFence failed with %d\n", vkRet);
+        // Out of pool memory or fragmented: move on to the next pool.  A
+        // brand new one failing means the layout can never fit.
+        if (fresh || vkRet == VK_ERROR_OUT_OF_HOST_MEMORY
+         || vkRet == VK_ERROR_OUT_OF_DEVICE_MEMORY) {
+            printf("vkAllocateDescriptorSets failed with %d\n", vkRet);
             return false;
         }
+        ++list->current;
+    }
+}
 
-        // MSAA init
-#ifdef MSAA
-        VkImageCreateInfo info = {};
-        info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-        info.imageType = VK_IMAGE_TYPE_2D;
-        info.format = devInfo.format.format;
-        info.extent.width = devInfo.extent.width;
-        info.extent.height = devInfo.extent.height;
-        info.extent.depth = 1;
-        info.mipLevels = 1;
-        info.arrayLayers = 1;
-        info.samples = VK_SAMPLE_COUNT_4_BIT;
-        info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-        info.tiling = VK_IMAGE_TILING_OPTIMAL;
-        // This image will only be used as a transient render target.  Its
-        // purpose is only to hold the multisampled data before resolving the
-        // render pass.
-        info.usage = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
-                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-        info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        // Create texture.
-        vkRet = vkCreateImage(device, &info, nullptr, &swpe.msaaImage);
-        if (vkRet != VK_SUCCESS) {
-            printf("vkCreateImage failed with %d\n", vkRet);
-            return false;
+uint64_t DescriptorAllocator::hash(VkDescriptorSetLayout layout,
+                                   const vector<BufferBinding>& bindings,
+                                   VkImageView view, VkSampler sampler)
+{
+    // FNV-1a over the handles and ranges
+    uint64_t h = 14695981039346656037ULL;
+    auto mix = [&h](uint64_t v) {
+        for (int i = 0; i < 8; ++i) {
+            h ^= (v >> (8 * i)) & 0xff;
+            h *= 1099511628211ULL;
         }
+    };
+    mix((uint64_t) layout);
+    for (const auto& b : bindings) {
+        mix(b.type);
+        mix((uint64_t) b.buffer);
+        mix(b.offset);
+        mix(b.range);
+    }
+    mix((uint64_t) view);
+    mix((uint64_t) sampler);
+    return h;
+}
 
-        VkMemoryRequirements memReqs;
-        vkGetImageMemoryRequirements(device, swpe.msaaImage, &memReqs);
+// Semaphores of a queue submission.  Timeline semaphores come with the
+// value to wait for or to signal, binary ones with 0; the values are only
+// chained to the submission when there is a timeline semaphore among them.
+struct SubmitSync {
+    vector<VkSemaphore> waits;
+    vector<VkPipelineStageFlags> waitStages;
+    vector<uint64_t> waitValues;
+    vector<VkSemaphore> signals;
+    vector<uint64_t> signalValues;
+    bool hasTimeline = false;
+#ifdef VK_KHR_timeline_semaphore
+    VkTimelineSemaphoreSubmitInfoKHR timelineInfo;
+#endif
 
-        VkPhysicalDeviceMemoryProperties memProps;
-        vkGetPhysicalDeviceMemoryProperties(devInfo.device, &memProps);
+    void wait(VkSemaphore sem, VkPipelineStageFlags stage, uint64_t value = 0);
+    void signal(VkSemaphore sem, uint64_t value = 0);
+    // The submission points into this afterwards
+    void apply(VkSubmitInfo *submitInfo);
+};
 
-        uint32_t memTypeIndex = 0;
-        for (unsigned j = 0; j < memProps.memoryTypeCount; ++j) {
-            if (memReqs.memoryTypeBits & (1U << j)) {
-                if (memProps.memoryTypes[j].propertyFlags &
-                                 VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) {
-                    memTypeIndex = j;
-                    break;
-                }
-            }
-        }
+void SubmitSync::wait(VkSemaphore sem, VkPipelineStageFlags stage,
+                      uint64_t value)
+{
+    waits.push_back(sem);
+    waitStages.push_back(stage);
+    waitValues.push_back(value);
+    hasTimeline = hasTimeline || value != 0;
+}
 
-        VkMemoryAllocateInfo alloc = { };
-        alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        alloc.allocationSize = memReqs.size;
-        // For multisampled attachments, we will want to use LAZILY
-        // allocated if such a type is available.
-        alloc.memoryTypeIndex = memTypeIndex;
-        vkRet = vkAllocateMemory(device, &alloc, nullptr, &swpe.msaaMemory);
+void SubmitSync::signal(VkSemaphore sem, uint64_t value)
+{
+    signals.push_back(sem);
+    signalValues.push_back(value);
+    hasTimeline = hasTimeline || value != 0;
+}
 
-        if (vkRet != VK_SUCCESS) {
-            printf("vkAllocateMemory failed with %d\n", vkRet);
-            return false;
-        }
-        vkBindImageMemory(device, swpe.msaaImage, swpe.msaaMemory, 0);
-
-        VkImageViewCreateInfo viewInfo = { };
-        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        viewInfo.image = swpe.msaaImage;
-        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        viewInfo.format = devInfo.format.format;
-        viewInfo.components.r = VK_COMPONENT_SWIZZLE_R;
-        viewInfo.components.g = VK_COMPONENT_SWIZZLE_G;
-        viewInfo.components.b = VK_COMPONENT_SWIZZLE_B;
-        viewInfo.components.a = VK_COMPONENT_SWIZZLE_A;
-        viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        viewInfo.subresourceRange.levelCount = 1;
-        viewInfo.subresourceRange.layerCount = 1;
-
-        vkRet = vkCreateImageView(device, &viewInfo, nullptr, &swpe.msaaView);
-        if (vkRet != VK_SUCCESS) {
-            printf("vkCreateImageView failed with %d\n", vkRet);
-            return false;
-        }
+void SubmitSync::apply(VkSubmitInfo *submitInfo)
+{
+    submitInfo->waitSemaphoreCount = waits.size();
+    submitInfo->pWaitSemaphores = waits.data();
+    submitInfo->pWaitDstStageMask = waitStages.data();
+    submitInfo->signalSemaphoreCount = signals.size();
+    submitInfo->pSignalSemaphores = signals.data();
+#ifdef VK_KHR_timeline_semaphore
+    if (!hasTimeline)
+        return;
+    timelineInfo = {};
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+    timelineInfo.waitSemaphoreValueCount = waitValues.size();
+    timelineInfo.pWaitSemaphoreValues = waitValues.data();
+    timelineInfo.signalSemaphoreValueCount = signalValues.size();
+    timelineInfo.pSignalSemaphoreValues = signalValues.data();
+    submitInfo->pNext = &timelineInfo;
 #endif
-    }
-    return true;
 }
 
-bool VulkanApp::loadShaders() {
-    vector<char> shader;
-    if (!readFile(&shader, "vertex.spv")) {
-        printf("Could not read vertex.spv\n");
-        return false;
-    }
+// Fixed set of worker threads.  Jobs are run on every worker at once, each
+// worker being handed its index so that it can use the resources it owns
+// (command pools cannot be shared between threads).
+class JobSystem
+{
+  public:
+    ~JobSystem() { stop(); }
 
-    VkShaderModuleCreateInfo createInfo = {};
-    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    createInfo.codeSize = shader.size();
-    createInfo.pCode = (uint32_t *) shader.data();
+    void start(uint32_t threadCount);
+    void stop();
+    uint32_t size() const { return threads.size(); }
+    // Calls fn(worker) on every worker and waits for all of them
+    void runOnAll(const function<void(uint32_t)>& fn);
 
-    VkResult vkRet;
-    vkRet = vkCreateShaderModule(device, &createInfo, nullptr, &vertexShader);
-    if (vkRet != VK_SUCCESS) {
-        printf("vkCreateShaderModule failed with %d\n", vkRet);
-        return false;
-    }
-    if (!readFile(&shader, "fragment.spv")) {
-        printf("Could not read fragment.spv\n");
-        return false;
+  private:
+    void workerLoop(uint32_t index);
+
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(uint32_t)> *job = nullptr;
+    uint64_t generation = 0;
+    uint32_t remaining = 0;
+    bool quit = false;
+};
+
+void JobSystem::start(uint32_t threadCount)
+{
+    for (uint32_t i = 0; i < threadCount; ++i)
+        threads.emplace_back(&JobSystem::workerLoop, this, i);
+}
+
+void JobSystem::stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        quit = true;
     }
-    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    createInfo.codeSize = shader.size();
-    createInfo.pCode = (uint32_t *) shader.data();
+    wake.notify_all();
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+    quit = false;
+}
 
-    vkRet = vkCreateShaderModule(device, &createInfo, nullptr, &fragShader);
-    if (vkRet != VK_SUCCESS) {
-        printf("vkCreateShaderModule failed with %d\n", vkRet);
-        return false;
+void JobSystem::runOnAll(const function<void(uint32_t)>& fn)
+{
+    unique_lock<mutex> guard(lock);
+    job = &fn;
+    remaining = threads.size();
+    ++generation;
+    wake.notify_all();
+    done.wait(guard, [this]() { return remaining == 0; });
+    job = nullptr;
+}
+
+void JobSystem::workerLoop(uint32_t index)
+{
+    uint64_t seen = 0;
+    unique_lock<mutex> guard(lock);
+    while (1) {
+        wake.wait(guard, [&]() { return quit || generation != seen; });
+        if (quit)
+            return;
+        seen = generation;
+        const function<void(uint32_t)> *fn = job;
+        guard.unlock();
+        (*fn)(index);
+        guard.lock();
+        if (--remaining == 0)
+            done.notify_one();
     }
-    return true;
 }
 
-bool VulkanApp::createRenderPass()
+// Background pipeline compilation.  Jobs are queued and run on worker
+// threads; the caller gets a ticket to poll or wait for the pipeline.
+// Pipeline creation is thread safe in Vulkan and the pipeline cache is
+// internally synchronized, so all the workers can feed the same cache.
+class PipelineCompiler
 {
-    // MSAA attachment
-    // from https://arm-software.github.io/vulkan-sdk/multisampling.html
-    VkAttachmentDescription attachments[2];
-    memset(attachments, 0, sizeof(attachments));
-    attachments[0].format = devInfo.format.format;
-    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-#ifdef MSAA
-    attachments[0].samples = VK_SAMPLE_COUNT_4_BIT;
-    // Don't write to memory, we just want to compute
-    attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
- #else
-    attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
-    attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-#endif
-    attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-#ifdef MSAA
-    // this does not go to the presentation
-    attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-#else
-    attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-#endif
+  public:
+    typedef uint64_t Ticket;
 
-#ifdef MSAA
-    attachments[1].format = devInfo.format.format;
-    attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
-    attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    attachments[1].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-#endif
+    ~PipelineCompiler() { stop(); }
 
+    void start(uint32_t threadCount);
+    // Jobs still queued are dropped, their result is VK_NULL_HANDLE
+    void stop();
+    // build runs on a worker: it must only use objects outliving the job
+    Ticket submit(function<VkPipeline()> build);
+    // Non blocking, true and *pipeline set once the job has run.  The
+    // ticket is consumed then.
+    bool poll(Ticket ticket, VkPipeline *pipeline);
+    VkPipeline wait(Ticket ticket);
 
-    VkAttachmentReference colorRef = {};
-    colorRef.attachment = 0;
-    colorRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  private:
+    struct Job {
+        Ticket ticket;
+        function<VkPipeline()> build;
+    };
+    void workerLoop();
+
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    deque<Job> queue;
+    map<Ticket, VkPipeline> results;
+    Ticket nextTicket = 1;
+    bool quit = false;
+};
 
-    VkAttachmentReference resolveRef = {};
-    resolveRef.attachment = 1;
-    resolveRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+void PipelineCompiler::start(uint32_t threadCount)
+{
+    for (uint32_t i = 0; i < max(threadCount, 1U); ++i)
+        threads.emplace_back(&PipelineCompiler::workerLoop, this);
+}
 
-    // The color attachment is referenced by
-    // 'layout (location = 0) out vec4 outColor' in the frag shader
-    VkSubpassDescription subpass = {};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = 1;
-    subpass.pColorAttachments = &colorRef;
-#ifdef MSAA
-    subpass.pResolveAttachments = &resolveRef;
-#else
-    subpass.pResolveAttachments = nullptr;
-#endif
+void PipelineCompiler::stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        quit = true;
+        for (auto& job : queue)
+            results[job.ticket] = VK_NULL_HANDLE;
+        queue.clear();
+    }
+    wake.notify_all();
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+    quit = false;
+    done.notify_all();
+}
 
-    VkRenderPassCreateInfo renderPassInfo = {};
-    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-#ifdef MSAA
-    renderPassInfo.attachmentCount = 2;
+PipelineCompiler::Ticket PipelineCompiler::submit(
+                                              function<VkPipeline()> build)
+{
+    lock_guard<mutex> guard(lock);
+    const Ticket ticket = nextTicket++;
+    queue.push_back({ticket, move(build)});
+    wake.notify_one();
+    return ticket;
+}
+
+bool PipelineCompiler::poll(Ticket ticket, VkPipeline *pipeline)
+{
+    lock_guard<mutex> guard(lock);
+    auto it = results.find(ticket);
+    if (it == results.end())
+        return false;
+    *pipeline = it->second;
+    results.erase(it);
+    return true;
+}
+
+VkPipeline PipelineCompiler::wait(Ticket ticket)
+{
+    unique_lock<mutex> guard(lock);
+    done.wait(guard, [&]() { return results.count(ticket) != 0; });
+    const VkPipeline pipeline = results[ticket];
+    results.erase(ticket);
+    return pipeline;
+}
+
+void PipelineCompiler::workerLoop()
+{
+    unique_lock<mutex> guard(lock);
+    while (1) {
+        wake.wait(guard, [this]() { return quit || !queue.empty(); });
+        if (quit)
+            return;
+        Job job = move(queue.front());
+        queue.pop_front();
+        guard.unlock();
+        const VkPipeline pipeline = job.build();
+        guard.lock();
+        results[job.ticket] = pipeline;
+        done.notify_all();
+    }
+}
+
+// Watches the GLSL sources for changes and recompiles them with glslc on a
+// background thread.  The SPIR-V of every shader that compiled is handed
+// over through takeUpdates(), compilation errors are just printed.
+class ShaderWatcher
+{
+  public:
+    enum Stage {
+        VERTEX,
+        FRAGMENT,
+        STAGE_COUNT
+    };
+    struct Update {
+        Stage stage;
+        vector<uint32_t> code;
+    };
+
+    ~ShaderWatcher() { stop(); }
+
+    void start(const string& dir, const string& compiler);
+    void stop();
+    bool running() const { return watcher.joinable(); }
+    vector<Update> takeUpdates();
+
+  private:
+    struct Source {
+        const char *file;
+        const char *stage;
+        timespec mtime = {};
+        off_t size = 0;
+    };
+    void watchLoop();
+    bool changed(Source *source) const;
+    bool compile(const Source& source, vector<uint32_t> *code) const;
+
+    string dir;
+    string compiler;
+    Source sources[STAGE_COUNT] = {{"vertex.glsl", "vertex"},
+                                   {"fragment.glsl", "fragment"}};
+    thread watcher;
+    mutex lock;
+    condition_variable wake;
+    bool quit = false;
+    vector<Update> updates;
+};
+
+void ShaderWatcher::start(const string& watchDir, const string& glslc)
+{
+    dir = watchDir;
+    compiler = glslc;
+    // Only changes from now on trigger a reload
+    for (auto& source : sources)
+        changed(&source);
+    quit = false;
+    watcher = thread(&ShaderWatcher::watchLoop, this);
+    printf("Watching %s/{vertex,fragment}.glsl\n", dir.c_str());
+}
+
+void ShaderWatcher::stop()
+{
+    if (!watcher.joinable())
+        return;
+    {
+        lock_guard<mutex> guard(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    watcher.join();
+}
+
+vector<ShaderWatcher::Update> ShaderWatcher::takeUpdates()
+{
+    lock_guard<mutex> guard(lock);
+    vector<Update> ret;
+    ret.swap(updates);
+    return ret;
+}
+
+bool ShaderWatcher::changed(Source *source) const
+{
+    // Size too, in case the file system only keeps seconds
+    struct stat st;
+    if (stat((dir + "/" + source->file).c_str(), &st) != 0)
+        return false;
+#ifdef __APPLE__
+    const timespec& mtime = st.st_mtimespec;
 #else
-    renderPassInfo.attachmentCount = 1;
+    const timespec& mtime = st.st_mtim;
 #endif
-    renderPassInfo.pAttachments = attachments;
-    renderPassInfo.subpassCount = 1;
-    renderPassInfo.pSubpasses = &subpass;
+    if (mtime.tv_sec == source->mtime.tv_sec
+     && mtime.tv_nsec == source->mtime.tv_nsec && st.st_size == source->size)
+        return false;
+    source->mtime = mtime;
+    source->size = st.st_size;
+    return true;
+}
 
-    VkSubpassDependency dependency = {};
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
-                               VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+bool ShaderWatcher::compile(const Source& source,
+                            vector<uint32_t> *code) const
+{
+    char output[] = "/tmp/vulkantest-XXXXXX";
+    const int fd = mkstemp(output);
+    if (fd < 0)
+        return false;
+    close(fd);
+
+    // No shell in between, so paths can hold any character.  Spawned
+    // rather than forked: other threads may hold locks the child would need
+    // before exec.
+    const string stage = string("-fshader-stage=") + source.stage;
+    const string path = dir + "/" + source.file;
+    const char *argv[] = {compiler.c_str(), stage.c_str(), "-o", output,
+                          path.c_str(), nullptr};
+    pid_t pid;
+    int status = 0;
+    bool ok = posix_spawnp(&pid, argv[0], nullptr, nullptr,
+                           const_cast<char **>(argv), environ) == 0
+           && waitpid(pid, &status, 0) == pid
+           && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (ok) {
+        FILE *f = fopen(output, "rb");
+        struct stat st;
+        ok = f && fstat(fileno(f), &st) == 0 && st.st_size > 0
+          && st.st_size % sizeof(uint32_t) == 0;
+        if (ok) {
+            code->resize(st.st_size / sizeof(uint32_t));
+            ok = fread(code->data(), st.st_size, 1, f) == 1;
+        }
+        if (f)
+            fclose(f);
+    }
+    unlink(output);
+    return ok;
+}
 
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
+void ShaderWatcher::watchLoop()
+{
+    unique_lock<mutex> guard(lock);
+    while (!quit) {
+        wake.wait_for(guard, chrono::milliseconds(250));
+        if (quit)
+            break;
+        guard.unlock();
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            if (!changed(&sources[i]))
+                continue;
+            Update update;
+            update.stage = (Stage) i;
+            if (!compile(sources[i], &update.code)) {
+                printf("Failed to compile %s, keeping the old shader\n",
+                       sources[i].file);
+                continue;
+            }
+            printf("Recompiled %s\n", sources[i].file);
+            lock_guard<mutex> updateGuard(lock);
+            updates.push_back(move(update));
+        }
+        guard.lock();
+    }
+}
 
-    VkResult vkRet =  vkCreateRenderPass(device, &renderPassInfo, nullptr,
-                                         &renderPass);
-    if (vkRet != VK_SUCCESS) {
-        printf("vkCreateRenderPass failed with %d\n", vkRet);
+// Window events handed from the main thread, which only pumps the OS event
+// loop, to the render thread.  Single producer, single consumer ring: each
+// side owns one index and neither ever waits for the other.  Pushing fails
+// when the ring is full, the render thread drains it every frame so that
+// only happens when it is stalled.
+struct InputEvent {
+    enum Type { KEY, RESIZE, CLOSE };
+    Type type = KEY;
+    int key = 0;
+    int action = 0;
+    // Framebuffer size in pixels for RESIZE
+    int width = 0;
+    int height = 0;
+};
+
+class InputQueue
+{
+  public:
+    bool push(const InputEvent& event);
+    bool pop(InputEvent *event);
+
+  private:
+    // Power of two, indices wrap
+    static constexpr uint32_t capacity = 256;
+    InputEvent events[capacity];
+    // Written by the producer only
+    atomic<uint32_t> head{0};
+    // Written by the consumer only
+    atomic<uint32_t> tail{0};
+};
+
+bool InputQueue::push(const InputEvent& event)
+{
+    const uint32_t h = head.load(memory_order_relaxed);
+    if (h - tail.load(memory_order_acquire) == capacity)
         return false;
-    }
+    events[h % capacity] = event;
+    // Publishes the event
+    head.store(h + 1, memory_order_release);
     return true;
 }
-// Pipeline setup
 
-bool VulkanApp::createPipeline()
+bool InputQueue::pop(InputEvent *event)
 {
-    // Stader stages
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
-    vertShaderStageInfo.sType =
-                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vertShaderStageInfo.module = vertexShader;
-    vertShaderStageInfo.pName = "main";
+    const uint32_t t = tail.load(memory_order_relaxed);
+    if (t == head.load(memory_order_acquire))
+        return false;
+    *event = events[t % capacity];
+    // Hands the slot back to the producer
+    tail.store(t + 1, memory_order_release);
+    return true;
+}
 
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
-    fragShaderStageInfo.sType =
-                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fragShaderStageInfo.module = fragShader;
-    fragShaderStageInfo.pName = "main";
-    VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
-                                                      fragShaderStageInfo};
+// Wall clock time of the startup stages, reported once the first frame has
+// been submitted.  Side stages run on other threads, overlapping with the
+// main thread ones; they may record concurrently.
+class StartupProfile
+{
+  public:
+    using Clock = chrono::steady_clock;
 
-    // fixed function stages
-    // No vertices
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
-    vertexInputInfo.sType =
-                VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.vertexBindingDescriptionCount = 0;
-    vertexInputInfo.pVertexBindingDescriptions = nullptr;
-    vertexInputInfo.vertexAttributeDescriptionCount = 0;
-    vertexInputInfo.pVertexAttributeDescriptions = nullptr;
+    // Times the enclosing scope
+    class Stage
+    {
+      public:
+        Stage(StartupProfile& profile, const char *name, bool side = false)
+            : profile(profile), name(name), side(side), begin(Clock::now()) {}
+        ~Stage() { profile.record(name, begin, Clock::now(), side); }
+
+      private:
+        StartupProfile& profile;
+        const char *name;
+        bool side;
+        Clock::time_point begin;
+    };
 
-    // Using triangles
-    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
-    inputAssembly.sType =
-                   VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    inputAssembly.primitiveRestartEnable = VK_FALSE;
+    // False once reported: later compilations and such are not startup
+    bool record(const string& name, Clock::time_point begin,
+                Clock::time_point end, bool side);
+    // Only the first call prints
+    void report();
 
-    // View port
-    VkViewport viewport = {};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float) devInfo.extent.width;
-    viewport.height = (float) devInfo.extent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
+  private:
+    struct Entry {
+        string name;
+        double begin;
+        double duration;
+        bool side;
+    };
+    mutex lock;
+    const Clock::time_point launch = Clock::now();
+    vector<Entry> entries;
+    bool reported = false;
+};
 
-    VkRect2D scissor = {};
-    scissor.offset = {0, 0};
-    scissor.extent = devInfo.extent;
+bool StartupProfile::record(const string& name, Clock::time_point begin,
+                            Clock::time_point end, bool side)
+{
+    using ms = chrono::duration<double, milli>;
+    lock_guard<mutex> guard(lock);
+    if (reported)
+        return false;
+    entries.push_back({name, ms(begin - launch).count(),
+                       ms(end - begin).count(), side});
+    return true;
+}
 
-    VkPipelineViewportStateCreateInfo viewportState = {};
-    viewportState.sType =
-                         VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewportState.viewportCount = 1;
-    viewportState.pViewports = &viewport;
-    viewportState.scissorCount = 1;
-    viewportState.pScissors = &scissor;
+void StartupProfile::report()
+{
+    lock_guard<mutex> guard(lock);
+    if (reported)
+        return;
+    reported = true;
+    stable_sort(entries.begin(), entries.end(),
+                [](const Entry& a, const Entry& b) {
+        return a.begin < b.begin;
+    });
+    puts("Startup, ms since launch:");
+    for (const Entry& e : entries) {
+        printf("  %-24s %8.1f +%7.1f%s\n", e.name.c_str(), e.begin,
+               e.duration, e.side ? " (side)" : "");
+    }
+    printf("  %-24s %8.1f\n", "first frame submitted",
+           chrono::duration<double, milli>(Clock::now() - launch).count());
+}
 
-    // Rasterizer
-    VkPipelineRasterizationStateCreateInfo rasterizer = {};
-    rasterizer.sType =
-                    VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable = VK_FALSE;
-    rasterizer.rasterizerDiscardEnable = VK_FALSE;
-    // Try VK_POLYGON_MODE_LINE, VK_POLYGON_MODE_POINT
-    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
-    rasterizer.depthBiasEnable = VK_FALSE;
-    rasterizer.depthBiasConstantFactor = 0.0f;
-    rasterizer.depthBiasClamp = 0.0f;
-    rasterizer.depthBiasSlopeFactor = 0.0f;
+// Rolling frame timings.  Every sample is a frame whose GPU work has
+// completed; averages are over the last 'window' of them and the samples can
+// also be streamed to a CSV file.
+class FrameStats
+{
+  public:
+    // All durations in milliseconds
+    struct Sample {
+        uint64_t frame = 0;
+        double cpuFrame = 0.0;
+        // Frame pacing sleep before acquiring the image
+        double sleep = 0.0;
+        double acquire = 0.0;
+        // Command buffer recording, 0 for static command buffers
+        double record = 0.0;
+        double submit = 0.0;
+        double present = 0.0;
+        // Whole command buffer, then the render pass alone.  0 when the
+        // queue has no timestamp support.
+        double gpuFrame = 0.0;
+        double renderPass = 0.0;
+        // From the end of the pacing sleep, where input is sampled, to the
+        // GPU writing the frame's last timestamp, on the CPU clock.  The
+        // image is ready for presentation then.  0 without timestamps.
+        double latency = 0.0;
+    };
 
-    // MSAA
-#ifdef MSAA
-    VkPipelineMultisampleStateCreateInfo multisampling = {};
-    multisampling.sType =
-                      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable = VK_FALSE;
-    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_4_BIT;
-    multisampling.minSampleShading = 1.0f;
-    multisampling.pSampleMask = nullptr;
-    multisampling.alphaToCoverageEnable = VK_FALSE;
-    multisampling.alphaToOneEnable = VK_FALSE;
+    static constexpr size_t window = 128;
+
+    ~FrameStats() { closeCsv(); }
+
+    bool openCsv(const char *path);
+    void closeCsv();
+    // Keep every sample from frame firstFrame on, for percentiles
+    void recordHistory(uint64_t firstFrame) { historyStart = firstFrame; }
+    void add(const Sample& sample);
+    Sample average() const;
+    size_t size() const { return count; }
+    void print() const;
+    // Percentiles of the recorded history and throughput over 'seconds'
+    void printSummary(double seconds) const;
+
+  private:
+    static double percentile(vector<double> values, double p);
+
+    Sample samples[window];
+    size_t count = 0;
+    size_t next = 0;
+    FILE *csv = nullptr;
+    uint64_t historyStart = UINT64_MAX;
+    vector<Sample> history;
+};
+
+bool FrameStats::openCsv(const char *path)
+{
+    csv = fopen(path, "w");
+    if (!csv) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+    fprintf(csv, "frame,cpu_frame_ms,sleep_ms,acquire_ms,record_ms,submit_ms,"
+                 "present_ms,gpu_frame_ms,render_pass_ms,latency_ms\n");
+    return true;
+}
+
+void FrameStats::closeCsv()
+{
+    if (csv)
+        fclose(csv);
+    csv = nullptr;
+}
+
+void FrameStats::add(const Sample& sample)
+{
+    samples[next] = sample;
+    next = (next + 1) % window;
+    count = min(count + 1, window);
+    if (sample.frame >= historyStart)
+        history.push_back(sample);
+    if (csv) {
+        fprintf(csv, "%llu,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+                (unsigned long long) sample.frame, sample.cpuFrame,
+                sample.sleep, sample.acquire, sample.record, sample.submit,
+                sample.present, sample.gpuFrame, sample.renderPass,
+                sample.latency);
+    }
+}
+
+FrameStats::Sample FrameStats::average() const
+{
+    Sample avg;
+    if (count == 0)
+        return avg;
+    for (size_t i = 0; i < count; ++i) {
+        const Sample& s = samples[i];
+        avg.frame = max(avg.frame, s.frame);
+        avg.cpuFrame += s.cpuFrame;
+        avg.sleep += s.sleep;
+        avg.acquire += s.acquire;
+        avg.record += s.record;
+        avg.submit += s.submit;
+        avg.present += s.present;
+        avg.gpuFrame += s.gpuFrame;
+        avg.renderPass += s.renderPass;
+        avg.latency += s.latency;
+    }
+    avg.cpuFrame /= count;
+    avg.sleep /= count;
+    avg.acquire /= count;
+    avg.record /= count;
+    avg.submit /= count;
+    avg.present /= count;
+    avg.gpuFrame /= count;
+    avg.renderPass /= count;
+    avg.latency /= count;
+    return avg;
+}
+
+void FrameStats::print() const
+{
+    const Sample avg = average();
+    printf("frame %llu: cpu %.3fms (sleep %.3f acquire %.3f record %.3f "
+           "submit %.3f present %.3f) gpu %.3fms (render pass %.3f) "
+           "latency %.3fms\n",
+           (unsigned long long) avg.frame, avg.cpuFrame, avg.sleep,
+           avg.acquire, avg.record, avg.submit, avg.present, avg.gpuFrame,
+           avg.renderPass, avg.latency);
+}
+
+double FrameStats::percentile(vector<double> values, double p)
+{
+    // Nearest rank
+    if (values.empty())
+        return 0.0;
+    sort(values.begin(), values.end());
+    const size_t rank = (size_t) ceil(p / 100.0 * values.size());
+    return values[min(values.size(), max<size_t>(rank, 1)) - 1];
+}
+
+void FrameStats::printSummary(double seconds) const
+{
+    vector<double> cpu, record, gpu, renderPass, latency;
+    for (const Sample& s : history) {
+        cpu.push_back(s.cpuFrame);
+        record.push_back(s.record);
+        latency.push_back(s.latency);
+        gpu.push_back(s.gpuFrame);
+        renderPass.push_back(s.renderPass);
+    }
+    printf("%zu frames in %.3fs: %.1f frames/s\n", history.size(), seconds,
+           seconds > 0.0 ? history.size() / seconds : 0.0);
+    printf("            p50       p95       p99\n");
+    printf("cpu    %8.3fms %8.3fms %8.3fms\n", percentile(cpu, 50),
+           percentile(cpu, 95), percentile(cpu, 99));
+    printf("record %8.3fms %8.3fms %8.3fms\n", percentile(record, 50),
+           percentile(record, 95), percentile(record, 99));
+    printf("gpu    %8.3fms %8.3fms %8.3fms\n", percentile(gpu, 50),
+           percentile(gpu, 95), percentile(gpu, 99));
+    printf("pass   %8.3fms %8.3fms %8.3fms\n", percentile(renderPass, 50),
+           percentile(renderPass, 95), percentile(renderPass, 99));
+    printf("latency%8.3fms %8.3fms %8.3fms\n", percentile(latency, 50),
+           percentile(latency, 95), percentile(latency, 99));
+}
+
+class VulkanApp
+{
+    // What the present mode and frame pacing optimize for
+    enum PresentPolicy {
+        // Mailbox, immediate as a fallback: never wait for vblank
+        PRESENT_LOW_LATENCY,
+        // Fifo, no tearing and no frame rendered just to be dropped
+        PRESENT_VSYNC,
+        // Fifo capped at powerSavingFps unless there is an explicit cap
+        PRESENT_POWER_SAVING,
+        PRESENT_POLICY_COUNT
+    };
+    static const char *presentPolicyName(PresentPolicy policy) {
+        static const char *names[PRESENT_POLICY_COUNT] = {
+            "low-latency", "vsync", "power-saving"
+        };
+        return names[policy];
+    }
+    static constexpr double powerSavingFps = 30.0;
+
+    // Runtime settings, from the command line
+    struct Settings {
+        // Index or part of the name of the device to use instead of the
+        // best scoring one, also read from $VULKANTEST_DEVICE
+        const char *device = nullptr;
+        // Requested MSAA sample count, clamped to what the device supports
+        uint32_t msaaSamples = 4;
+        // One stream with every attribute or one stream per attribute
+        bool splitVertexStreams = false;
+        // The triangle is subdivided into meshDetail^2 triangles
+        uint32_t meshDetail = 1;
+        // Copies of the mesh, all drawn by a single instanced draw
+        uint32_t instanceCount = 1;
+        // The instances are split into that many draws
+        uint32_t drawCount = 1;
+        // Animate the instances with a compute pass every frame
+        bool simulate = false;
+        // Cull the instances on the GPU and draw them with an indirect draw
+        // instead of drawList
+        bool gpuDriven = false;
+        // KTX2 files sampled by the draws, round robin.  A white texel
+        // when there are none.
+        vector<const char *> textures;
+        // Device memory the texture mips may use, in MB
+        uint32_t textureBudget = 64;
+        // Threads recording secondary command buffers, 0 to record
+        // everything inline on the main thread
+        uint32_t recordThreads = 0;
+        // Re-record the command buffers every frame instead of recording
+        // them once per swap chain image
+        bool dynamicRecording = false;
+        // Timeline semaphores for the frame synchronization when the device
+        // has them, fences and binary semaphores otherwise
+        bool timelineSync = true;
+        // Pipeline compilation threads
+        uint32_t compileThreads = 2;
+        // Load vertex.spv and fragment.spv from there instead of using the
+        // embedded shaders
+        const char *shaderDir = nullptr;
+        // Reload the shaders when the GLSL sources in there change
+        const char *watchDir = nullptr;
+        PresentPolicy presentPolicy = PRESENT_LOW_LATENCY;
+        // GPU frame time the render scale is adjusted to, in ms, 0 to always
+        // render at the window size
+        double dynamicResolution = 0.0;
+        // Lowest render scale dynamic resolution may go down to
+        float minRenderScale = 0.5f;
+        // CPU side frame rate limit, 0 for none
+        double fpsCap = 0.0;
+        // Print the rolling frame stats every statsInterval seconds, 0 to
+        // disable
+        double statsInterval = 0.0;
+        const char *statsCsv = nullptr;
+        // Render to offscreen images, without window nor surface
+        bool headless = false;
+        // Load the validation layers, debug builds only
+        bool validation = false;
+        // Stop after benchFrames frames or benchSeconds seconds, not
+        // counting the warmup frames, and report frame time percentiles
+        uint32_t benchFrames = 0;
+        double benchSeconds = 0.0;
+        uint32_t warmupFrames = 10;
+        bool benchmark() const {
+            return benchFrames > 0 || benchSeconds > 0.0;
+        }
+    } settings;
+    // Window size, and size of the offscreen images when headless
+    static constexpr uint32_t defaultWidth = 800;
+    static constexpr uint32_t defaultHeight = 600;
+
+    GLFWwindow *window = nullptr;
+    VkInstance instance;
+    // Debug builds (make vulkantest-debug) name the Vulkan objects and label
+    // the passes through VK_EXT_debug_utils, so that RenderDoc or Nsight
+    // captures read like the code, and load the validation layers with
+    // --validation.  Release builds have none of it: no extension, no
+    // layer, no calls.
+#ifdef VULKANTEST_DEBUG
+    // Entry points of VK_EXT_debug_utils, null when the instance doesn't
+    // have it
+    struct DebugUtils {
+        PFN_vkCreateDebugUtilsMessengerEXT createMessenger = nullptr;
+        PFN_vkDestroyDebugUtilsMessengerEXT destroyMessenger = nullptr;
+        PFN_vkSetDebugUtilsObjectNameEXT setObjectName = nullptr;
+        PFN_vkCmdBeginDebugUtilsLabelEXT beginLabel = nullptr;
+        PFN_vkCmdEndDebugUtilsLabelEXT endLabel = nullptr;
+        VkDebugUtilsMessengerEXT messenger = VK_NULL_HANDLE;
+    } debugUtils;
+    // Enabled on the instance, and on the device for older loaders
+    vector<const char *> layers;
 #endif
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
 
-    // Stencil/depth buffer
-    // Use VkPipelineDepthStencilStateCreateInfo
+    struct PhysicalDeviceInfo {
+        VkPhysicalDevice device = VK_NULL_HANDLE;
+        VkPhysicalDeviceProperties properties;
+        VkPhysicalDeviceFeatures deviceFeatures;
+        VkSurfaceCapabilitiesKHR capabilities;
 
-    // Color blending
-    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
-    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
-                                          VK_COLOR_COMPONENT_G_BIT |
-                                          VK_COLOR_COMPONENT_B_BIT |
-                                          VK_COLOR_COMPONENT_A_BIT;
-    // no alpha blending
-    colorBlendAttachment.blendEnable = VK_FALSE;
-    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
-    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+        // idx 0 is graphics, 1 is presentation
+        uint32_t families[2];
+        // Dedicated transfer family if the device has one, otherwise the
+        // graphics family
+        uint32_t transferFamily;
+        // Same for compute
+        uint32_t computeFamily;
+        // Of the graphics family, 0 when it can't write timestamps
+        uint32_t timestampValidBits;
+        // VK_KHR_timeline_semaphore, extension and feature, when the
+        // headers know about it
+        bool hasTimelineSemaphore = false;
+
+        // color depth
+        VkSurfaceFormatKHR format;
+        VkFormat depthFormat;
+        // how we display images
+        VkPresentModeKHR presentMode;
+        vector<VkPresentModeKHR> presentModes;
+        VkExtent2D extent;
+        uint32_t imageCount;
+
+        bool hasUniqueFamily() const {
+            return families[0] == families[1];
+        }
+        bool hasTransferFamily() const {
+            return transferFamily != families[0];
+        }
+        bool hasComputeFamily() const {
+            return computeFamily != families[0];
+        }
+    } devInfo;
+    VkDevice device;
+    DeviceAllocator allocator;
+    DescriptorAllocator descriptors;
+    VkQueue presentationQueue;
+    VkQueue graphicsQueue;
+    VkQueue transferQueue;
+    VkQueue computeQueue;
+
+    // Uploads are staged in a persistently mapped ring buffer and copied on
+    // the transfer queue (the graphics one when there is no dedicated
+    // transfer family).  Each flush is a batch signaling a semaphore that
+    // the next graphics submission waits on, so nothing ever blocks the
+    // graphics queue.
+    struct UploadBatch {
+        VkCommandBuffer cmd = VK_NULL_HANDLE;
+        // Without timeline semaphores
+        VkFence fence = VK_NULL_HANDLE;
+        VkSemaphore doneSem = VK_NULL_HANDLE;
+        // Otherwise the value it signals on timeline.uploads
+        uint64_t value = 0;
+        // Staging bytes to release once the batch has executed
+        VkDeviceSize stagingBytes = 0;
+        // Frame that waited on doneSem: the semaphore can only be reused
+        // once that frame has completed
+        uint64_t waitFrame = 0;
+    };
+    struct StagingRing {
+        static constexpr VkDeviceSize size = 16 * 1024 * 1024;
+        VkBuffer buffer = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation memory;
+        VkDeviceSize head = 0;
+        VkDeviceSize used = 0;
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        // Batch being recorded, if cmd is set
+        UploadBatch recording;
+        // Submitted, oldest first
+        deque<UploadBatch> inFlight;
+        vector<UploadBatch> freeBatches;
+        // Semaphores for the next graphics submission to wait on, or the
+        // upload timeline value (0 for none)
+        vector<VkSemaphore> pendingWaits;
+        uint64_t pendingValue = 0;
+        vector<UploadBatch *> pendingBatches;
+    } staging;
+
+    struct MappedFile {
+        void *data = nullptr;
+        size_t size = 0;
+    };
+    // Textures are streamed from memory mapped KTX2 files.  Only a
+    // contiguous tail of the mip chain is resident, in an image holding
+    // just those levels: streaming a finer level in or evicting one
+    // replaces the image.  The coarsest level is there from the start so
+    // that there always is something to sample.
+    struct TextureLevel {
+        // Offset in the file and size of the level
+        VkDeviceSize offset;
+        VkDeviceSize size;
+        uint32_t width;
+        uint32_t height;
+        // Last frame that wanted it resident, for the LRU eviction
+        uint64_t lastUsed = 0;
+    };
+    struct Texture {
+        const char *name;
+        // Unmapped if data is the built in texture
+        MappedFile file;
+        const char *data = nullptr;
+        VkFormat format;
+        // Texel block dimensions and size, 1x1 for uncompressed formats
+        uint32_t blockWidth;
+        uint32_t blockHeight;
+        uint32_t blockBytes;
+        vector<TextureLevel> levels;
+        // Finest resident level
+        uint32_t residentBase;
+        VkDeviceSize residentBytes = 0;
+        VkImage image = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation memory;
+        VkImageView view = VK_NULL_HANDLE;
+        VkDescriptorSet set = VK_NULL_HANDLE;
+    };
+    struct TextureStreamer {
+        vector<Texture> textures;
+        VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+        VkSampler sampler = VK_NULL_HANDLE;
+        // Of every resident level, kept under the budget
+        VkDeviceSize residentBytes = 0;
+        VkDeviceSize budget = 0;
+        uint32_t streamedIn = 0;
+        uint32_t evicted = 0;
+    } streamer;
+
+    struct Vertex {
+        float pos[2];
+        float color[3];
+    };
+    // Per instance attributes, the mesh is scaled, moved and tinted
+    struct Instance {
+        float offset[2];
+        float scale;
+        float tint[3];
+        // In [0, 1), smaller is nearer
+        float depth;
+    };
+    struct Mesh {
+        VkBuffer vertexBuffer = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation vertexMemory;
+        VkBuffer indexBuffer = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation indexMemory;
+        uint32_t vertexCount = 0;
+        uint32_t indexCount = 0;
+        // Start of the position and color streams in vertexBuffer.  Both
+        // are 0 with the interleaved layout.
+        VkDeviceSize streamOffsets[2] = {0, 0};
+        VkBuffer instanceBuffer = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation instanceMemory;
+        uint32_t instanceCount = 0;
+        // Bounding circle around the origin, for culling
+        float radius = 0.0f;
+        // Of the instances, which all have the same size
+        float instanceScale = 1.0f;
+    } mesh;
+
+    // One draw of the mesh for a range of instances
+    struct DrawItem {
+        uint32_t firstInstance;
+        uint32_t instanceCount;
+    };
+    vector<DrawItem> drawList;
+
+    // Pipeline cache, persisted to disk between runs
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+    // The driver blob starts with a VkPipelineCacheHeaderVersionOne, but that
+    // one does not carry the driver version so we prepend our own header.
+    struct PipelineCacheFileHeader {
+        uint32_t magic;
+        uint32_t dataSize;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t uuid[VK_UUID_SIZE];
+    };
+    static constexpr uint32_t pipelineCacheMagic = 0x43505456; // 'VTPC'
+    static constexpr const char *pipelineCacheFile = "pipelinecache.bin";
+
+    VkSwapchainKHR vkSwapChain = VK_NULL_HANDLE;
+    struct SwapChainEntry {
+        VkImage image;
+        VkImageView view;
+        // Only set for offscreen images, which we own
+        DeviceAllocator::Allocation memory;
+
+        // Frame number of the frame that last rendered to this image
+        uint64_t inFlightFrame = 0;
+    };
+    vector<SwapChainEntry> swapChain;
+
+    // Anti aliasing stuff.  The multisampled image is only ever written and
+    // resolved inside the render pass (its store op is DONT_CARE), so a
+    // single one is shared by every swap chain image; successive render
+    // passes are ordered on the attachment by the subpass dependency.
+    // There is no MSAA target when running with a single sample.
+    struct RenderTarget {
+        VkImage image = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation memory;
+        VkImageView view = VK_NULL_HANDLE;
+    };
+    RenderTarget msaaTarget;
+    // Shared the same way, it is cleared and never stored either
+    RenderTarget depthTarget;
+    // With dynamic resolution, what the render pass draws into instead of
+    // the swap chain images, then upscaled into them.  Every target has the
+    // size of the window and only the top left corner is rendered, so the
+    // scale changes without any reallocation.
+    RenderTarget sceneTarget;
+    float renderScale = 1.0f;
+    // Set by the controller, applied between frames
+    float pendingRenderScale = 1.0f;
+    // Feedback on the GPU frame time
+    struct ResolutionController {
+        static constexpr float step = 0.05f;
+        // Frames for a new scale to show in the timings, and to smooth them
+        static constexpr uint32_t settleFrames = 16;
+        double gpuTime = 0.0;
+        uint32_t samples = 0;
+    } resolution;
+    VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+    // Set by onKey() on the render thread, applied between frames
+    VkSampleCountFlagBits pendingMsaaSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    PresentPolicy presentPolicy = PRESENT_LOW_LATENCY;
+    PresentPolicy pendingPresentPolicy = PRESENT_LOW_LATENCY;
+
+    // Swap chain changes are coalesced: resize events, suboptimal and out of
+    // date results only mark the swap chain dirty and it is recreated at
+    // most once per frame, between frames, once resize events have stopped
+    // for resizeDebounce seconds.
+    static constexpr double resizeDebounce = 0.1;
+    bool swapChainDirty = false;
+    // Nothing can be presented until it is recreated
+    bool swapChainOutOfDate = false;
+    chrono::steady_clock::time_point lastResizeEvent;
+    // Windowed runs render on their own thread and the main thread only
+    // pumps the glfw events, which must stay on the main thread, into
+    // inputQueue.  Neither side ever blocks the other.
+    InputQueue inputQueue;
+    // Set by the render thread once it is done, wakes up the main thread
+    atomic<bool> renderFinished{false};
+    // Main thread side: an input event did not fit in a full queue and is
+    // sent again on the next wake up
+    bool resizeBacklog = false;
+    bool closeSent = false;
+    // Render thread side, from the last resize event
+    int framebufferWidth = defaultWidth;
+    int framebufferHeight = defaultHeight;
+    bool quitRequested = false;
+    // When the next frame may start with a frame rate cap
+    chrono::steady_clock::time_point nextFrameDeadline;
+
+    // Per frame in flight resources, used round robin
+    struct FrameContext {
+        VkSemaphore imageAvailableSem;
+        VkSemaphore renderFinishedSem;
+        // Simulation pass of the frame, only with --simulate
+        VkCommandBuffer computeCmd = VK_NULL_HANDLE;
+        VkSemaphore computeFinishedSem = VK_NULL_HANDLE;
+        // Without timeline semaphores only
+        VkFence fence = VK_NULL_HANDLE;
+        // Frame number of the last submission, signaling fence
+        uint64_t fenceFrame = 0;
+        // Timing slot written by that submission, -1 if none
+        int32_t timingSlot = -1;
+    };
+    vector<FrameContext> frames;
+
+    // Frame numbers start at 1, completedFrame is the last frame known to
+    // have finished executing on the GPU.
+    uint64_t frameNumber = 0;
+    uint64_t completedFrame = 0;
+
+    // With VK_KHR_timeline_semaphore every queue signals a timeline
+    // semaphore with a counter that only goes up: the graphics queue the
+    // frame number, the compute queue the number of the frame it simulates
+    // for and the transfer queue its batch count.  Cross queue waits, CPU
+    // waits and retirement are all comparisons against those values.
+    // Otherwise frame contexts and upload batches each have a fence and
+    // binary semaphores.  Acquire and present always use binary ones.
+    struct TimelineSync {
+        bool enabled = false;
+        VkSemaphore frames = VK_NULL_HANDLE;
+        VkSemaphore compute = VK_NULL_HANDLE;
+        VkSemaphore uploads = VK_NULL_HANDLE;
+        // Last value signaled on uploads
+        uint64_t uploadValue = 0;
+#ifdef VK_KHR_timeline_semaphore
+        PFN_vkWaitSemaphoresKHR waitSemaphores = nullptr;
+        PFN_vkGetSemaphoreCounterValueKHR counterValue = nullptr;
+#endif
+    } timeline;
+    bool hasProperties2 = false;
+
+    // Objects retired while the GPU may still be using them.  Entries are
+    // destroyed once the frame they were retired in has completed.
+    struct DeferredDeletion {
+        uint64_t frame;
+        function<void()> destroy;
+    };
+    deque<DeferredDeletion> deletionQueue;
+
+    // Shaders
+    VkShaderModule vertexShader;
+    VkShaderModule fragShader;
+
+    VkRenderPass renderPass;
+
+    // Set 0 is the frame set, the draw index is a push constant
+    VkDescriptorSetLayout frameSetLayout;
+    VkPipelineLayout pipelineLayout;
+    // The pipeline for the current sample count, owned by pipelineVariants
+    VkPipeline graphicsPipeline;
+
+    // A pipeline per supported sample count.  They are all compiled in the
+    // background at startup, we only wait for the one needed by the first
+    // frame, and switching the sample count doesn't compile anything.
+    // Indexed by log2 of the sample count.
+    struct PipelineVariant {
+        // Set while compiling
+        PipelineCompiler::Ticket ticket = 0;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+    };
+    static constexpr uint32_t maxPipelineVariants = 4;
+    PipelineVariant pipelineVariants[maxPipelineVariants];
+    PipelineCompiler pipelineCompiler;
+
+    // Shader hot reload.  New modules get their own set of variants built
+    // in the background, and once they are all ready they replace the
+    // current ones between frames.
+    ShaderWatcher shaderWatcher;
+    struct ShaderReload {
+        bool active = false;
+        VkShaderModule vertexShader = VK_NULL_HANDLE;
+        VkShaderModule fragShader = VK_NULL_HANDLE;
+        PipelineVariant variants[maxPipelineVariants];
+    } reload;
+
+    vector<VkFramebuffer> frameBuffers;
+
+    VkCommandPool commandPool;
+
+    // Per frame data.  Every record slot owns a region of a persistently
+    // mapped ring, written with a memcpy right before the slot is submitted
+    // (its previous submission has completed by then).  The regions are
+    // bound with dynamic offsets, so even static command buffers pick up
+    // new data without re-recording, and nothing is allocated nor updated
+    // per frame.  A region holds the frame uniforms followed by the per
+    // draw data, indexed by a push constant.
+    struct FrameUniforms {
+        float pan[2];
+        float zoom;
+        float time;
+    };
+    struct DrawUniforms {
+        float tint[4];
+    };
+    struct DrawPushConstants {
+        uint32_t drawIndex;
+    };
+    struct UniformRing {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation memory;
+        VkDeviceSize regionSize = 0;
+        // Start of the draw data in a region
+        VkDeviceSize drawOffset = 0;
+        uint32_t regionCount = 0;
+        VkDescriptorSet set = VK_NULL_HANDLE;
+    } uniforms;
+    // Written to the uniforms of every frame
+    struct Camera {
+        float pan[2] = {0.0f, 0.0f};
+        float zoom = 1.0f;
+    } camera;
+    vector<DrawUniforms> drawUniforms;
+    chrono::steady_clock::time_point startTime;
+
+    StartupProfile startup;
+    // Read on a side thread while the instance and the device are created,
+    // consumed by createPipelineCache() and loadShaders()
+    struct StartupFiles {
+        bool hasPipelineCache = false;
+        vector<char> pipelineCache;
+        // With --shader-dir, unmapped once the modules are created
+        MappedFile vertexSpirv;
+        MappedFile fragmentSpirv;
+    } startupFiles;
+
+    // Async compute simulation.  Every frame a compute pass animates the
+    // instances into the record slot's own instance buffer, on the compute
+    // queue (the graphics one when there is no dedicated compute family),
+    // and the graphics submission waits on it at vertex input.  A slot is
+    // only reused once its last frame has completed, so the pass of a frame
+    // overlaps with the rendering of the previous one.
+    struct Simulation {
+        VkShaderModule shader = VK_NULL_HANDLE;
+        VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+        VkPipelineLayout layout = VK_NULL_HANDLE;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        // Of the compute family, the buffers are re-recorded every frame
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        chrono::steady_clock::time_point start;
+    } sim;
+    struct SimPushConstants {
+        float time;
+        uint32_t count;
+    };
+    // local_size_x of the compute shaders
+    static constexpr uint32_t computeGroupSize = 64;
+
+    // GPU driven rendering.  A compute pass at the start of the frame
+    // culls the instances and compacts the visible ones in the record
+    // slot's buffers, counting them in the instanceCount of a single
+    // indirect draw: neither the CPU nor the GPU pay for culled instances.
+    struct Culling {
+        VkShaderModule shader = VK_NULL_HANDLE;
+        VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+        VkPipelineLayout layout = VK_NULL_HANDLE;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+    } cull;
+    struct CullPushConstants {
+        uint32_t count;
+        float radius;
+    };
+
+    // GPU timings.  Every command buffer writes timestamps to its own query
+    // pool, alongside the CPU timings of the frame that submitted it.  Those
+    // are read back without waiting once the frame's fence has signaled,
+    // that is MAX_FRAMES_IN_FLIGHT frames later.
+    enum {
+        TS_FRAME_BEGIN,
+        TS_RENDER_PASS_BEGIN,
+        TS_RENDER_PASS_END,
+        TS_FRAME_END,
+        TS_COUNT
+    };
+    struct TimingSlot {
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+        // Set at submission, cleared once read back
+        bool pending = false;
+        FrameStats::Sample sample;
+        // Start of the latency measurement
+        chrono::steady_clock::time_point started;
+    };
+    // A GPU timestamp and the CPU time it was written at, which put the end
+    // of the frames on the CPU clock.  Taken once at startup.
+    struct TimestampCalibration {
+        uint64_t gpu = 0;
+        chrono::steady_clock::time_point cpu;
+    } calibration;
+
+    // Everything recorded for one submission: the primary command buffer,
+    // the secondary ones recorded by the worker threads and the timestamp
+    // queries.  Static command buffers are recorded once for a given swap
+    // chain image so there is one slot per image.  Dynamic ones are
+    // recorded every frame, in one slot per frame in flight whose pools are
+    // reset before recording.
+    struct RecordSlot {
+        // Only in dynamic mode, static primaries come from commandPool
+        VkCommandPool pool = VK_NULL_HANDLE;
+        VkCommandBuffer cmd = VK_NULL_HANDLE;
+        // One pool and secondary command buffer per recording thread
+        vector<VkCommandPool> workerPools;
+        vector<VkCommandBuffer> secondaries;
+        TimingSlot timing;
+        // Instances animated by the simulation, drawn instead of
+        // mesh.instanceBuffer, and the descriptors of the pass writing them
+        VkBuffer simBuffer = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation simMemory;
+        VkDescriptorSet simSet = VK_NULL_HANDLE;
+        // Of the slot's region in the uniform ring
+        VkDeviceSize uniformOffset = 0;
+        // Written by the culling pass, only when GPU driven: the visible
+        // instances, drawn instead of the others, and the draw command
+        VkBuffer visibleBuffer = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation visibleMemory;
+        VkBuffer drawBuffer = VK_NULL_HANDLE;
+        DeviceAllocator::Allocation drawMemory;
+        VkDescriptorSet cullSet = VK_NULL_HANDLE;
+        // Texture sets the command buffers were recorded with, a static
+        // slot is recorded again once streaming replaced one of them
+        vector<VkDescriptorSet> textureSets;
+    };
+    vector<RecordSlot> recordSlots;
+    JobSystem recordJobs;
+
+    FrameStats frameStats;
+    chrono::steady_clock::time_point lastFrameStart;
+    chrono::steady_clock::time_point lastStatsPrint;
+
+   public:
+    VulkanApp() = default;
+    ~VulkanApp() = default;
+
+    VulkanApp(VulkanApp&) = delete;
+    VulkanApp& operator=(const VulkanApp&) = delete;
+
+    bool parseArgs(int argc, char *argv[]);
+    void run();
+
+  private:
+    void renderLoop();
+    void pumpEvents();
+    void drainInput();
+    bool readFile(vector<char> *data, const char *filename);
+    static bool mapFile(const char *filename, MappedFile *file);
+    static void unmapFile(const MappedFile& file);
+    VkPresentModeKHR choosePresentMode(PresentPolicy policy) const;
+    bool setPresentPolicy(PresentPolicy policy);
+    double frameRateCap() const;
+    double paceFrame();
+    VkSurfaceFormatKHR chooseSwapSurfaceFormat(
+                                             const VkSurfaceFormatKHR* formats,
+                                             uint32_t formatCount);
+
+    static void glfwErrorCallback(int /*error*/, const char* description)
+    {
+        puts(description);
+    }
+
+    bool init();
+    bool timed(const char *stage, bool (VulkanApp::*fn)());
+    void loadStartupFiles();
+    bool initGlFw();
+    bool initVulkanInstance();
+    static bool hasInstanceExtension(const char *name);
+#ifdef VULKANTEST_DEBUG
+    void chooseLayers();
+    bool initDebugUtils();
+    void destroyDebugUtils();
+    static VKAPI_ATTR VkBool32 VKAPI_CALL onDebugMessage(
+                         VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+                         VkDebugUtilsMessageTypeFlagsEXT types,
+                         const VkDebugUtilsMessengerCallbackDataEXT *data,
+                         void *user);
+    void setObjectName(VkObjectType type, uint64_t handle,
+                       const char *name) const;
+    template <typename Handle>
+    void nameObject(VkObjectType type, Handle handle, const char *name) const {
+        setObjectName(type, (uint64_t) handle, name);
+    }
+    void beginLabel(VkCommandBuffer b, const char *name) const;
+    void endLabel(VkCommandBuffer b) const;
+#else
+    // Compiled out.  Pass literals or plain pointers as names so that
+    // nothing is computed for them either.
+    template <typename Handle>
+    void nameObject(VkObjectType, Handle, const char *) const {}
+    void beginLabel(VkCommandBuffer, const char *) const {}
+    void endLabel(VkCommandBuffer) const {}
+#endif
+    bool createSurface();
+    bool choosePhysicalDevice();
+    bool inspectDevice(VkPhysicalDevice physicalDevice);
+    int64_t scoreDevice(const PhysicalDeviceInfo& info) const;
+    static VkDeviceSize deviceLocalMemory(VkPhysicalDevice physicalDevice);
+    static const char *deviceTypeName(VkPhysicalDeviceType type);
+    bool createLogicalDevice();
+    bool createPipelineCache();
+    bool validatePipelineCache(const vector<char>& data);
+    void savePipelineCache();
+    bool createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE);
+    bool createOffscreenImages();
+    bool createImageViews();
+    VkSampleCountFlagBits chooseSampleCount(uint32_t requested) const;
+    VkSampleCountFlagBits nextSampleCount(VkSampleCountFlagBits current) const;
+    bool setSampleCount(VkSampleCountFlagBits samples);
+    void reportMsaaMemory() const;
+    bool createMsaaTarget(RenderTarget *target);
+    bool createDepthTarget(RenderTarget *target);
+    bool createSceneTarget(RenderTarget *target);
+    bool canUpscale() const;
+    VkExtent2D renderExtent() const;
+    void updateRenderScale(double gpuTime);
+    bool setRenderScale(float scale);
+    void recordUpscale(VkCommandBuffer b, uint32_t imageIndex);
+    bool createView(VkImage image, VkFormat format, VkImageAspectFlags aspect,
+                    VkImageView *view, uint32_t levelCount = 1);
+    void destroyRenderTarget(const RenderTarget& target);
+    bool loadShaders();
+    bool createShaderModule(const char *filename, VkShaderModule *module);
+    bool createShaderModule(const char *filename, const MappedFile& file,
+                            VkShaderModule *module);
+    bool createShaderModule(const uint32_t *code, size_t size,
+                            VkShaderModule *module);
+    bool createRenderPass(VkSampleCountFlagBits samples,
+                          VkRenderPass *pass) const;
+    bool createPipelineLayout();
+    bool buildPipeline(VkSampleCountFlagBits samples, VkRenderPass pass,
+                       VkShaderModule vertModule, VkShaderModule fragModule,
+                       VkPipeline *pipeline) const;
+    static uint32_t variantIndex(VkSampleCountFlagBits samples);
+    void requestPipelines(PipelineVariant *variants, VkShaderModule vert,
+                          VkShaderModule frag);
+    void collectPipelines(PipelineVariant *variants);
+    bool usePipeline(VkSampleCountFlagBits samples);
+    void destroyPipelines(PipelineVariant *variants);
+    void pollShaderReload();
+    bool finishShaderReload();
+    void abortShaderReload();
+    bool retireCommandBuffers();
+    bool createFrameBuffers();
+    bool createCommandPool();
+    bool createFrameContexts();
+    bool createTimeline(VkSemaphore *sem);
+    void waitTimeline(VkSemaphore sem, uint64_t value);
+    uint64_t timelineValue(VkSemaphore sem);
+    void waitForFrame(uint64_t frame);
+    bool createStagingRing();
+    void destroyStagingRing();
+    bool beginUploadBatch();
+    bool reserveUpload(VkDeviceSize size, VkDeviceSize alignment,
+                       VkDeviceSize *offset);
+    bool reserveStaging(VkDeviceSize size, VkDeviceSize alignment,
+                        VkDeviceSize *offset);
+    bool uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void *data,
+                      VkDeviceSize size);
+    bool flushUploads();
+    bool uploadDone(const UploadBatch& batch, bool wait);
+    void waitForUploads(SubmitSync *sync, VkPipelineStageFlags stages);
+    void retireUploads(bool wait);
+    bool createMesh();
+    bool createTextures();
+    bool loadKtx2(const char *filename, Texture *tex);
+    static bool textureBlock(VkFormat format, Texture *tex);
+    uint32_t wantedTextureLevel(const Texture& tex) const;
+    bool setResidency(Texture *tex, uint32_t base);
+    bool uploadTexture(const Texture& tex, VkImage image, uint32_t base);
+    void copyTextureLevels(const Texture& tex, VkImage image, uint32_t base);
+    bool streamTextures();
+    void destroyTextures();
+    bool createInstances();
+    vector<uint32_t> bufferFamilies() const;
+    uint32_t vertexBindingCount() const;
+    void destroyMesh();
+    bool createCommandBuffers();
+    bool setupCommandBuffers();
+    bool calibrateTimestamps();
+    bool createTimingSlot(RecordSlot *slot);
+    bool createUniformRing(uint32_t regionCount);
+    void destroyUniformRing(const UniformRing& ring);
+    void writeUniforms(const RecordSlot& slot);
+    bool createWorkerBuffers(RecordSlot *slot);
+    bool createSimulation();
+    bool createSimBuffer(RecordSlot *slot);
+    bool submitSimulation(FrameContext& frame, const RecordSlot& slot);
+    void destroySimulation();
+    bool createCulling();
+    bool createCullBuffers(RecordSlot *slot);
+    void recordCulling(VkCommandBuffer b, const RecordSlot& slot);
+    void destroyCulling();
+    bool createComputePipeline(const uint32_t *code, size_t codeSize,
+                               const char *file, uint32_t bindingCount,
+                               uint32_t pushConstantsSize,
+                               VkShaderModule *shader,
+                               VkDescriptorSetLayout *setLayout,
+                               VkPipelineLayout *layout,
+                               VkPipeline *pipeline,
+                               VkDescriptorSetLayout extraSetLayout =
+                                                            VK_NULL_HANDLE);
+    bool createStorageSet(VkDescriptorSetLayout setLayout,
+                          const vector<VkBuffer>& buffers,
+                          VkDescriptorSet *set);
+    void destroyRecordSlots(const vector<RecordSlot>& slots);
+    uint32_t recordSlotIndex(uint32_t frameIndex, uint32_t imageIndex) const;
+    bool recordSlot(uint32_t slotIndex, uint32_t imageIndex);
+    bool texturesChanged(const RecordSlot& slot) const;
+    bool recordSecondary(const RecordSlot& slot, uint32_t imageIndex,
+                         uint32_t worker);
+    void recordDraws(VkCommandBuffer b, const RecordSlot& slot,
+                     uint32_t firstDraw, uint32_t endDraw);
+    void readTimestamps(int32_t slot);
+    void reportBenchmark(double seconds);
+    void finishTiming(FrameContext& frame, uint32_t slotIndex,
+                      const FrameStats::Sample& sample,
+                      chrono::steady_clock::time_point started);
+    void cleanup();
+    void cleanupSwapChain();
+    void destroySwapChain(VkSwapchainKHR swapChainHandle,
+                          const vector<SwapChainEntry>& entries);
+    void destroyFrameBuffers(const vector<VkFramebuffer>& buffers,
+                             const vector<RecordSlot>& slots,
+                             const RenderTarget& msaa,
+                             const RenderTarget& depth,
+                             const RenderTarget& scene);
+    void retireSwapChain();
+    void retireFrameBuffers();
+    void deferDestroy(function<void()> destroy);
+    void deferDestroyAfterUploads(function<void()> destroy);
+    void collectGarbage();
+    void waitForIdle();
+    bool recreateSwapChain();
+    bool updateSwapChain();
+    void onResize(int width, int height);
+    void pushResize();
+    void onKey(int key, int action);
+    void updateExtent();
+
+    bool renderFrame(uint32_t renderCount);
+
+    // Glfw glue, the callbacks run on the main thread and only queue the
+    // events for the render thread
+    static void glfw_onResize(GLFWwindow * window, int /*width*/,
+                              int /*height*/)
+    {
+        VulkanApp *app = (VulkanApp *) glfwGetWindowUserPointer(window);
+        app->pushResize();
+    }
+    static void glfw_onKey(GLFWwindow * window, int key, int /*scancode*/,
+                           int action, int /*mods*/)
+    {
+        VulkanApp *app = (VulkanApp *) glfwGetWindowUserPointer(window);
+        InputEvent event;
+        event.type = InputEvent::KEY;
+        event.key = key;
+        event.action = action;
+        // Dropped if the render thread is that far behind
+        app->inputQueue.push(event);
+    }
+};
+
+bool VulkanApp::parseArgs(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (0 == strcmp(arg, "--device") && hasValue) {
+            settings.device = argv[++i];
+        }
+        else if (0 == strcmp(arg, "--msaa") && hasValue) {
+            settings.msaaSamples = strtoul(argv[++i], nullptr, 10);
+            if (settings.msaaSamples != 1 && settings.msaaSamples != 2
+             && settings.msaaSamples != 4 && settings.msaaSamples != 8) {
+                printf("--msaa must be 1, 2, 4 or 8\n");
+                return false;
+            }
+        }
+        else if (0 == strcmp(arg, "--vertex-layout") && hasValue) {
+            const char *layout = argv[++i];
+            if (0 == strcmp(layout, "split")) {
+                settings.splitVertexStreams = true;
+            }
+            else if (0 == strcmp(layout, "interleaved")) {
+                settings.splitVertexStreams = false;
+            }
+            else {
+                printf("--vertex-layout must be interleaved or split\n");
+                return false;
+            }
+        }
+        else if (0 == strcmp(arg, "--mesh-detail") && hasValue) {
+            settings.meshDetail = max(1UL, strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(arg, "--instances") && hasValue) {
+            settings.instanceCount = max(1UL, strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(arg, "--draws") && hasValue) {
+            settings.drawCount = max(1UL, strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(arg, "--simulate")) {
+            settings.simulate = true;
+        }
+        else if (0 == strcmp(arg, "--gpu-driven")) {
+            settings.gpuDriven = true;
+        }
+        else if (0 == strcmp(arg, "--texture") && hasValue) {
+            settings.textures.push_back(argv[++i]);
+        }
+        else if (0 == strcmp(arg, "--texture-budget") && hasValue) {
+            settings.textureBudget = max(1UL, strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(arg, "--record-threads") && hasValue) {
+            settings.recordThreads = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (0 == strcmp(arg, "--sync") && hasValue) {
+            const char *mode = argv[++i];
+            if (0 == strcmp(mode, "timeline")) {
+                settings.timelineSync = true;
+            }
+            else if (0 == strcmp(mode, "binary")) {
+                settings.timelineSync = false;
+            }
+            else {
+                printf("--sync must be timeline or binary\n");
+                return false;
+            }
+        }
+        else if (0 == strcmp(arg, "--recording") && hasValue) {
+            const char *mode = argv[++i];
+            if (0 == strcmp(mode, "dynamic")) {
+                settings.dynamicRecording = true;
+            }
+            else if (0 == strcmp(mode, "static")) {
+                settings.dynamicRecording = false;
+            }
+            else {
+                printf("--recording must be static or dynamic\n");
+                return false;
+            }
+        }
+        else if (0 == strcmp(arg, "--present") && hasValue) {
+            const char *policy = argv[++i];
+            int found = -1;
+            for (int p = 0; p < PRESENT_POLICY_COUNT; ++p) {
+                if (0 == strcmp(policy, presentPolicyName((PresentPolicy) p)))
+                    found = p;
+            }
+            if (found < 0) {
+                printf("--present must be low-latency, vsync or "
+                       "power-saving\n");
+                return false;
+            }
+            settings.presentPolicy = (PresentPolicy) found;
+        }
+        else if (0 == strcmp(arg, "--dynamic-resolution") && hasValue) {
+            settings.dynamicResolution = max(0.0, strtod(argv[++i], nullptr));
+        }
+        else if (0 == strcmp(arg, "--min-scale") && hasValue) {
+            const float scale = strtof(argv[++i], nullptr);
+            settings.minRenderScale = min(1.0f, max(0.1f, scale));
+        }
+        else if (0 == strcmp(arg, "--fps-cap") && hasValue) {
+            settings.fpsCap = max(0.0, strtod(argv[++i], nullptr));
+        }
+        else if (0 == strcmp(arg, "--compile-threads") && hasValue) {
+            settings.compileThreads = max(1UL, strtoul(argv[++i], nullptr, 10));
+        }
+        else if (0 == strcmp(arg, "--shader-dir") && hasValue) {
+            settings.shaderDir = argv[++i];
+        }
+        else if (0 == strcmp(arg, "--watch") && hasValue) {
+            settings.watchDir = argv[++i];
+        }
+        else if (0 == strcmp(arg, "--stats") && hasValue) {
+            settings.statsInterval = max(0.0, strtod(argv[++i], nullptr));
+        }
+        else if (0 == strcmp(arg, "--stats-csv") && hasValue) {
+            settings.statsCsv = argv[++i];
+        }
+        else if (0 == strcmp(arg, "--headless")) {
+            settings.headless = true;
+        }
+        else if (0 == strcmp(arg, "--validation")) {
+#ifdef VULKANTEST_DEBUG
+            settings.validation = true;
+#else
+            printf("--validation needs a debug build, see VULKANTEST_DEBUG\n");
+            return false;
+#endif
+        }
+        else if (0 == strcmp(arg, "--frames") && hasValue) {
+            settings.benchFrames = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (0 == strcmp(arg, "--duration") && hasValue) {
+            settings.benchSeconds = max(0.0, strtod(argv[++i], nullptr));
+        }
+        else if (0 == strcmp(arg, "--warmup") && hasValue) {
+            settings.warmupFrames = strtoul(argv[++i], nullptr, 10);
+        }
+        else {
+            printf("usage: %s [options]\n"
+                   "  --device <n|name>  use device #n or the first one\n"
+                   "                     whose name contains name instead\n"
+                   "                     of the best scoring one, also\n"
+                   "                     $VULKANTEST_DEVICE\n"
+                   "  --msaa <1|2|4|8>   MSAA sample count (default 4),\n"
+                   "                     press M to cycle at runtime\n"
+                   "  --vertex-layout <interleaved|split>\n"
+                   "                     vertex attribute streams\n"
+                   "  --mesh-detail <n>  subdivide the triangle into n^2\n"
+                   "  --instances <n>    draw n copies of the mesh in one\n"
+                   "                     instanced draw (default 1)\n"
+                   "  --draws <n>        split the instances into n draws\n"
+                   "  --simulate         animate the instances with async\n"
+                   "                     compute\n"
+                   "  --gpu-driven       cull the instances on the GPU and\n"
+                   "                     draw them with an indirect draw\n"
+                   "  --texture <file>   stream and sample a KTX2 texture,\n"
+                   "                     repeat to spread several over the\n"
+                   "                     draws\n"
+                   "  --texture-budget <MB>\n"
+                   "                     texture memory before the least\n"
+                   "                     recently used mips are evicted\n"
+                   "                     (default 64)\n"
+                   "  --record-threads <n>\n"
+                   "                     record the draws into secondary\n"
+                   "                     command buffers on n threads\n"
+                   "  --recording <static|dynamic>\n"
+                   "                     record the command buffers once\n"
+                   "                     per image or every frame\n"
+                   "  --sync <timeline|binary>\n"
+                   "                     frame synchronization with timeline\n"
+                   "                     semaphores when the device has them\n"
+                   "                     (default), or fences\n"
+                   "  --present <low-latency|vsync|power-saving>\n"
+                   "                     present mode policy (default\n"
+                   "                     low-latency), P cycles at runtime\n"
+                   "  --dynamic-resolution <ms>\n"
+                   "                     scale the resolution down to keep\n"
+                   "                     the GPU frame time under ms\n"
+                   "  --min-scale <s>    lowest render scale (default 0.5)\n"
+                   "  --fps-cap <fps>    frame rate limit, 0 for none\n"
+                   "  --compile-threads <n>\n"
+                   "                     pipeline compilation threads\n"
+                   "  --shader-dir <dir> load the SPIR-V from dir instead\n"
+                   "                     of the embedded shaders\n"
+                   "  --watch <dir>      hot reload {vertex,fragment}.glsl\n"
+                   "                     from dir with $GLSLC (default glslc)\n"
+                   "  --stats <seconds>  print frame timings periodically\n"
+                   "  --stats-csv <file> dump every frame's timings\n"
+                   "  --headless         render offscreen, without window\n"
+                   "  --validation       load the validation layers (debug\n"
+                   "                     builds)\n"
+                   "  --frames <n>       benchmark: stop after n frames\n"
+                   "  --duration <s>     benchmark: stop after s seconds\n"
+                   "  --warmup <n>       frames ignored by the benchmark\n"
+                   "                     (default 10)\n"
+                   "Arrows pan, + and - zoom, 0 resets the camera\n",
+                   argv[0]);
+            return false;
+        }
+    }
+    // There is no ESC key without a window
+    if (settings.headless && !settings.benchmark())
+        settings.benchFrames = 1000;
+    return true;
+}
+
+bool VulkanApp::init()
+{
+    // Device lifetime objects first: none of these depend on the extent so
+    // they survive window resizes.
+    if (settings.statsCsv && !frameStats.openCsv(settings.statsCsv))
+        return false;
+    // The files don't need the device, they are read meanwhile
+    thread loader([this]() {
+        StartupProfile::Stage stage(startup, "read files", true);
+        loadStartupFiles();
+    });
+    const bool created = (settings.headless
+                       || timed("glfw", &VulkanApp::initGlFw))
+                      && timed("instance", &VulkanApp::initVulkanInstance)
+                      && (settings.headless
+                       || timed("surface", &VulkanApp::createSurface))
+                      && timed("physical device",
+                               &VulkanApp::choosePhysicalDevice)
+                      && timed("device", &VulkanApp::createLogicalDevice);
+    loader.join();
+    if (!created || !timed("pipeline cache", &VulkanApp::createPipelineCache))
+        return false;
+
+    if (settings.dynamicResolution > 0.0 && !canUpscale()) {
+        printf("Cannot blit to the swap chain images, dynamic resolution "
+               "disabled\n");
+        settings.dynamicResolution = 0.0;
+    }
+    msaaSamples = chooseSampleCount(settings.msaaSamples);
+    pendingMsaaSamples = msaaSamples;
+    presentPolicy = pendingPresentPolicy = settings.presentPolicy;
+    startTime = chrono::steady_clock::now();
+    recordJobs.start(settings.recordThreads);
+    pipelineCompiler.start(settings.compileThreads);
+    if (!timed("shaders", &VulkanApp::loadShaders)
+     || !createPipelineLayout())
+        return false;
+    // Pipelines compile while we get on with the rest, they are only needed
+    // to record the command buffers
+    requestPipelines(pipelineVariants, vertexShader, fragShader);
+    {
+        StartupProfile::Stage stage(startup, "render pass");
+        if (!createRenderPass(msaaSamples, &renderPass))
+            return false;
+    }
+    if (!timed("command pool", &VulkanApp::createCommandPool)
+     || !timed("timestamps", &VulkanApp::calibrateTimestamps)
+     || !timed("frame contexts", &VulkanApp::createFrameContexts)
+     || !timed("staging ring", &VulkanApp::createStagingRing)
+     || !timed("mesh", &VulkanApp::createMesh)
+     || !timed("textures", &VulkanApp::createTextures)
+     || (settings.simulate
+      && !timed("simulation", &VulkanApp::createSimulation))
+     || (settings.gpuDriven && !timed("culling", &VulkanApp::createCulling)))
+        return false;
+
+    // Swap chain lifetime objects, rebuilt by recreateSwapChain()
+    {
+        StartupProfile::Stage stage(startup, "swap chain");
+        if (!createSwapChain())
+            return false;
+    }
+    if (!timed("framebuffers", &VulkanApp::createFrameBuffers)
+     || !timed("command buffers", &VulkanApp::createCommandBuffers))
+        return false;
+    {
+        // Only blocks if the pipeline is still compiling
+        StartupProfile::Stage stage(startup, "pipeline wait");
+        if (!usePipeline(msaaSamples))
+            return false;
+    }
+    if (!timed("record", &VulkanApp::setupCommandBuffers))
+        return false;
+    if (devInfo.timestampValidBits == 0) {
+        printf("No timestamp support, GPU timings disabled%s\n",
+               settings.dynamicResolution > 0.0
+             ? ", rendering at full resolution" : "");
+    }
+    if (settings.watchDir) {
+        const char *glslc = getenv("GLSLC");
+        shaderWatcher.start(settings.watchDir, glslc ? glslc : "glslc");
+    }
+    reportMsaaMemory();
+    allocator.printStats();
+    return true;
+}
+
+bool VulkanApp::timed(const char *stage, bool (VulkanApp::*fn)())
+{
+    StartupProfile::Stage timer(startup, stage);
+    return (this->*fn)();
+}
+
+void VulkanApp::loadStartupFiles()
+{
+    // Side thread: only files, nothing touching the instance or the device.
+    // The pipeline cache header is validated once the device is known.
+    startupFiles.hasPipelineCache = readFile(&startupFiles.pipelineCache,
+                                             pipelineCacheFile);
+    if (settings.shaderDir) {
+        // Mapping alone reads nothing: have the pages read ahead while the
+        // device gets created, the modules are then created from them
+        auto prefetch = [](const string& path, MappedFile *file) {
+            if (mapFile(path.c_str(), file))
+                madvise(file->data, file->size, MADV_WILLNEED);
+        };
+        const string dir = settings.shaderDir;
+        prefetch(dir + "/vertex.spv", &startupFiles.vertexSpirv);
+        prefetch(dir + "/fragment.spv", &startupFiles.fragmentSpirv);
+    }
+}
+
+void VulkanApp::run()
+{
+    if (!init())
+        return;
+
+    if (settings.headless) {
+        renderLoop();
+    }
+    else {
+        // Everything but the event loop moves to the render thread, a slow
+        // event (a live resize on macOS blocks in the event loop) no longer
+        // delays submission.
+        thread renderThread(&VulkanApp::renderLoop, this);
+        pumpEvents();
+        renderThread.join();
+    }
+    cleanup();
+}
+
+void VulkanApp::pumpEvents()
+{
+    while (!renderFinished.load(memory_order_acquire)) {
+        // Events that did not fit are retried after a while
+        const bool backlog = resizeBacklog
+                          || (!closeSent && glfwWindowShouldClose(window));
+        if (backlog)
+            glfwWaitEventsTimeout(resizeDebounce);
+        else
+            glfwWaitEvents();
+        if (resizeBacklog)
+            pushResize();
+        if (!closeSent && glfwWindowShouldClose(window)) {
+            InputEvent event;
+            event.type = InputEvent::CLOSE;
+            closeSent = inputQueue.push(event);
+        }
+    }
+}
+
+void VulkanApp::drainInput()
+{
+    // Render thread, after the pacing sleep of every frame.  Settings that
+    // need a new swap chain or pipelines are applied once it's submitted.
+    InputEvent event;
+    while (inputQueue.pop(&event)) {
+        if (event.type == InputEvent::KEY)
+            onKey(event.key, event.action);
+        else if (event.type == InputEvent::RESIZE)
+            onResize(event.width, event.height);
+        else
+            quitRequested = true;
+    }
+}
+
+void VulkanApp::renderLoop()
+{
+    uint32_t renderCount = 0;
+    lastFrameStart = lastStatsPrint = chrono::steady_clock::now();
+    chrono::steady_clock::time_point benchStart = lastFrameStart;
+    if (settings.benchmark())
+        frameStats.recordHistory(settings.warmupFrames + 1);
+    while(1) {
+        if (settings.benchmark() && frameNumber == settings.warmupFrames)
+            benchStart = chrono::steady_clock::now();
+        bool running = renderFrame(renderCount++);
+        if (frameNumber == 1)
+            startup.report();
+        collectPipelines(pipelineVariants);
+        if (shaderWatcher.running())
+            pollShaderReload();
+        running = streamTextures() && running;
+        if (settings.benchmark() && frameNumber > settings.warmupFrames) {
+            const uint64_t benchFrames = frameNumber - settings.warmupFrames;
+            const double elapsed = chrono::duration<double>(
+                              chrono::steady_clock::now() - benchStart).count();
+            if ((settings.benchFrames > 0
+              && benchFrames >= settings.benchFrames)
+             || (settings.benchSeconds > 0.0
+              && elapsed >= settings.benchSeconds))
+                running = false;
+        }
+
+        if (settings.statsInterval > 0.0) {
+            const auto now = chrono::steady_clock::now();
+            if (chrono::duration<double>(now - lastStatsPrint).count() >=
+                                                     settings.statsInterval) {
+                frameStats.print();
+                lastStatsPrint = now;
+            }
+        }
+
+        if (quitRequested)
+            running = false;
+        if (pendingMsaaSamples != msaaSamples)
+            running = setSampleCount(pendingMsaaSamples) && running;
+        if (pendingPresentPolicy != presentPolicy)
+            running = setPresentPolicy(pendingPresentPolicy) && running;
+        if (pendingRenderScale != renderScale)
+            running = setRenderScale(pendingRenderScale) && running;
+        if (swapChainDirty && !settings.headless && running)
+            running = updateSwapChain();
+        if (!running) {
+            break;
+        }
+    }
+
+    waitForIdle();
+    if (settings.benchmark()) {
+        reportBenchmark(chrono::duration<double>(
+                             chrono::steady_clock::now() - benchStart).count());
+    }
+    // The main thread may be waiting for events
+    renderFinished.store(true, memory_order_release);
+    if (!settings.headless)
+        glfwPostEmptyEvent();
+}
+
+void VulkanApp::reportBenchmark(double seconds)
+{
+    // Called once idle: collect the timings of the last frames
+    for (auto& frame : frames) {
+        readTimestamps(frame.timingSlot);
+        frame.timingSlot = -1;
+    }
+    printf("Benchmark: %ux%u, %u samples, %u instances of %u triangles in "
+           "%zu draws, %s recording on %u threads, %s present, %s sync%s\n",
+           devInfo.extent.width, devInfo.extent.height, msaaSamples,
+           mesh.instanceCount, mesh.indexCount / 3, drawList.size(),
+           settings.dynamicRecording ? "dynamic" : "static",
+           recordJobs.size(), presentPolicyName(presentPolicy),
+           timeline.enabled ? "timeline" : "fence",
+           settings.headless ? ", headless" : "");
+    frameStats.printSummary(seconds);
+    if (settings.dynamicResolution > 0.0) {
+        printf("Render scale %.2f for a %.2f ms target\n", renderScale,
+               settings.dynamicResolution);
+    }
+    if (seconds > 0.0) {
+        const double frames = frameNumber - settings.warmupFrames;
+        printf("%.1f Mtriangles/s\n", frames * mesh.instanceCount *
+                                      (mesh.indexCount / 3) / seconds * 1e-6);
+    }
+    if (!settings.textures.empty()) {
+        printf("Textures: %u levels streamed in, %u evicted, %.1f MB "
+               "resident\n", streamer.streamedIn, streamer.evicted,
+               streamer.residentBytes / (1024.0 * 1024.0));
+    }
+}
+
+void VulkanApp::waitForIdle()
+{
+    waitForFrame(frameNumber);
+    vkDeviceWaitIdle(device);
+}
+
+bool VulkanApp::hasInstanceExtension(const char *name)
+{
+    uint32_t extensionCount;
+    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+    vector<VkExtensionProperties> extProps(extensionCount);
+    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount,
+                                           extProps.data());
+    return any_of(extProps.begin(), extProps.end(),
+                  [name](const VkExtensionProperties& p) {
+        return 0 == strcmp(p.extensionName, name);
+    });
+}
+
+bool VulkanApp::mapFile(const char *filename, MappedFile *file)
+{
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid once the descriptor is closed
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    file->data = data;
+    file->size = st.st_size;
+    return true;
+}
+
+void VulkanApp::unmapFile(const MappedFile& file)
+{
+    if (file.data)
+        munmap(file.data, file.size);
+}
+
+bool VulkanApp::readFile(vector<char> *buf, const char *filename)
+{
+    FILE *fd = fopen(filename, "r");
+    if (!fd)
+        return false;
+    size_t numRead = 0;
+    while (1) {
+        buf->resize(numRead + 4096);
+        size_t ret = fread(buf->data() + numRead, 1, 4096, fd);
+        numRead += ret;
+        if (ret != 4096)
+            break;
+    }
+    buf->resize(numRead);
+    fclose(fd);
+    return true;
+}
+
+VkPresentModeKHR VulkanApp::choosePresentMode(PresentPolicy policy) const
+{
+    // This is guaranteed to be avail per spec but can be buggy
+    VkPresentModeKHR bestMode = VK_PRESENT_MODE_FIFO_KHR;
+    if (policy != PRESENT_LOW_LATENCY)
+        return bestMode;
+    for (VkPresentModeKHR mode : devInfo.presentModes) {
+        if (mode == VK_PRESENT_MODE_MAILBOX_KHR)
+            return VK_PRESENT_MODE_MAILBOX_KHR;
+        if (mode == VK_PRESENT_MODE_IMMEDIATE_KHR)
+            bestMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+    }
+    return bestMode;
+}
+
+void VulkanApp::updateRenderScale(double gpuTime)
+{
+    // GPU time goes mostly with the pixel count, the square of the scale.
+    // The timings are smoothed and the scale only moves by whole steps
+    // once they reflect the current one, so that it doesn't oscillate.
+    ResolutionController& ctl = resolution;
+    ctl.gpuTime = ctl.samples == 0 ? gpuTime
+                                   : 0.9 * ctl.gpuTime + 0.1 * gpuTime;
+    if (++ctl.samples < ResolutionController::settleFrames
+     || pendingRenderScale != renderScale)
+        return;
+
+    const float ideal = renderScale *
+                        (float) sqrt(settings.dynamicResolution / ctl.gpuTime);
+    if (fabs(ideal - renderScale) < ResolutionController::step)
+        return;
+    const float steps = floor(ideal / ResolutionController::step);
+    pendingRenderScale = min(1.0f, max(settings.minRenderScale,
+                                       steps * ResolutionController::step));
+}
+
+bool VulkanApp::setRenderScale(float scale)
+{
+    printf("Render scale %.2f, GPU %.2f ms\n", scale, resolution.gpuTime);
+    renderScale = scale;
+    pendingRenderScale = scale;
+    resolution.samples = 0;
+    // The targets don't change, only the render area and the viewport.
+    // Static command buffers have them baked in.
+    return settings.dynamicRecording || retireCommandBuffers();
+}
+
+bool VulkanApp::setPresentPolicy(PresentPolicy policy)
+{
+    presentPolicy = pendingPresentPolicy = policy;
+    nextFrameDeadline = chrono::steady_clock::time_point();
+    printf("Present policy %s, fps cap %.0f\n", presentPolicyName(policy),
+           frameRateCap());
+    if (settings.headless)
+        return true;
+
+    const VkPresentModeKHR mode = choosePresentMode(policy);
+    if (mode == devInfo.presentMode)
+        return true;
+    // The present mode is baked in the swap chain
+    devInfo.presentMode = mode;
+    swapChainDirty = true;
+    return true;
+}
+
+double VulkanApp::frameRateCap() const
+{
+    if (settings.fpsCap > 0.0)
+        return settings.fpsCap;
+    return presentPolicy == PRESENT_POWER_SAVING ? powerSavingFps : 0.0;
+}
+
+double VulkanApp::paceFrame()
+{
+    // Sleep until the next frame is due rather than letting the GPU run at
+    // thousands of frames per second.  We don't try to catch up after
+    // falling behind, that would just be a burst of frames.
+    const double cap = frameRateCap();
+    if (cap <= 0.0)
+        return 0.0;
+
+    using Clock = chrono::steady_clock;
+    const Clock::duration interval = chrono::duration_cast<Clock::duration>(
+                                           chrono::duration<double>(1.0 / cap));
+    const Clock::time_point now = Clock::now();
+    if (nextFrameDeadline + interval < now)
+        nextFrameDeadline = now;
+    double slept = 0.0;
+    if (nextFrameDeadline > now) {
+        this_thread::sleep_until(nextFrameDeadline);
+        slept = chrono::duration<double, milli>(Clock::now() - now).count();
+    }
+    nextFrameDeadline += interval;
+    return slept;
+}
+
+VkSurfaceFormatKHR VulkanApp::chooseSwapSurfaceFormat(
+                                             const VkSurfaceFormatKHR* formats,
+                                             uint32_t formatCount)
+{
+    if (formatCount == 1 && formats[0].format == VK_FORMAT_UNDEFINED) {
+        // Guaranteed to be avail in this case
+        return {VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+    }
+    for (uint32_t i = 0; i < formatCount; ++i) {
+        if (formats[i].format == VK_FORMAT_B8G8R8A8_UNORM
+         && formats[i].colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
+            return formats[i];
+    }
+    return formats[0];
+}
+
+bool VulkanApp::initGlFw() {
+    // Init glfw
+    glfwInit();
+    glfwSetErrorCallback(glfwErrorCallback);
+
+    // This prevents glfw from creating a gl context
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
+    window = glfwCreateWindow(defaultWidth, defaultHeight, "Vulkan", nullptr,
+                              nullptr);
+    glfwSetWindowUserPointer(window, this);
+    glfwSetFramebufferSizeCallback(window, &VulkanApp::glfw_onResize);
+    glfwSetKeyCallback(window, &VulkanApp::glfw_onKey);
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+
+    VkExtensionProperties properties[16];
+    uint32_t extensionCount = 16;
+    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount,
+                                           properties);
+
+    printf("%u extensions supported: ", extensionCount);
+    for (unsigned i = 0; i < extensionCount; ++i) {
+        if (i)
+            printf(", ");
+        printf("%s", properties[i].extensionName);
+    }
+    puts("");
+    if (glfwVulkanSupported() != GLFW_TRUE) {
+        puts("glfw does not support vulkan! Upgrade to the latest version");
+        return false;
+    }
+    return true;
+}
+
+bool VulkanApp::initVulkanInstance() {
+    VkApplicationInfo appInfo = {};
+    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    appInfo.pApplicationName = "Vulkan triangle";
+    appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+    appInfo.pEngineName = "DeadCanard's Engine";
+    appInfo.engineVersion = VK_MAKE_VERSION(0, 0, 1);
+    appInfo.apiVersion = VK_API_VERSION_1_0;
+
+    VkInstanceCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    createInfo.pApplicationInfo = &appInfo;
+
+    // Headless rendering doesn't need any of the surface extensions
+    uint32_t glfwExtensionCount = 0;
+    const char** glfwExtensions = nullptr;
+    if (!settings.headless)
+        glfwExtensions = glfwGetRequiredInstanceExtensions(
+                                                          &glfwExtensionCount);
+    vector<const char *> extensions(glfwExtensions,
+                                    glfwExtensions + glfwExtensionCount);
+    createInfo.enabledLayerCount = 0;
+#ifdef VK_KHR_timeline_semaphore
+    // To query the timeline semaphore feature
+    hasProperties2 = hasInstanceExtension(
+        VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+    if (hasProperties2)
+        extensions.push_back(
+            VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+#endif
+#ifdef VULKANTEST_DEBUG
+    // Capture tools expose the extension themselves
+    const bool hasDebugUtils = hasInstanceExtension(
+                                            VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    if (hasDebugUtils)
+        extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    else
+        printf("No %s, objects are not named\n",
+               VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    if (settings.validation)
+        chooseLayers();
+    createInfo.enabledLayerCount = layers.size();
+    createInfo.ppEnabledLayerNames = layers.data();
+#endif
+    createInfo.enabledExtensionCount = extensions.size();
+    createInfo.ppEnabledExtensionNames = extensions.data();
+
+    VkResult vkRet = vkCreateInstance(&createInfo, nullptr, &instance);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateInstance failed with %d\n", vkRet);
+        return false;
+    }
+#ifdef VULKANTEST_DEBUG
+    if (hasDebugUtils && !initDebugUtils())
+        return false;
+#endif
+    return true;
+}
+
+#ifdef VULKANTEST_DEBUG
+void VulkanApp::chooseLayers()
+{
+    // The Khronos layer replaced the LunarG meta layer, take whichever the
+    // SDK has
+    uint32_t layerCount;
+    vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+    vector<VkLayerProperties> layerProps(layerCount);
+    vkEnumerateInstanceLayerProperties(&layerCount, layerProps.data());
+    for (const char *name : {"VK_LAYER_KHRONOS_validation",
+                             "VK_LAYER_LUNARG_standard_validation"}) {
+        for (const auto& props : layerProps) {
+            if (0 == strcmp(props.layerName, name)) {
+                layers.push_back(name);
+                printf("Validation with %s\n", name);
+                return;
+            }
+        }
+    }
+    printf("No validation layer found\n");
+}
+
+bool VulkanApp::initDebugUtils()
+{
+    auto load = [this](const char *name) {
+        return vkGetInstanceProcAddr(instance, name);
+    };
+    debugUtils.createMessenger = (PFN_vkCreateDebugUtilsMessengerEXT)
+                                        load("vkCreateDebugUtilsMessengerEXT");
+    debugUtils.destroyMessenger = (PFN_vkDestroyDebugUtilsMessengerEXT)
+                                       load("vkDestroyDebugUtilsMessengerEXT");
+    debugUtils.setObjectName = (PFN_vkSetDebugUtilsObjectNameEXT)
+                                          load("vkSetDebugUtilsObjectNameEXT");
+    debugUtils.beginLabel = (PFN_vkCmdBeginDebugUtilsLabelEXT)
+                                          load("vkCmdBeginDebugUtilsLabelEXT");
+    debugUtils.endLabel = (PFN_vkCmdEndDebugUtilsLabelEXT)
+                                            load("vkCmdEndDebugUtilsLabelEXT");
+    if (!debugUtils.createMessenger || !debugUtils.destroyMessenger) {
+        debugUtils = DebugUtils();
+        return true;
+    }
+
+    VkDebugUtilsMessengerCreateInfoEXT info = {};
+    info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+    info.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
+                           VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+    info.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
+                       VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+                       VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+    info.pfnUserCallback = onDebugMessage;
+    VkResult vkRet = debugUtils.createMessenger(instance, &info, nullptr,
+                                                &debugUtils.messenger);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateDebugUtilsMessengerEXT failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+void VulkanApp::destroyDebugUtils()
+{
+    if (debugUtils.messenger != VK_NULL_HANDLE)
+        debugUtils.destroyMessenger(instance, debugUtils.messenger, nullptr);
+    debugUtils = DebugUtils();
+}
+
+VKAPI_ATTR VkBool32 VKAPI_CALL VulkanApp::onDebugMessage(
+                         VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+                         VkDebugUtilsMessageTypeFlagsEXT /*types*/,
+                         const VkDebugUtilsMessengerCallbackDataEXT *data,
+                         void * /*user*/)
+{
+    // May be called from any thread the driver calls us on
+    const char *level =
+                  severity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT
+                ? "error" : "warning";
+    printf("Vulkan %s: %s\n", level, data->pMessage);
+    // The call that triggered it goes through
+    return VK_FALSE;
+}
+
+void VulkanApp::setObjectName(VkObjectType type, uint64_t handle,
+                              const char *name) const
+{
+    if (!debugUtils.setObjectName || handle == 0)
+        return;
+    VkDebugUtilsObjectNameInfoEXT info = {};
+    info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT;
+    info.objectType = type;
+    info.objectHandle = handle;
+    info.pObjectName = name;
+    debugUtils.setObjectName(device, &info);
+}
+
+void VulkanApp::beginLabel(VkCommandBuffer b, const char *name) const
+{
+    if (!debugUtils.beginLabel)
+        return;
+    VkDebugUtilsLabelEXT label = {};
+    label.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT;
+    label.pLabelName = name;
+    debugUtils.beginLabel(b, &label);
+}
+
+void VulkanApp::endLabel(VkCommandBuffer b) const
+{
+    if (debugUtils.endLabel)
+        debugUtils.endLabel(b);
+}
+#endif
+
+bool VulkanApp::createSurface() {
+    VkResult vkRet = glfwCreateWindowSurface(instance, window, nullptr,
+                                             &surface);
+    if (vkRet != VK_SUCCESS) {
+        printf("failed to create surface: glfwCreateWindowSurface() failed "
+               "with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+void VulkanApp::updateExtent()
+{
+    if (settings.headless) {
+        devInfo.extent = {defaultWidth, defaultHeight};
+        return;
+    }
+    // Not queried from glfw, this runs on the render thread
+    const int width = framebufferWidth;
+    const int height = framebufferHeight;
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(devInfo.device, surface,
+                                              &devInfo.capabilities);
+    if (devInfo.capabilities.currentExtent.width != UINT_MAX) {
+        devInfo.extent = devInfo.capabilities.currentExtent;
+    }
+    else {
+        devInfo.extent.width =
+            max(devInfo.capabilities.minImageExtent.width,
+                min(devInfo.capabilities.maxImageExtent.width,
+                    (unsigned) width));
+        devInfo.extent.height =
+            max(devInfo.capabilities.minImageExtent.height,
+                min(devInfo.capabilities.maxImageExtent.height,
+                    (unsigned) height));
+    }
+    devInfo.extent.width = width;
+    devInfo.extent.height = height;
+}
+
+bool VulkanApp::choosePhysicalDevice()
+{
+    uint32_t deviceCount = 0;
+    vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
+    if (deviceCount == 0) {
+        puts("Found no physical device");
+        return false;
+    }
+    VkPhysicalDevice devices[deviceCount];
+    vkEnumeratePhysicalDevices(instance, &deviceCount, devices);
+
+    // --device wins over the environment
+    const char *wanted = settings.device ? settings.device
+                                         : getenv("VULKANTEST_DEVICE");
+    struct Candidate {
+        uint32_t index;
+        int64_t score;
+        PhysicalDeviceInfo info;
+    };
+    vector<Candidate> candidates;
+    vector<string> unsuitable;
+    for (uint32_t i = 0; i < deviceCount; ++i) {
+        // Fills devInfo
+        if (inspectDevice(devices[i]))
+            candidates.push_back({i, scoreDevice(devInfo), devInfo});
+        else
+            unsuitable.push_back(devInfo.properties.deviceName);
+    }
+    stable_sort(candidates.begin(), candidates.end(),
+                [](const Candidate& a, const Candidate& b) {
+                    return a.score > b.score;
+                });
+    puts("Devices, best first:");
+    for (const auto& c : candidates) {
+        printf("  #%u %s: %s, %" PRIu64 " MiB, score %" PRId64 "\n", c.index,
+               c.info.properties.deviceName,
+               deviceTypeName(c.info.properties.deviceType),
+               (uint64_t) deviceLocalMemory(c.info.device) >> 20, c.score);
+    }
+    for (const auto& name : unsuitable)
+        printf("  %s: not suitable\n", name.c_str());
+
+    const Candidate *chosen = candidates.empty() ? nullptr : &candidates[0];
+    if (wanted) {
+        // Either an index or part of the name
+        char *end;
+        const unsigned long index = strtoul(wanted, &end, 10);
+        const bool byIndex = *wanted && !*end;
+        chosen = nullptr;
+        for (const auto& c : candidates) {
+            const char *name = c.info.properties.deviceName;
+            if (byIndex ? c.index == index : strstr(name, wanted) != nullptr) {
+                chosen = &c;
+                break;
+            }
+        }
+        if (!chosen) {
+            printf("No suitable device matches %s\n", wanted);
+            return false;
+        }
+    }
+    if (!chosen) {
+        puts("Found no suitable physical device");
+        return false;
+    }
+
+    devInfo = chosen->info;
+    if (settings.headless) {
+        printf("Using device %s, headless\n", devInfo.properties.deviceName);
+    }
+    else {
+        printf("Using device %s, %s present policy (mode %d)\n",
+               devInfo.properties.deviceName,
+               presentPolicyName(settings.presentPolicy), devInfo.presentMode);
+    }
+    return true;
+}
+
+bool VulkanApp::inspectDevice(VkPhysicalDevice physicalDevice)
+{
+    // We're looking for a device that has
+    // * graphics family queue
+    // * presentation family queue
+    // * swap chain khr extension
+    // * valid swap chain format/present mode
+    devInfo = PhysicalDeviceInfo();
+    VkPhysicalDeviceProperties& properties = devInfo.properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    vkGetPhysicalDeviceFeatures(physicalDevice, &devInfo.deviceFeatures);
+
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+                                         &extensionCount, nullptr);
+    if (extensionCount == 0)
+        return false;
+
+    VkExtensionProperties extProps[extensionCount];
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+                                         &extensionCount, extProps);
+    bool hasSwapChain = false;
+    for (unsigned k = 0; k < extensionCount; ++k) {
+        if (0 == strcmp(extProps[k].extensionName,
+                        VK_KHR_SWAPCHAIN_EXTENSION_NAME))
+            hasSwapChain = true;
+#ifdef VK_KHR_timeline_semaphore
+        if (0 == strcmp(extProps[k].extensionName,
+                        VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+            devInfo.hasTimelineSemaphore = hasProperties2;
+#endif
+    }
+    if (!hasSwapChain && !settings.headless)
+        return false;
+#ifdef VK_KHR_timeline_semaphore
+    if (devInfo.hasTimelineSemaphore) {
+        // The extension may be there without the feature
+        auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)
+                vkGetInstanceProcAddr(instance,
+                                      "vkGetPhysicalDeviceFeatures2KHR");
+        VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+        timelineFeatures.sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+        VkPhysicalDeviceFeatures2KHR features = {};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+        features.pNext = &timelineFeatures;
+        if (getFeatures2)
+            getFeatures2(physicalDevice, &features);
+        devInfo.hasTimelineSemaphore = timelineFeatures.timelineSemaphore;
+    }
+#endif
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                             nullptr);
+    VkQueueFamilyProperties queueProps[queueFamilyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                             queueProps);
+    uint32_t graphicsFamily;
+    uint32_t presentationFamily;
+    bool graphicsFamilySet = false;
+    bool presentationFamilySet = false;
+    for (unsigned j = 0; j != queueFamilyCount; ++j) {
+        if (queueProps[j].queueCount <= 0)
+            continue;
+
+        if (queueProps[j].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            graphicsFamily = j;
+            graphicsFamilySet = true;
+        }
+        if (settings.headless)
+            continue;
+        VkBool32 presentSupport = false;
+        vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, j, surface,
+                                             &presentSupport);
+        if (presentSupport) {
+            presentationFamily = j;
+            presentationFamilySet = true;
+        }
+    }
+    if (graphicsFamilySet && settings.headless) {
+        // Nothing is presented, make the graphics queue do it
+        presentationFamily = graphicsFamily;
+        presentationFamilySet = true;
+    }
+    if (!presentationFamilySet || !graphicsFamilySet)
+        return false;
+
+    // A transfer only family maps to the DMA engines of discrete GPUs.
+    // Failing that, anything without graphics will do.
+    uint32_t transferFamily = graphicsFamily;
+    int transferScore = 0;
+    for (unsigned j = 0; j != queueFamilyCount; ++j) {
+        const VkQueueFlags flags = queueProps[j].queueFlags;
+        if (queueProps[j].queueCount == 0
+         || !(flags & VK_QUEUE_TRANSFER_BIT)
+         || (flags & VK_QUEUE_GRAPHICS_BIT))
+            continue;
+        const int score = (flags & VK_QUEUE_COMPUTE_BIT) ? 1 : 2;
+        if (score > transferScore) {
+            transferFamily = j;
+            transferScore = score;
+        }
+    }
+    // Async compute wants a compute family without graphics, better if
+    // it is not the one doing the transfers
+    uint32_t computeFamily = graphicsFamily;
+    int computeScore = 0;
+    for (unsigned j = 0; j != queueFamilyCount; ++j) {
+        const VkQueueFlags flags = queueProps[j].queueFlags;
+        if (queueProps[j].queueCount == 0
+         || !(flags & VK_QUEUE_COMPUTE_BIT)
+         || (flags & VK_QUEUE_GRAPHICS_BIT))
+            continue;
+        const int score = j == transferFamily ? 1 : 2;
+        if (score > computeScore) {
+            computeFamily = j;
+            computeScore = score;
+        }
+    }
+
+    devInfo.families[0] = graphicsFamily;
+    devInfo.families[1] = presentationFamily;
+    devInfo.transferFamily = transferFamily;
+    devInfo.computeFamily = computeFamily;
+    devInfo.timestampValidBits = queueProps[graphicsFamily].timestampValidBits;
+
+    // One of the first two is mandatory
+    const VkFormat depthFormats[] = {VK_FORMAT_D32_SFLOAT,
+                                     VK_FORMAT_X8_D24_UNORM_PACK32,
+                                     VK_FORMAT_D16_UNORM};
+    devInfo.depthFormat = VK_FORMAT_UNDEFINED;
+    for (VkFormat format : depthFormats) {
+        VkFormatProperties props;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &props);
+        if (props.optimalTilingFeatures &
+                               VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            devInfo.depthFormat = format;
+            break;
+        }
+    }
+    if (devInfo.depthFormat == VK_FORMAT_UNDEFINED)
+        return false;
+
+    if (settings.headless) {
+        // Offscreen images use the format we'd pick for a surface,
+        // which is mandatory as a color attachment.
+        devInfo.device = physicalDevice;
+        devInfo.format = {VK_FORMAT_B8G8R8A8_UNORM,
+                          VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+        devInfo.presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+        devInfo.presentModes = {devInfo.presentMode};
+        devInfo.imageCount = 3;
+        updateExtent();
+        return true;
+    }
+
+    uint32_t formatCount;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &formatCount,
+                                         nullptr);
+    if (0 == formatCount) {
+        return false;
+    }
+    uint32_t presentModeCount;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface,
+                                              &presentModeCount,
+                                              nullptr);
+    if (0 == presentModeCount) {
+        return false;
+    }
+
+    // Ok, the device is usable.  Populate devInfo
+    devInfo.device = physicalDevice;
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface,
+                                              &devInfo.capabilities);
+    updateExtent();
+
+    VkSurfaceFormatKHR formats[formatCount];
+    vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface,
+                                         &formatCount, formats);
+    devInfo.format = chooseSwapSurfaceFormat(formats, formatCount);
+
+    devInfo.presentModes.resize(presentModeCount);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface,
+                                              &presentModeCount,
+                                              devInfo.presentModes.data());
+    devInfo.presentMode = choosePresentMode(settings.presentPolicy);
+
+    uint32_t imgCount = devInfo.capabilities.minImageCount + 1;
+    if (devInfo.capabilities.maxImageCount > 0)
+        imgCount = min(devInfo.capabilities.maxImageCount, imgCount);
+    devInfo.imageCount = imgCount;
+    return true;
+}
+
+int64_t VulkanApp::scoreDevice(const PhysicalDeviceInfo& info) const
+{
+    // The device type dominates: a discrete GPU beats an integrated one
+    // whatever the rest.  Then the memory, the limits we push against, the
+    // optional features and the queue topology break the ties.
+    int64_t score = 0;
+    switch (info.properties.deviceType) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        score += 100000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        score += 50000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        score += 20000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        score += 1000;
+        break;
+    default:
+        break;
+    }
+    // A point per 16MiB, integrated GPUs report a share of system memory
+    score += min<int64_t>(deviceLocalMemory(info.device) >> 24, 10000);
+
+    const VkPhysicalDeviceLimits& limits = info.properties.limits;
+    score += limits.maxImageDimension2D / 1024;
+    score += limits.maxComputeWorkGroupInvocations / 64;
+    const VkSampleCountFlags samples = limits.framebufferColorSampleCounts;
+    if (samples & VK_SAMPLE_COUNT_8_BIT)
+        score += 50;
+    else if (samples & VK_SAMPLE_COUNT_4_BIT)
+        score += 25;
+
+    if (info.deviceFeatures.multiDrawIndirect)
+        score += 100;
+    if (info.deviceFeatures.drawIndirectFirstInstance)
+        score += 50;
+    if (info.timestampValidBits > 0)
+        score += 100;
+
+    if (info.hasTransferFamily())
+        score += 200;
+    if (info.hasComputeFamily())
+        score += 200;
+    if (info.hasUniqueFamily())
+        score += 50;
+    return score;
+}
+
+VkDeviceSize VulkanApp::deviceLocalMemory(VkPhysicalDevice physicalDevice)
+{
+    // Largest device local heap
+    VkPhysicalDeviceMemoryProperties memProps;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProps);
+    VkDeviceSize size = 0;
+    for (uint32_t i = 0; i < memProps.memoryHeapCount; ++i) {
+        if (memProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            size = max(size, memProps.memoryHeaps[i].size);
+    }
+    return size;
+}
+
+const char *VulkanApp::deviceTypeName(VkPhysicalDeviceType type)
+{
+    switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        return "discrete";
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        return "integrated";
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        return "virtual";
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        return "cpu";
+    default:
+        return "other";
+    }
+}
+
+// Create logical device
+bool VulkanApp::createLogicalDevice() {
+    // One queue per distinct family
+    uint32_t families[4];
+    uint32_t numQueues = 0;
+    const uint32_t wanted[] = {devInfo.families[0], devInfo.families[1],
+                               devInfo.transferFamily, devInfo.computeFamily};
+    for (uint32_t family : wanted) {
+        if (find(families, families + numQueues, family) ==
+                                                      families + numQueues)
+            families[numQueues++] = family;
+    }
+
+    VkDeviceQueueCreateInfo queueCreateInfo[numQueues];
+    memset(queueCreateInfo, 0, sizeof(queueCreateInfo));
+    float priority[1] = {1.0f};
+    for (unsigned i = 0; i < numQueues; ++i) {
+        queueCreateInfo[i].sType =
+                                VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queueCreateInfo[i].queueFamilyIndex = families[i];
+        // Only one queue of each type
+        queueCreateInfo[i].queueCount = 1;
+        queueCreateInfo[i].pQueuePriorities = priority;
+    }
+
+    // Note that we've already verified what we need is supported when
+    // picking the physical device.
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(devInfo.device, nullptr,
+                                         &extensionCount, nullptr);
+    VkExtensionProperties extProps[extensionCount];
+    vkEnumerateDeviceExtensionProperties(devInfo.device, nullptr,
+                                         &extensionCount, extProps);
+    char *extNames[extensionCount];
+    for (unsigned i = 0; i < extensionCount; ++i) {
+        extNames[i] = extProps[i].extensionName;
+    }
+
+    VkDeviceCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    createInfo.pQueueCreateInfos = queueCreateInfo;
+    createInfo.queueCreateInfoCount = numQueues;
+    createInfo.pEnabledFeatures = &devInfo.deviceFeatures;
+    createInfo.enabledExtensionCount = extensionCount;
+    createInfo.ppEnabledExtensionNames = extNames;
+    createInfo.enabledLayerCount = 0;
+    timeline.enabled = settings.timelineSync && devInfo.hasTimelineSemaphore;
+    if (settings.timelineSync && !timeline.enabled)
+        printf("No timeline semaphores, synchronizing with fences\n");
+#ifdef VK_KHR_timeline_semaphore
+    // The extension is enabled with all the others, not the feature
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+    timelineFeatures.sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+    timelineFeatures.timelineSemaphore = VK_TRUE;
+    if (timeline.enabled)
+        createInfo.pNext = &timelineFeatures;
+#endif
+#ifdef VULKANTEST_DEBUG
+    // Device layers are deprecated, but the loaders of the 1.0 SDKs still
+    // want them
+    createInfo.enabledLayerCount = layers.size();
+    createInfo.ppEnabledLayerNames = layers.data();
+#endif
+
+    VkResult vkRet = vkCreateDevice(devInfo.device, &createInfo, nullptr,
+                                    &device);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateDevice failed with %d\n", vkRet);
+        return false;
+    }
+#ifdef VK_KHR_timeline_semaphore
+    if (timeline.enabled) {
+        timeline.waitSemaphores = (PFN_vkWaitSemaphoresKHR)
+                vkGetDeviceProcAddr(device, "vkWaitSemaphoresKHR");
+        timeline.counterValue = (PFN_vkGetSemaphoreCounterValueKHR)
+                vkGetDeviceProcAddr(device, "vkGetSemaphoreCounterValueKHR");
+    }
+#endif
+    vkGetDeviceQueue(device, devInfo.families[0], 0, &graphicsQueue);
+    vkGetDeviceQueue(device, devInfo.families[1], 0, &presentationQueue);
+    vkGetDeviceQueue(device, devInfo.transferFamily, 0, &transferQueue);
+    vkGetDeviceQueue(device, devInfo.computeFamily, 0, &computeQueue);
+    nameObject(VK_OBJECT_TYPE_QUEUE, graphicsQueue, "graphics queue");
+    if (devInfo.hasTransferFamily())
+        nameObject(VK_OBJECT_TYPE_QUEUE, transferQueue, "transfer queue");
+    if (devInfo.hasComputeFamily())
+        nameObject(VK_OBJECT_TYPE_QUEUE, computeQueue, "compute queue");
+    if (devInfo.hasTransferFamily())
+        printf("Using dedicated transfer family %u\n", devInfo.transferFamily);
+    if (devInfo.hasComputeFamily())
+        printf("Using dedicated compute family %u\n", devInfo.computeFamily);
+    descriptors.init(device, MAX_FRAMES_IN_FLIGHT);
+    return allocator.init(devInfo.device, device);
+}
+
+bool VulkanApp::validatePipelineCache(const vector<char>& data)
+{
+    const VkPhysicalDeviceProperties& props = devInfo.properties;
+    PipelineCacheFileHeader header;
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != pipelineCacheMagic
+     || header.dataSize != data.size() - sizeof(header)
+     || header.vendorID != props.vendorID
+     || header.deviceID != props.deviceID
+     || header.driverVersion != props.driverVersion
+     || memcmp(header.uuid, props.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+        return false;
+
+    // Also check the header written by the driver itself, drivers are
+    // supposed to do it but some of them happily crash on a foreign blob.
+    // Layout is VkPipelineCacheHeaderVersionOne:
+    // length, version, vendor id, device id, uuid
+    uint32_t driverHeader[4];
+    if (header.dataSize < sizeof(driverHeader) + VK_UUID_SIZE)
+        return false;
+    const char *blob = data.data() + sizeof(header);
+    memcpy(driverHeader, blob, sizeof(driverHeader));
+    return driverHeader[0] >= sizeof(driverHeader) + VK_UUID_SIZE
+        && driverHeader[1] == 1 // VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        && driverHeader[2] == props.vendorID
+        && driverHeader[3] == props.deviceID
+        && memcmp(blob + sizeof(driverHeader), props.pipelineCacheUUID,
+                  VK_UUID_SIZE) == 0;
+}
+
+bool VulkanApp::createPipelineCache()
+{
+    // Warm load whatever the previous run left behind.  A missing or stale
+    // file is not an error, we just start with an empty cache.
+    vector<char> data = move(startupFiles.pipelineCache);
+    const char *initialData = nullptr;
+    size_t initialSize = 0;
+    // Read by loadStartupFiles()
+    if (startupFiles.hasPipelineCache) {
+        if (validatePipelineCache(data)) {
+            initialData = data.data() + sizeof(PipelineCacheFileHeader);
+            initialSize = data.size() - sizeof(PipelineCacheFileHeader);
+            printf("Loaded %zu bytes of pipeline cache\n", initialSize);
+        }
+        else {
+            printf("Ignoring stale pipeline cache %s\n", pipelineCacheFile);
+        }
+    }
+
+    VkPipelineCacheCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.initialDataSize = initialSize;
+    createInfo.pInitialData = initialData;
+
+    VkResult vkRet = vkCreatePipelineCache(device, &createInfo, nullptr,
+                                           &pipelineCache);
+    if (vkRet != VK_SUCCESS && initialData) {
+        // Retry without the initial data
+        printf("vkCreatePipelineCache failed with %d, starting empty\n",
+               vkRet);
+        createInfo.initialDataSize = 0;
+        createInfo.pInitialData = nullptr;
+        vkRet = vkCreatePipelineCache(device, &createInfo, nullptr,
+                                      &pipelineCache);
+    }
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreatePipelineCache failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+void VulkanApp::savePipelineCache()
+{
+    size_t size = 0;
+    VkResult vkRet = vkGetPipelineCacheData(device, pipelineCache, &size,
+                                            nullptr);
+    if (vkRet != VK_SUCCESS || size == 0)
+        return;
+
+    const VkPhysicalDeviceProperties& props = devInfo.properties;
+    PipelineCacheFileHeader header;
+    header.magic = pipelineCacheMagic;
+    header.dataSize = size;
+    header.vendorID = props.vendorID;
+    header.deviceID = props.deviceID;
+    header.driverVersion = props.driverVersion;
+    memcpy(header.uuid, props.pipelineCacheUUID, VK_UUID_SIZE);
+
+    vector<char> data(sizeof(header) + size);
+    memcpy(data.data(), &header, sizeof(header));
+    vkRet = vkGetPipelineCacheData(device, pipelineCache, &size,
+                                   data.data() + sizeof(header));
+    if (vkRet != VK_SUCCESS) {
+        printf("vkGetPipelineCacheData failed with %d\n", vkRet);
+        return;
+    }
+
+    // Write to a temporary file first so that a crash never leaves a
+    // truncated cache behind
+    char tmpName[256];
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", pipelineCacheFile);
+    FILE *fd = fopen(tmpName, "wb");
+    if (!fd) {
+        printf("Could not write %s\n", tmpName);
+        return;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), fd) == data.size();
+    ok = fclose(fd) == 0 && ok;
+    if (!ok || rename(tmpName, pipelineCacheFile) != 0) {
+        printf("Could not save pipeline cache to %s\n", pipelineCacheFile);
+        remove(tmpName);
+    }
+}
+
+bool VulkanApp::createSwapChain(VkSwapchainKHR oldSwapChain)
+{
+    if (settings.headless)
+        return createOffscreenImages();
+
+    VkSwapchainCreateInfoKHR createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+    createInfo.surface = surface;
+    createInfo.minImageCount = devInfo.imageCount;
+    createInfo.imageFormat = devInfo.format.format;
+    createInfo.imageColorSpace = devInfo.format.colorSpace;
+    createInfo.imageExtent = devInfo.extent;
+    createInfo.imageArrayLayers = 1;
+    createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                            (settings.dynamicResolution > 0.0
+                           ? VK_IMAGE_USAGE_TRANSFER_DST_BIT : 0);
+    createInfo.imageSharingMode = devInfo.hasUniqueFamily()
+                                ? VK_SHARING_MODE_EXCLUSIVE
+                                : VK_SHARING_MODE_CONCURRENT;
+    createInfo.queueFamilyIndexCount = devInfo.hasUniqueFamily() ? 0 : 2;
+    createInfo.pQueueFamilyIndices = devInfo.hasUniqueFamily()
+                                   ? nullptr
+                                   : devInfo.families;
+    createInfo.preTransform = devInfo.capabilities.currentTransform;
+    createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+    createInfo.presentMode = devInfo.presentMode;
+    createInfo.clipped = VK_TRUE;
+    // Handing over the old swap chain lets the presentation engine reuse its
+    // resources and keep presenting while we switch.
+    createInfo.oldSwapchain = oldSwapChain;
+
+    VkResult vkRet = vkCreateSwapchainKHR(device, &createInfo, nullptr,
+                                          &vkSwapChain);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateSwapchainKHR failed with %d\n", vkRet);
+        return false;
+    }
+    // Vulkan is allowed to create a bigger swap chain than requested so let's
+    // figure out the size
+    uint32_t size;
+    vkGetSwapchainImagesKHR(device, vkSwapChain, &size, nullptr);
+
+    swapChain.resize(size);
+
+    // Now get the images
+    VkImage images[size];
+    vkGetSwapchainImagesKHR(device, vkSwapChain, &size, images);
+    for (uint32_t i = 0; i < size; ++i) {
+        swapChain[i].image = images[i];
+    }
+    return createImageViews();
+}
+
+bool VulkanApp::createOffscreenImages()
+{
+    // Stand-ins for the swap chain images when headless.  They are never
+    // read, TRANSFER_SRC is there so that they could be.  The upscale
+    // writes them with dynamic resolution.
+    swapChain.resize(devInfo.imageCount);
+    for (auto& swpe : swapChain) {
+        VkImageCreateInfo imageInfo = {};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.format = devInfo.format.format;
+        imageInfo.extent = {devInfo.extent.width, devInfo.extent.height, 1};
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                          VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                          VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        if (!allocator.createImage(imageInfo,
+                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                                   &swpe.image, &swpe.memory))
+            return false;
+    }
+    return createImageViews();
+}
+
+bool VulkanApp::createImageViews()
+{
+    for (auto& swpe : swapChain) {
+        // Image views
+        VkImageViewCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        createInfo.image = swpe.image;
+        createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        createInfo.format = devInfo.format.format;
+
+        createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+        createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+        createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+        createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+        createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        createInfo.subresourceRange.baseMipLevel = 0;
+        createInfo.subresourceRange.levelCount = 1;
+        createInfo.subresourceRange.baseArrayLayer = 0;
+        createInfo.subresourceRange.layerCount = 1;
+
+        VkResult vkRet = vkCreateImageView(device, &createInfo, nullptr,
+                                           &swpe.view);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateImageView failed with %d\n", vkRet);
+            return false;
+        }
+    }
+    return true;
+}
+
+VkSampleCountFlagBits VulkanApp::chooseSampleCount(uint32_t requested) const
+{
+    // Highest supported count not above the requested one.  1 is always
+    // supported.
+    const VkSampleCountFlags supported =
+                    devInfo.properties.limits.framebufferColorSampleCounts;
+    uint32_t count = 1;
+    for (uint32_t c = 2; c <= requested && c <= VK_SAMPLE_COUNT_8_BIT; c *= 2) {
+        if (supported & c)
+            count = c;
+    }
+    if (count != requested)
+        printf("%ux MSAA is not supported, using %ux\n", requested, count);
+    return (VkSampleCountFlagBits) count;
+}
+
+VkSampleCountFlagBits VulkanApp::nextSampleCount(
+                                      VkSampleCountFlagBits current) const
+{
+    // Cycle through 1, 2, 4, 8 skipping what the device can't do
+    const VkSampleCountFlags supported =
+            devInfo.properties.limits.framebufferColorSampleCounts;
+    uint32_t c = current;
+    do {
+        c = c >= VK_SAMPLE_COUNT_8_BIT ? 1 : c * 2;
+    } while (c != 1 && !(supported & c));
+    return (VkSampleCountFlagBits) c;
+}
+
+bool VulkanApp::setSampleCount(VkSampleCountFlagBits samples)
+{
+    // The render pass, the pipeline and everything bound to them depend on
+    // the sample count.  The old render pass may still be in use by frames
+    // in flight so it goes through the deletion queue.  Pipelines are kept
+    // for every sample count.
+    printf("Switching to %ux MSAA\n", samples);
+    VkRenderPass oldRenderPass = renderPass;
+    deferDestroy([this, oldRenderPass]() {
+        vkDestroyRenderPass(device, oldRenderPass, nullptr);
+    });
+    retireFrameBuffers();
+
+    msaaSamples = samples;
+    pendingMsaaSamples = samples;
+    if (!createRenderPass(samples, &renderPass)
+     || !usePipeline(samples)
+     || !createFrameBuffers()
+     || !createCommandBuffers()
+     || !setupCommandBuffers())
+        return false;
+    reportMsaaMemory();
+    return true;
+}
+
+void VulkanApp::reportMsaaMemory() const
+{
+    printf("Depth target: %.1f MB\n",
+           depthTarget.memory.size / (1024.0 * 1024.0));
+    if (msaaSamples == VK_SAMPLE_COUNT_1_BIT) {
+        printf("MSAA disabled\n");
+        return;
+    }
+    // One per swap chain image is what it used to cost
+    printf("%ux MSAA target: %.1f MB shared by %zu images, saving %.1f MB\n",
+           msaaSamples, msaaTarget.memory.size / (1024.0 * 1024.0),
+           swapChain.size(),
+           msaaTarget.memory.size * (swapChain.size() - 1) / (1024.0 * 1024.0));
+}
+
+bool VulkanApp::createMsaaTarget(RenderTarget *target)
+{
+    VkImageCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    info.imageType = VK_IMAGE_TYPE_2D;
+    info.format = devInfo.format.format;
+    info.extent.width = devInfo.extent.width;
+    info.extent.height = devInfo.extent.height;
+    info.extent.depth = 1;
+    info.mipLevels = 1;
+    info.arrayLayers = 1;
+    info.samples = msaaSamples;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    // This image will only be used as a transient render target.  Its
+    // purpose is only to hold the multisampled data before resolving the
+    // render pass.
+    info.usage = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+                 VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // For multisampled attachments, we will want to use LAZILY allocated
+    // memory if such a type is available.
+    if (!allocator.createImage(info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                               VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
+                               &target->image, &target->memory))
+        return false;
+    return createView(target->image, devInfo.format.format,
+                      VK_IMAGE_ASPECT_COLOR_BIT, &target->view);
+}
+
+bool VulkanApp::createDepthTarget(RenderTarget *target)
+{
+    // Same deal as the MSAA target: cleared at the start of the render
+    // pass and dropped at the end, so it can live in lazily allocated
+    // memory, which on tilers means it never leaves the tile memory.
+    VkImageCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    info.imageType = VK_IMAGE_TYPE_2D;
+    info.format = devInfo.depthFormat;
+    info.extent.width = devInfo.extent.width;
+    info.extent.height = devInfo.extent.height;
+    info.extent.depth = 1;
+    info.mipLevels = 1;
+    info.arrayLayers = 1;
+    info.samples = msaaSamples;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    info.usage = VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+                 VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (!allocator.createImage(info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                               VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
+                               &target->image, &target->memory))
+        return false;
+    return createView(target->image, devInfo.depthFormat,
+                      VK_IMAGE_ASPECT_DEPTH_BIT, &target->view);
+}
+
+bool VulkanApp::createSceneTarget(RenderTarget *target)
+{
+    // Written by the render pass and read by the upscale, it has to live
+    // in memory
+    VkImageCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    info.imageType = VK_IMAGE_TYPE_2D;
+    info.format = devInfo.format.format;
+    info.extent.width = devInfo.extent.width;
+    info.extent.height = devInfo.extent.height;
+    info.extent.depth = 1;
+    info.mipLevels = 1;
+    info.arrayLayers = 1;
+    info.samples = VK_SAMPLE_COUNT_1_BIT;
+    info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                 VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (!allocator.createImage(info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                               &target->image, &target->memory))
+        return false;
+    return createView(target->image, devInfo.format.format,
+                      VK_IMAGE_ASPECT_COLOR_BIT, &target->view);
+}
+
+bool VulkanApp::canUpscale() const
+{
+    // Blitting from the scene target into the swap chain images, with a
+    // linear filter
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(devInfo.device, devInfo.format.format,
+                                        &props);
+    const VkFormatFeatureFlags blit =
+                            VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+                            VK_FORMAT_FEATURE_BLIT_DST_BIT |
+                            VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    if ((props.optimalTilingFeatures & blit) != blit)
+        return false;
+    return settings.headless || (devInfo.capabilities.supportedUsageFlags &
+                                 VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+}
+
+VkExtent2D VulkanApp::renderExtent() const
+{
+    VkExtent2D extent;
+    extent.width = max(1U, (uint32_t) (devInfo.extent.width * renderScale));
+    extent.height = max(1U, (uint32_t) (devInfo.extent.height * renderScale));
+    return extent;
+}
+
+bool VulkanApp::createView(VkImage image, VkFormat format,
+                           VkImageAspectFlags aspect, VkImageView *view,
+                           uint32_t levelCount)
+{
+    VkImageViewCreateInfo viewInfo = { };
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewInfo.format = format;
+    viewInfo.components.r = VK_COMPONENT_SWIZZLE_R;
+    viewInfo.components.g = VK_COMPONENT_SWIZZLE_G;
+    viewInfo.components.b = VK_COMPONENT_SWIZZLE_B;
+    viewInfo.components.a = VK_COMPONENT_SWIZZLE_A;
+    viewInfo.subresourceRange.aspectMask = aspect;
+    viewInfo.subresourceRange.levelCount = levelCount;
+    viewInfo.subresourceRange.layerCount = 1;
+
+    VkResult vkRet = vkCreateImageView(device, &viewInfo, nullptr, view);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateImageView failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+void VulkanApp::destroyRenderTarget(const RenderTarget& target)
+{
+    vkDestroyImageView(device, target.view, nullptr);
+    allocator.destroyImage(target.image, target.memory);
+}
+
+bool VulkanApp::loadShaders() {
+    if (!settings.shaderDir) {
+        return createShaderModule(vertexSpirv, sizeof(vertexSpirv),
+                                  &vertexShader)
+            && createShaderModule(fragmentSpirv, sizeof(fragmentSpirv),
+                                  &fragShader);
+    }
+    // Mapped by loadStartupFiles()
+    const string dir = settings.shaderDir;
+    const bool ok = createShaderModule((dir + "/vertex.spv").c_str(),
+                                       startupFiles.vertexSpirv,
+                                       &vertexShader)
+                 && createShaderModule((dir + "/fragment.spv").c_str(),
+                                       startupFiles.fragmentSpirv,
+                                       &fragShader);
+    unmapFile(startupFiles.vertexSpirv);
+    unmapFile(startupFiles.fragmentSpirv);
+    startupFiles.vertexSpirv = MappedFile();
+    startupFiles.fragmentSpirv = MappedFile();
+    return ok;
+}
+
+bool VulkanApp::createShaderModule(const uint32_t *code, size_t size,
+                                   VkShaderModule *module)
+{
+    VkShaderModuleCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    createInfo.codeSize = size;
+    createInfo.pCode = code;
+
+    VkResult vkRet = vkCreateShaderModule(device, &createInfo, nullptr,
+                                          module);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateShaderModule failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+bool VulkanApp::createShaderModule(const char *filename,
+                                   VkShaderModule *module)
+{
+    MappedFile file;
+    mapFile(filename, &file);
+    const bool ok = createShaderModule(filename, file, module);
+    unmapFile(file);
+    return ok;
+}
+
+bool VulkanApp::createShaderModule(const char *filename,
+                                   const MappedFile& file,
+                                   VkShaderModule *module)
+{
+    // The module is created straight from the mapping, which is page
+    // aligned as SPIR-V words need to be.
+    if (!file.data) {
+        printf("Could not read %s\n", filename);
+        return false;
+    }
+    if (file.size % sizeof(uint32_t)) {
+        printf("%s is not SPIR-V\n", filename);
+        return false;
+    }
+    return createShaderModule((const uint32_t *) file.data, file.size,
+                              module);
+}
+
+bool VulkanApp::createRenderPass(VkSampleCountFlagBits samples,
+                                 VkRenderPass *pass) const
+{
+    // Also called from the pipeline compiler threads
+    const bool msaa = samples != VK_SAMPLE_COUNT_1_BIT;
+    // Layout the image is left in for presentation, or for the upscale
+    // with dynamic resolution
+    const bool upscale = settings.dynamicResolution > 0.0;
+    const VkImageLayout presentLayout = settings.headless || upscale
+                                      ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                      : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    // MSAA attachment
+    // from https://arm-software.github.io/vulkan-sdk/multisampling.html
+    VkAttachmentDescription attachments[3];
+    memset(attachments, 0, sizeof(attachments));
+    attachments[0].format = devInfo.format.format;
+    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[0].samples = samples;
+    // With MSAA, don't write to memory, we just want to compute
+    attachments[0].storeOp = msaa ? VK_ATTACHMENT_STORE_OP_DONT_CARE
+                                  : VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // with MSAA this does not go to the presentation
+    attachments[0].finalLayout = msaa ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+                                      : presentLayout;
+
+    // Resolve attachment, only used with MSAA
+    attachments[1].format = devInfo.format.format;
+    attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attachments[1].finalLayout = presentLayout;
+
+    // Depth, last.  Only needed during the pass.
+    const uint32_t depthIndex = msaa ? 2 : 1;
+    VkAttachmentDescription& depth = attachments[depthIndex];
+    depth.format = devInfo.depthFormat;
+    depth.samples = samples;
+    depth.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference colorRef = {};
+    colorRef.attachment = 0;
+    colorRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference resolveRef = {};
+    resolveRef.attachment = 1;
+    resolveRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference depthRef = {};
+    depthRef.attachment = depthIndex;
+    depthRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    // The color attachment is referenced by
+    // 'layout (location = 0) out vec4 outColor' in the frag shader
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &colorRef;
+    subpass.pResolveAttachments = msaa ? &resolveRef : nullptr;
+    subpass.pDepthStencilAttachment = &depthRef;
+
+    VkRenderPassCreateInfo renderPassInfo = {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = depthIndex + 1;
+    renderPassInfo.pAttachments = attachments;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+
+    VkSubpassDependency dependencies[2] = {};
+    VkSubpassDependency& dependency = dependencies[0];
+    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.dstSubpass = 0;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                              VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                              (upscale ? VK_PIPELINE_STAGE_TRANSFER_BIT : 0);
+    // The MSAA, depth and scene targets are shared between frames: order
+    // our writes after the ones of the previous render pass, and after the
+    // previous upscale read the scene target.
+    dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                               VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                              VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                               VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                               VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                               VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    // The upscale reads what the pass wrote
+    VkSubpassDependency& upscaleDependency = dependencies[1];
+    upscaleDependency.srcSubpass = 0;
+    upscaleDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    upscaleDependency.srcStageMask =
+                                 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    upscaleDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    upscaleDependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    upscaleDependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    renderPassInfo.dependencyCount = upscale ? 2 : 1;
+    renderPassInfo.pDependencies = dependencies;
+
+    VkResult vkRet =  vkCreateRenderPass(device, &renderPassInfo, nullptr,
+                                         pass);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateRenderPass failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+// Pipeline setup
+
+bool VulkanApp::createPipelineLayout()
+{
+    // The frame uniforms are also read by the culling pass
+    VkDescriptorSetLayoutBinding bindings[2] = {};
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    bindings[0].descriptorCount = 1;
+    bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT |
+                             VK_SHADER_STAGE_COMPUTE_BIT;
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    bindings[1].descriptorCount = 1;
+    bindings[1].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = {};
+    setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    setLayoutInfo.bindingCount = 2;
+    setLayoutInfo.pBindings = bindings;
+    VkResult vkRet = vkCreateDescriptorSetLayout(device, &setLayoutInfo,
+                                                 nullptr, &frameSetLayout);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateDescriptorSetLayout failed with %d\n", vkRet);
+        return false;
+    }
+
+    // Set 1 is the texture of the draw
+    VkDescriptorSetLayoutBinding textureBinding = {};
+    textureBinding.binding = 0;
+    textureBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    textureBinding.descriptorCount = 1;
+    textureBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    setLayoutInfo.bindingCount = 1;
+    setLayoutInfo.pBindings = &textureBinding;
+    vkRet = vkCreateDescriptorSetLayout(device, &setLayoutInfo, nullptr,
+                                        &streamer.setLayout);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateDescriptorSetLayout failed with %d\n", vkRet);
+        return false;
+    }
+
+    VkPushConstantRange pushRange = {};
+    pushRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    pushRange.size = sizeof(DrawPushConstants);
+
+    const VkDescriptorSetLayout setLayouts[] = {frameSetLayout,
+                                                streamer.setLayout};
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+    pipelineLayoutInfo.sType =
+                            VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 2;
+    pipelineLayoutInfo.pSetLayouts = setLayouts;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushRange;
+
+    vkRet = vkCreatePipelineLayout(device, &pipelineLayoutInfo,
+                                   nullptr, &pipelineLayout);
+    if (vkRet != VK_SUCCESS) {
+       printf("vkCreatePipelineLayout failed with ret %d\n", vkRet);
+       return false;
+    }
+    return true;
+}
+
+bool VulkanApp::buildPipeline(VkSampleCountFlagBits samples,
+                              VkRenderPass pass, VkShaderModule vertModule,
+                              VkShaderModule fragModule,
+                              VkPipeline *pipeline) const
+{
+    // Runs on the pipeline compiler threads: only reads state that doesn't
+    // change once initialized.
+    // Stader stages
+    VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
+    vertShaderStageInfo.sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    vertShaderStageInfo.module = vertModule;
+    vertShaderStageInfo.pName = "main";
+
+    VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
+    fragShaderStageInfo.sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    fragShaderStageInfo.module = fragModule;
+    fragShaderStageInfo.pName = "main";
+    VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
+                                                      fragShaderStageInfo};
+
+    // fixed function stages
+    // Vertices: position at location 0, color at location 1, either
+    // interleaved in one binding or in one binding each.  Instance data
+    // comes last, in locations 2 to 4.
+    VkVertexInputBindingDescription bindings[3] = {};
+    VkVertexInputAttributeDescription attributes[6] = {};
+    attributes[0].location = 0;
+    attributes[0].format = VK_FORMAT_R32G32_SFLOAT;
+    attributes[1].location = 1;
+    attributes[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+    uint32_t bindingCount;
+    if (settings.splitVertexStreams) {
+        bindings[0].binding = 0;
+        bindings[0].stride = sizeof(Vertex::pos);
+        bindings[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        bindings[1].binding = 1;
+        bindings[1].stride = sizeof(Vertex::color);
+        bindings[1].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        attributes[0].binding = 0;
+        attributes[0].offset = 0;
+        attributes[1].binding = 1;
+        attributes[1].offset = 0;
+        bindingCount = 2;
+    }
+    else {
+        bindings[0].binding = 0;
+        bindings[0].stride = sizeof(Vertex);
+        bindings[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        attributes[0].binding = 0;
+        attributes[0].offset = offsetof(Vertex, pos);
+        attributes[1].binding = 0;
+        attributes[1].offset = offsetof(Vertex, color);
+        bindingCount = 1;
+    }
+    bindings[bindingCount].binding = bindingCount;
+    bindings[bindingCount].stride = sizeof(Instance);
+    bindings[bindingCount].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+    const VkFormat instanceFormats[] = {VK_FORMAT_R32G32_SFLOAT,
+                                        VK_FORMAT_R32_SFLOAT,
+                                        VK_FORMAT_R32G32B32_SFLOAT,
+                                        VK_FORMAT_R32_SFLOAT};
+    const uint32_t instanceOffsets[] = {offsetof(Instance, offset),
+                                        offsetof(Instance, scale),
+                                        offsetof(Instance, tint),
+                                        offsetof(Instance, depth)};
+    for (uint32_t i = 0; i < 4; ++i) {
+        attributes[2 + i].location = 2 + i;
+        attributes[2 + i].binding = bindingCount;
+        attributes[2 + i].format = instanceFormats[i];
+        attributes[2 + i].offset = instanceOffsets[i];
+    }
+    ++bindingCount;
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
+    vertexInputInfo.sType =
+                VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.vertexBindingDescriptionCount = bindingCount;
+    vertexInputInfo.pVertexBindingDescriptions = bindings;
+    vertexInputInfo.vertexAttributeDescriptionCount = 6;
+    vertexInputInfo.pVertexAttributeDescriptions = attributes;
+
+    // Using triangles
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+    inputAssembly.sType =
+                   VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+    // View port.  Both viewport and scissor are dynamic (see below) so that
+    // the pipeline does not depend on the extent.
+    VkPipelineViewportStateCreateInfo viewportState = {};
+    viewportState.sType =
+                         VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.pViewports = nullptr;
+    viewportState.scissorCount = 1;
+    viewportState.pScissors = nullptr;
+
+    // Rasterizer
+    VkPipelineRasterizationStateCreateInfo rasterizer = {};
+    rasterizer.sType =
+                    VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.depthClampEnable = VK_FALSE;
+    rasterizer.rasterizerDiscardEnable = VK_FALSE;
+    // Try VK_POLYGON_MODE_LINE, VK_POLYGON_MODE_POINT
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rasterizer.depthBiasEnable = VK_FALSE;
+    rasterizer.depthBiasConstantFactor = 0.0f;
+    rasterizer.depthBiasClamp = 0.0f;
+    rasterizer.depthBiasSlopeFactor = 0.0f;
+
+    // MSAA
+    VkPipelineMultisampleStateCreateInfo multisampling = {};
+    multisampling.sType =
+                      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.sampleShadingEnable = VK_FALSE;
+    multisampling.rasterizationSamples = samples;
+    multisampling.minSampleShading = 1.0f;
+    multisampling.pSampleMask = nullptr;
+    multisampling.alphaToCoverageEnable = VK_FALSE;
+    multisampling.alphaToOneEnable = VK_FALSE;
+
+    // Depth test, drawing front to back lets early Z reject what's hidden
+    VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+    depthStencil.sType =
+                    VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = VK_TRUE;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.stencilTestEnable = VK_FALSE;
+
+    // Color blending
+    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
+    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
+                                          VK_COLOR_COMPONENT_G_BIT |
+                                          VK_COLOR_COMPONENT_B_BIT |
+                                          VK_COLOR_COMPONENT_A_BIT;
+    // no alpha blending
+    colorBlendAttachment.blendEnable = VK_FALSE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+    VkPipelineColorBlendStateCreateInfo colorBlending = {};
+    colorBlending.sType =
+                      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.logicOpEnable = VK_FALSE;
+    colorBlending.logicOp = VK_LOGIC_OP_COPY;
+    colorBlending.attachmentCount = 1;
+    colorBlending.pAttachments = &colorBlendAttachment;
+    colorBlending.blendConstants[0] = 0.0f;
+    colorBlending.blendConstants[1] = 0.0f;
+    colorBlending.blendConstants[2] = 0.0f;
+    colorBlending.blendConstants[3] = 0.0f;
+
+    // vulkan dynamic states, set when recording the command buffers
+    VkDynamicState dynamicStates[] = {VK_DYNAMIC_STATE_VIEWPORT,
+                                      VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamicState = {};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = sizeof(dynamicStates) /
+                                     sizeof(*dynamicStates);
+    dynamicState.pDynamicStates = dynamicStates;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pDepthStencilState = &depthStencil;
+    pipelineInfo.pColorBlendState = &colorBlending;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = pipelineLayout;
+    pipelineInfo.renderPass = pass;
+    pipelineInfo.subpass = 0;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = -1;
+
+    VkResult vkRet = vkCreateGraphicsPipelines(device, pipelineCache, 1,
+                                               &pipelineInfo, nullptr,
+                                               pipeline);
+    if (vkRet != VK_SUCCESS) {
+       printf("vkCreateGraphicsPipelines failed with ret %d\n", vkRet);
+       return false;
+    }
+    return true;
+}
+
+uint32_t VulkanApp::variantIndex(VkSampleCountFlagBits samples)
+{
+    uint32_t index = 0;
+    while ((1U << index) < (uint32_t) samples)
+        ++index;
+    return index;
+}
+
+void VulkanApp::requestPipelines(PipelineVariant *variants,
+                                 VkShaderModule vert, VkShaderModule frag)
+{
+    // The current sample count goes first, it's the one we'll wait for
+    vector<VkSampleCountFlagBits> counts = {msaaSamples};
+    for (VkSampleCountFlagBits s = nextSampleCount(msaaSamples);
+         s != msaaSamples; s = nextSampleCount(s))
+        counts.push_back(s);
+
+    for (VkSampleCountFlagBits samples : counts) {
+        PipelineVariant& variant = variants[variantIndex(samples)];
+        if (variant.ticket || variant.pipeline != VK_NULL_HANDLE)
+            continue;
+        variant.ticket = pipelineCompiler.submit([=]() {
+            // A pipeline can be used with any compatible render pass, so
+            // a throwaway one will do.
+            const auto start = chrono::steady_clock::now();
+            VkRenderPass pass;
+            if (!createRenderPass(samples, &pass))
+                return (VkPipeline) VK_NULL_HANDLE;
+            VkPipeline pipeline = VK_NULL_HANDLE;
+            buildPipeline(samples, pass, vert, frag, &pipeline);
+            vkDestroyRenderPass(device, pass, nullptr);
+            // Variants finishing late and hot reloads are not startup
+            const auto end = chrono::steady_clock::now();
+            if (!startup.record("pipeline " + to_string(samples) + "x MSAA",
+                                start, end, true)) {
+                printf("Compiled %ux MSAA pipeline in %.1fms\n", samples,
+                       chrono::duration<double, milli>(end - start).count());
+            }
+            return pipeline;
+        });
+    }
+}
+
+void VulkanApp::collectPipelines(PipelineVariant *variants)
+{
+    for (uint32_t i = 0; i < maxPipelineVariants; ++i) {
+        PipelineVariant& variant = variants[i];
+        if (variant.ticket
+         && pipelineCompiler.poll(variant.ticket, &variant.pipeline))
+            variant.ticket = 0;
+    }
+}
+
+bool VulkanApp::usePipeline(VkSampleCountFlagBits samples)
+{
+    // Only blocks if the variant is still compiling
+    PipelineVariant& variant = pipelineVariants[variantIndex(samples)];
+    if (variant.ticket) {
+        variant.pipeline = pipelineCompiler.wait(variant.ticket);
+        variant.ticket = 0;
+    }
+    if (variant.pipeline == VK_NULL_HANDLE) {
+        printf("No pipeline for %ux MSAA\n", samples);
+        return false;
+    }
+    graphicsPipeline = variant.pipeline;
+    nameObject(VK_OBJECT_TYPE_PIPELINE, graphicsPipeline, "graphics pipeline");
+    return true;
+}
+
+void VulkanApp::destroyPipelines(PipelineVariant *variants)
+{
+    // Waits for the variants still compiling
+    for (uint32_t i = 0; i < maxPipelineVariants; ++i) {
+        PipelineVariant& variant = variants[i];
+        if (variant.ticket)
+            variant.pipeline = pipelineCompiler.wait(variant.ticket);
+        vkDestroyPipeline(device, variant.pipeline, nullptr);
+        variant = PipelineVariant();
+    }
+}
+
+void VulkanApp::pollShaderReload()
+{
+    if (!reload.active) {
+        vector<ShaderWatcher::Update> updates = shaderWatcher.takeUpdates();
+        if (updates.empty())
+            return;
+        // Stages that didn't change keep their module
+        reload.vertexShader = vertexShader;
+        reload.fragShader = fragShader;
+        for (auto& update : updates) {
+            VkShaderModule *module = update.stage == ShaderWatcher::VERTEX
+                                   ? &reload.vertexShader
+                                   : &reload.fragShader;
+            VkShaderModule newModule;
+            if (!createShaderModule(update.code.data(),
+                                    update.code.size() * sizeof(uint32_t),
+                                    &newModule))
+                continue;
+            if (*module != vertexShader && *module != fragShader)
+                vkDestroyShaderModule(device, *module, nullptr);
+            *module = newModule;
+        }
+        if (reload.vertexShader == vertexShader
+         && reload.fragShader == fragShader)
+            return;
+        reload.active = true;
+        requestPipelines(reload.variants, reload.vertexShader,
+                         reload.fragShader);
+        return;
+    }
+
+    collectPipelines(reload.variants);
+    for (const auto& variant : reload.variants) {
+        if (variant.ticket)
+            return;
+    }
+    if (!finishShaderReload())
+        abortShaderReload();
+}
+
+bool VulkanApp::finishShaderReload()
+{
+    // Every variant compiled: swap them in, the old pipelines and modules go
+    // once the frames using them are done.
+    for (uint32_t i = 0; i < maxPipelineVariants; ++i) {
+        const PipelineVariant& current = pipelineVariants[i];
+        if ((current.ticket || current.pipeline != VK_NULL_HANDLE)
+         && reload.variants[i].pipeline == VK_NULL_HANDLE) {
+            printf("Shader reload failed, keeping the old pipelines\n");
+            return false;
+        }
+    }
+
+    vector<VkPipeline> oldPipelines;
+    for (auto& variant : pipelineVariants) {
+        if (variant.ticket)
+            variant.pipeline = pipelineCompiler.wait(variant.ticket);
+        if (variant.pipeline != VK_NULL_HANDLE)
+            oldPipelines.push_back(variant.pipeline);
+    }
+    vector<VkShaderModule> oldModules;
+    if (reload.vertexShader != vertexShader)
+        oldModules.push_back(vertexShader);
+    if (reload.fragShader != fragShader)
+        oldModules.push_back(fragShader);
+    deferDestroy([this, oldPipelines, oldModules]() {
+        for (VkPipeline pipeline : oldPipelines)
+            vkDestroyPipeline(device, pipeline, nullptr);
+        for (VkShaderModule module : oldModules)
+            vkDestroyShaderModule(device, module, nullptr);
+    });
+
+    copy(begin(reload.variants), end(reload.variants), pipelineVariants);
+    vertexShader = reload.vertexShader;
+    fragShader = reload.fragShader;
+    reload = ShaderReload();
+    graphicsPipeline = pipelineVariants[variantIndex(msaaSamples)].pipeline;
+    printf("Shaders reloaded\n");
+
+    // Static command buffers have the old pipeline baked in, dynamic ones
+    // pick the new one up with the next frame.
+    return settings.dynamicRecording || retireCommandBuffers();
+}
+
+void VulkanApp::abortShaderReload()
+{
+    destroyPipelines(reload.variants);
+    if (reload.vertexShader != vertexShader)
+        vkDestroyShaderModule(device, reload.vertexShader, nullptr);
+    if (reload.fragShader != fragShader)
+        vkDestroyShaderModule(device, reload.fragShader, nullptr);
+    reload = ShaderReload();
+}
+
+bool VulkanApp::createFrameBuffers()
+{
+    const bool msaa = msaaSamples != VK_SAMPLE_COUNT_1_BIT;
+    const bool upscale = settings.dynamicResolution > 0.0;
+    if ((msaa && !createMsaaTarget(&msaaTarget))
+     || !createDepthTarget(&depthTarget)
+     || (upscale && !createSceneTarget(&sceneTarget)))
+        return false;
+    nameObject(VK_OBJECT_TYPE_IMAGE, msaaTarget.image, "MSAA target");
+    nameObject(VK_OBJECT_TYPE_IMAGE, depthTarget.image, "depth target");
+    nameObject(VK_OBJECT_TYPE_IMAGE, sceneTarget.image, "scene target");
+
+    frameBuffers.resize(swapChain.size());
+    for (unsigned i = 0; i != swapChain.size(); ++i) {
+        // Same order as the render pass attachments
+        VkImageView attachments[3];
+        uint32_t attachmentCount = 0;
+        if (msaa)
+            attachments[attachmentCount++] = msaaTarget.view;
+        attachments[attachmentCount++] = upscale ? sceneTarget.view
+                                                 : swapChain[i].view;
+        attachments[attachmentCount++] = depthTarget.view;
+
+        VkFramebufferCreateInfo framebufferInfo = {};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = renderPass;
+        framebufferInfo.attachmentCount = attachmentCount;
+        framebufferInfo.pAttachments = attachments;
+        framebufferInfo.width = devInfo.extent.width;
+        framebufferInfo.height = devInfo.extent.height;
+        framebufferInfo.layers = 1;
+
+        VkResult vkRet = vkCreateFramebuffer(device, &framebufferInfo,
+                                             nullptr, &frameBuffers[i]);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateFramebuffer failed with %d\n", vkRet);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VulkanApp::createCommandPool()
+{
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = devInfo.families[0];
+    // Static command buffers get recorded again one by one when the
+    // textures they sample are streamed
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+    VkResult vkRet = vkCreateCommandPool(device, &poolInfo, nullptr,
+                                         &commandPool);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateCommandPool failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+bool VulkanApp::createFrameContexts()
+{
+    frames.resize(MAX_FRAMES_IN_FLIGHT);
+    for (auto& frame : frames) {
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        VkResult vkRet = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+                                           &frame.imageAvailableSem);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateSemaphore failed with %d\n", vkRet);
+            return false;
+        }
+        vkRet = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+                                  &frame.renderFinishedSem);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateSemaphore failed with %d\n", vkRet);
+            return false;
+        }
+
+        if (timeline.enabled)
+            continue;
+        VkFenceCreateInfo fenceCreateInfo = {};
+        fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        vkRet = vkCreateFence(device, &fenceCreateInfo, nullptr, &frame.fence);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateFence failed with %d\n", vkRet);
+            return false;
+        }
+    }
+    return !timeline.enabled
+        || (createTimeline(&timeline.frames)
+         && createTimeline(&timeline.compute)
+         && createTimeline(&timeline.uploads));
+}
+
+bool VulkanApp::createTimeline(VkSemaphore *sem)
+{
+#ifdef VK_KHR_timeline_semaphore
+    VkSemaphoreTypeCreateInfoKHR typeInfo = {};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+    // Frame numbers and batch counts start at 1
+    typeInfo.initialValue = 0;
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &typeInfo;
+    VkResult vkRet = vkCreateSemaphore(device, &semaphoreInfo, nullptr, sem);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateSemaphore failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+#else
+    (void) sem;
+    return false;
+#endif
+}
+
+void VulkanApp::waitTimeline(VkSemaphore sem, uint64_t value)
+{
+#ifdef VK_KHR_timeline_semaphore
+    VkSemaphoreWaitInfoKHR waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &sem;
+    waitInfo.pValues = &value;
+    timeline.waitSemaphores(device, &waitInfo, UINT64_MAX);
+#else
+    (void) sem;
+    (void) value;
+#endif
+}
+
+uint64_t VulkanApp::timelineValue(VkSemaphore sem)
+{
+    uint64_t value = 0;
+#ifdef VK_KHR_timeline_semaphore
+    timeline.counterValue(device, sem, &value);
+#else
+    (void) sem;
+#endif
+    return value;
+}
+
+void VulkanApp::waitForFrame(uint64_t frame)
+{
+    // Submissions complete in order, everything up to the frame is done
+    // once it is
+    if (timeline.enabled) {
+        if (frame > completedFrame)
+            waitTimeline(timeline.frames, frame);
+        // Later frames may be done too
+        completedFrame = max(completedFrame, timelineValue(timeline.frames));
+        return;
+    }
+    if (frame <= completedFrame)
+        return;
+    // The oldest fence covering the frame
+    const FrameContext *oldest = nullptr;
+    for (const auto& other : frames) {
+        if (other.fenceFrame >= frame
+         && (!oldest || other.fenceFrame < oldest->fenceFrame))
+            oldest = &other;
+    }
+    if (!oldest)
+        return;
+    vkWaitForFences(device, 1, &oldest->fence, VK_TRUE, UINT64_MAX);
+    completedFrame = oldest->fenceFrame;
+}
+
+bool VulkanApp::createStagingRing()
+{
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = devInfo.transferFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                     VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VkResult vkRet = vkCreateCommandPool(device, &poolInfo, nullptr,
+                                         &staging.commandPool);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateCommandPool failed with %d\n", vkRet);
+        return false;
+    }
+
+    if (!allocator.createBuffer(StagingRing::size,
+                                VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                0, &staging.buffer, &staging.memory))
+        return false;
+    nameObject(VK_OBJECT_TYPE_BUFFER, staging.buffer, "staging ring");
+    return true;
+}
+
+void VulkanApp::destroyStagingRing()
+{
+    // Called once the device is idle
+    staging.pendingWaits.clear();
+    staging.pendingValue = 0;
+    staging.pendingBatches.clear();
+    retireUploads(true);
+    for (auto& batch : staging.freeBatches) {
+        vkDestroyFence(device, batch.fence, nullptr);
+        vkDestroySemaphore(device, batch.doneSem, nullptr);
+    }
+    staging.freeBatches.clear();
+    vkDestroyCommandPool(device, staging.commandPool, nullptr);
+    allocator.destroyBuffer(staging.buffer, staging.memory);
+}
+
+bool VulkanApp::beginUploadBatch()
+{
+    if (staging.recording.cmd != VK_NULL_HANDLE)
+        return true;
+
+    UploadBatch batch;
+    if (!staging.freeBatches.empty()) {
+        batch = staging.freeBatches.back();
+        staging.freeBatches.pop_back();
+        if (batch.fence != VK_NULL_HANDLE)
+            vkResetFences(device, 1, &batch.fence);
+    }
+    else {
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = staging.commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        VkResult vkRet = vkAllocateCommandBuffers(device, &allocInfo,
+                                                  &batch.cmd);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkAllocateCommandBuffers failed with %d\n", vkRet);
+            return false;
+        }
+    }
+    // Timeline batches signal timeline.uploads instead
+    if (batch.fence == VK_NULL_HANDLE && !timeline.enabled) {
+        VkFenceCreateInfo fenceInfo = {};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        VkResult vkRet = vkCreateFence(device, &fenceInfo, nullptr,
+                                       &batch.fence);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateFence failed with %d\n", vkRet);
+            return false;
+        }
+        VkSemaphoreCreateInfo semInfo = {};
+        semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        vkRet = vkCreateSemaphore(device, &semInfo, nullptr, &batch.doneSem);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateSemaphore failed with %d\n", vkRet);
+            return false;
+        }
+    }
+    batch.stagingBytes = 0;
+    batch.waitFrame = 0;
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VkResult vkRet = vkBeginCommandBuffer(batch.cmd, &beginInfo);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkBeginCommandBuffer failed with %d\n", vkRet);
+        return false;
+    }
+    beginLabel(batch.cmd, "uploads");
+    staging.recording = batch;
+    return true;
+}
+
+bool VulkanApp::reserveStaging(VkDeviceSize size, VkDeviceSize alignment,
+                               VkDeviceSize *offset)
+{
+    // Ring allocation: space is consumed at head and released in submission
+    // order, so the live range is always the 'used' bytes before head.
+    // Wrapping around wastes the end of the buffer.
+    VkDeviceSize start = (staging.head + alignment - 1) / alignment * alignment;
+    if (start + size > StagingRing::size)
+        start = 0;
+    const VkDeviceSize consumed = (start == 0 && staging.head != 0)
+                                ? StagingRing::size - staging.head + size
+                                : start - staging.head + size;
+    if (staging.used + consumed > StagingRing::size)
+        return false;
+
+    staging.used += consumed;
+    staging.recording.stagingBytes += consumed;
+    staging.head = start + size;
+    if (staging.head == StagingRing::size)
+        staging.head = 0;
+    *offset = start;
+    return true;
+}
+
+bool VulkanApp::reserveUpload(VkDeviceSize size, VkDeviceSize alignment,
+                              VkDeviceSize *offset)
+{
+    // Staging space in the batch being recorded, which is started if needed
+    if (!beginUploadBatch())
+        return false;
+    while (!reserveStaging(size, alignment, offset)) {
+        // Ring is full: submit what we have and wait for the oldest
+        // batch to give its space back
+        if (staging.recording.stagingBytes > 0 && !flushUploads())
+            return false;
+        auto it = find_if(staging.inFlight.begin(),
+                          staging.inFlight.end(),
+                          [](const UploadBatch& b) {
+                              return b.stagingBytes > 0;
+                          });
+        if (it == staging.inFlight.end()) {
+            printf("staging ring too small for %llu bytes\n",
+                   (unsigned long long) size);
+            return false;
+        }
+        uploadDone(*it, true);
+        retireUploads(false);
+        if (!beginUploadBatch())
+            return false;
+    }
+    return true;
+}
+
+bool VulkanApp::uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset,
+                             const void *data, VkDeviceSize size)
+{
+    // Big uploads are split so that they stream through the ring instead of
+    // requiring it to be as large as the biggest resource.
+    const VkDeviceSize maxChunk = StagingRing::size / 4;
+    const VkDeviceSize alignment = max<VkDeviceSize>(4,
+        devInfo.properties.limits.optimalBufferCopyOffsetAlignment);
+    const char *src = (const char *) data;
+    while (size > 0) {
+        const VkDeviceSize chunk = min(size, maxChunk);
+        VkDeviceSize offset;
+        if (!reserveUpload(chunk, alignment, &offset))
+            return false;
+        memcpy((char *) staging.memory.mapped + offset, src, chunk);
+
+        VkBufferCopy region = {};
+        region.srcOffset = offset;
+        region.dstOffset = dstOffset;
+        region.size = chunk;
+        vkCmdCopyBuffer(staging.recording.cmd, staging.buffer, dst, 1,
+                        &region);
+        src += chunk;
+        dstOffset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool VulkanApp::flushUploads()
+{
+    UploadBatch& batch = staging.recording;
+    if (batch.cmd == VK_NULL_HANDLE)
+        return true;
+
+    endLabel(batch.cmd);
+    VkResult vkRet = vkEndCommandBuffer(batch.cmd);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkEndCommandBuffer failed with %d\n", vkRet);
+        return false;
+    }
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch.cmd;
+    SubmitSync sync;
+    if (timeline.enabled) {
+        batch.value = ++timeline.uploadValue;
+        sync.signal(timeline.uploads, batch.value);
+    }
+    else {
+        sync.signal(batch.doneSem);
+    }
+    sync.apply(&submitInfo);
+    vkRet = vkQueueSubmit(transferQueue, 1, &submitInfo, batch.fence);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkQueueSubmit failed with %d\n", vkRet);
+        return false;
+    }
+
+    staging.inFlight.push_back(batch);
+    if (timeline.enabled)
+        staging.pendingValue = batch.value;
+    else
+        staging.pendingWaits.push_back(batch.doneSem);
+    staging.pendingBatches.push_back(&staging.inFlight.back());
+    batch = UploadBatch();
+    return true;
+}
+
+bool VulkanApp::uploadDone(const UploadBatch& batch, bool wait)
+{
+    if (timeline.enabled) {
+        if (wait)
+            waitTimeline(timeline.uploads, batch.value);
+        return wait || timelineValue(timeline.uploads) >= batch.value;
+    }
+    if (wait) {
+        vkWaitForFences(device, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+        return true;
+    }
+    return vkGetFenceStatus(device, batch.fence) == VK_SUCCESS;
+}
+
+void VulkanApp::waitForUploads(SubmitSync *sync, VkPipelineStageFlags stages)
+{
+    // Whatever got uploaded since the last frame
+    if (timeline.enabled) {
+        if (staging.pendingValue != 0)
+            sync->wait(timeline.uploads, stages, staging.pendingValue);
+        return;
+    }
+    for (VkSemaphore sem : staging.pendingWaits)
+        sync->wait(sem, stages);
+}
+
+void VulkanApp::retireUploads(bool wait)
+{
+    // Staging space is given back as soon as the copies are done.  Batches
+    // complete in submission order since they all go to the same queue.
+    for (auto& batch : staging.inFlight) {
+        if (batch.stagingBytes == 0)
+            continue;
+        if (!uploadDone(batch, wait))
+            break;
+        staging.used -= batch.stagingBytes;
+        batch.stagingBytes = 0;
+    }
+    if (staging.used == 0)
+        staging.head = 0;
+
+    // The batch itself must wait for its binary semaphore to have been
+    // consumed by a completed frame.  Timeline waits consume nothing.
+    while (!staging.inFlight.empty()) {
+        UploadBatch& batch = staging.inFlight.front();
+        if (batch.stagingBytes != 0)
+            break;
+        if (!wait && !timeline.enabled
+         && (batch.waitFrame == 0 || batch.waitFrame > completedFrame))
+            break;
+        vkResetCommandBuffer(batch.cmd, 0);
+        staging.freeBatches.push_back(batch);
+        staging.inFlight.pop_front();
+    }
+}
+
+bool VulkanApp::createMesh()
+{
+    // The good old triangle, subdivided into meshDetail rows so that we can
+    // throw large meshes at the upload path.  Vertex (i, j) is the j-th one
+    // of row i, counting from the top vertex; colors are interpolated from
+    // the corners.
+    const float top[2] = {0.0f, -0.5f};
+    const float right[2] = {0.5f, 0.5f};
+    const float left[2] = {-0.5f, 0.5f};
+    const uint32_t n = settings.meshDetail;
+
+    vector<Vertex> vertices;
+    vertices.reserve((n + 1) * (n + 2) / 2);
+    for (uint32_t i = 0; i <= n; ++i) {
+        for (uint32_t j = 0; j <= i; ++j) {
+            const float wRight = (float) j / n;
+            const float wLeft = (float) (i - j) / n;
+            const float wTop = 1.0f - wRight - wLeft;
+            Vertex v;
+            for (int k = 0; k < 2; ++k) {
+                v.pos[k] = wTop * top[k] + wRight * right[k]
+                         + wLeft * left[k];
+            }
+            v.color[0] = wTop;
+            v.color[1] = wRight;
+            v.color[2] = wLeft;
+            vertices.push_back(v);
+        }
+    }
+
+    // Same clockwise winding as the original triangle
+    vector<uint32_t> indices;
+    indices.reserve(n * n * 3);
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint32_t row = i * (i + 1) / 2;
+        const uint32_t next = (i + 1) * (i + 2) / 2;
+        for (uint32_t j = 0; j <= i; ++j) {
+            indices.insert(indices.end(), {row + j, next + j + 1, next + j});
+            if (j < i)
+                indices.insert(indices.end(),
+                               {row + j, row + j + 1, next + j + 1});
+        }
+    }
+    mesh.vertexCount = vertices.size();
+    mesh.indexCount = indices.size();
+    mesh.radius = 0.0f;
+    for (const auto& v : vertices)
+        mesh.radius = max(mesh.radius, hypotf(v.pos[0], v.pos[1]));
+
+    // Split layout stores all the positions, then all the colors
+    vector<char> vertexData(vertices.size() * sizeof(Vertex));
+    if (settings.splitVertexStreams) {
+        const size_t posSize = vertices.size() * sizeof(Vertex::pos);
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            memcpy(&vertexData[i * sizeof(Vertex::pos)], vertices[i].pos,
+                   sizeof(Vertex::pos));
+            memcpy(&vertexData[posSize + i * sizeof(Vertex::color)],
+                   vertices[i].color, sizeof(Vertex::color));
+        }
+        mesh.streamOffsets[0] = 0;
+        mesh.streamOffsets[1] = posSize;
+    }
+    else {
+        memcpy(vertexData.data(), vertices.data(), vertexData.size());
+    }
+
+    const vector<uint32_t> families = bufferFamilies();
+    if (!allocator.createBuffer(vertexData.size(),
+                                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                                &mesh.vertexBuffer, &mesh.vertexMemory,
+                                families)
+     || !allocator.createBuffer(indices.size() * sizeof(uint32_t),
+                                VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                                VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                                &mesh.indexBuffer, &mesh.indexMemory,
+                                families))
+        return false;
+    nameObject(VK_OBJECT_TYPE_BUFFER, mesh.vertexBuffer, "vertices");
+    nameObject(VK_OBJECT_TYPE_BUFFER, mesh.indexBuffer, "indices");
+
+    if (!uploadBuffer(mesh.vertexBuffer, 0, vertexData.data(),
+                      vertexData.size())
+     || !uploadBuffer(mesh.indexBuffer, 0, indices.data(),
+                      indices.size() * sizeof(uint32_t))
+     || !createInstances()
+     || !flushUploads())
+        return false;
+    printf("Mesh: %u vertices, %u triangles, %s layout, %u instances in "
+           "%zu draws\n", mesh.vertexCount, mesh.indexCount / 3,
+           settings.splitVertexStreams ? "split" : "interleaved",
+           mesh.instanceCount, drawList.size());
+    return true;
+}
+
+bool VulkanApp::createInstances()
+{
+    // Lay the instances out on a square grid covering the viewport.  A
+    // single instance is the untouched mesh.
+    const uint32_t count = settings.instanceCount;
+    const uint32_t cols = (uint32_t) ceil(sqrt((double) count));
+    const float cell = 2.0f / cols;
+    const float scale = min(1.0f, 0.9f * cell);
+
+    vector<Instance> instances(count);
+    uint32_t seed = 12345;
+    for (uint32_t i = 0; i < count; ++i) {
+        Instance& inst = instances[i];
+        inst.offset[0] = -1.0f + cell * (i % cols + 0.5f);
+        inst.offset[1] = -1.0f + cell * (i / cols + 0.5f);
+        inst.scale = scale;
+        for (int k = 0; k < 3; ++k) {
+            seed = seed * 1664525 + 1013904223;
+            inst.tint[k] = count == 1
+                         ? 1.0f : 0.25f + 0.75f * (seed >> 8) / 16777216.0f;
+        }
+        seed = seed * 1664525 + 1013904223;
+        inst.depth = count == 1 ? 0.5f : (seed >> 8) / 16777216.0f;
+    }
+    // Opaque geometry goes front to back, so that early Z rejects the
+    // fragments of whatever ends up hidden.  The draws cover consecutive
+    // ranges of instances and are recorded in order, so sorting the
+    // instances orders everything.
+    stable_sort(instances.begin(), instances.end(),
+                [](const Instance& a, const Instance& b) {
+                    return a.depth < b.depth;
+                });
+
+    // The simulation and the culling read them as a storage buffer
+    const VkDeviceSize size = count * sizeof(Instance);
+    if (!allocator.createBuffer(size,
+                                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                                (settings.simulate || settings.gpuDriven
+                               ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT : 0),
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                                &mesh.instanceBuffer, &mesh.instanceMemory,
+                                bufferFamilies()))
+        return false;
+    nameObject(VK_OBJECT_TYPE_BUFFER, mesh.instanceBuffer, "instances");
+    mesh.instanceCount = count;
+    mesh.instanceScale = scale;
+
+    // Draws get an even share of the instances, the first ones one more
+    const uint32_t drawCount = min(settings.drawCount, count);
+    drawList.clear();
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < drawCount; ++i) {
+        const uint32_t n = count / drawCount + (i < count % drawCount ? 1 : 0);
+        drawList.push_back({first, n});
+        first += n;
+    }
+    drawUniforms.assign(drawList.size(), {{1.0f, 1.0f, 1.0f, 1.0f}});
+    return uploadBuffer(mesh.instanceBuffer, 0, instances.data(), size);
+}
+
+vector<uint32_t> VulkanApp::bufferFamilies() const
+{
+    // Every family that may access the device buffers, sharing is
+    // concurrent rather than through ownership transfers
+    vector<uint32_t> families = {devInfo.families[0]};
+    if (devInfo.hasTransferFamily())
+        families.push_back(devInfo.transferFamily);
+    if (settings.simulate && devInfo.hasComputeFamily()
+     && devInfo.computeFamily != devInfo.transferFamily)
+        families.push_back(devInfo.computeFamily);
+    return families;
+}
+
+uint32_t VulkanApp::vertexBindingCount() const
+{
+    // Vertex streams followed by the instance stream
+    return (settings.splitVertexStreams ? 2 : 1) + 1;
+}
+
+void VulkanApp::destroyMesh()
+{
+    allocator.destroyBuffer(mesh.vertexBuffer, mesh.vertexMemory);
+    allocator.destroyBuffer(mesh.indexBuffer, mesh.indexMemory);
+    allocator.destroyBuffer(mesh.instanceBuffer, mesh.instanceMemory);
+    mesh = Mesh();
+}
+
+bool VulkanApp::createTextures()
+{
+    streamer.budget = (VkDeviceSize) settings.textureBudget * 1024 * 1024;
+
+    // The views only hold the resident levels, sampling clamps to them
+    VkSamplerCreateInfo samplerInfo = {};
+    samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+    samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK;
+    VkResult vkRet = vkCreateSampler(device, &samplerInfo, nullptr,
+                                     &streamer.sampler);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateSampler failed with %d\n", vkRet);
+        return false;
+    }
+
+    static const uint32_t white = 0xffffffff;
+    if (settings.textures.empty()) {
+        Texture tex;
+        tex.name = "white";
+        tex.data = (const char *) &white;
+        tex.format = VK_FORMAT_R8G8B8A8_UNORM;
+        textureBlock(tex.format, &tex);
+        tex.levels.push_back({0, sizeof(white), 1, 1});
+        streamer.textures.push_back(tex);
+    }
+    for (const char *filename : settings.textures) {
+        Texture tex;
+        if (!loadKtx2(filename, &tex))
+            return false;
+        streamer.textures.push_back(tex);
+    }
+
+    // Lowest mip first, the rest is streamed in as the view needs it
+    for (auto& tex : streamer.textures) {
+        if (!setResidency(&tex, tex.levels.size() - 1))
+            return false;
+    }
+    if (!flushUploads())
+        return false;
+    for (const auto& tex : streamer.textures) {
+        printf("Texture %s: %ux%u, %zu levels\n", tex.name,
+               tex.levels[0].width, tex.levels[0].height, tex.levels.size());
+    }
+    printf("Textures: %.1f MB resident, %u MB budget\n",
+           streamer.residentBytes / (1024.0 * 1024.0), settings.textureBudget);
+    return true;
+}
+
+bool VulkanApp::loadKtx2(const char *filename, Texture *tex)
+{
+    // See the KTX 2.0 specification.  Only what can go straight to the GPU
+    // is supported: a single 2D image per level, without supercompression.
+    struct Header {
+        uint8_t identifier[12];
+        uint32_t vkFormat;
+        uint32_t typeSize;
+        uint32_t pixelWidth;
+        uint32_t pixelHeight;
+        uint32_t pixelDepth;
+        uint32_t layerCount;
+        uint32_t faceCount;
+        uint32_t levelCount;
+        uint32_t supercompressionScheme;
+        uint32_t dfdByteOffset;
+        uint32_t dfdByteLength;
+        uint32_t kvdByteOffset;
+        uint32_t kvdByteLength;
+        uint64_t sgdByteOffset;
+        uint64_t sgdByteLength;
+    };
+    // Follows the header, finest level first
+    struct LevelIndex {
+        uint64_t byteOffset;
+        uint64_t byteLength;
+        uint64_t uncompressedByteLength;
+    };
+    static_assert(sizeof(Header) == 80, "KTX2 header is 80 bytes");
+    static const uint8_t identifier[12] = {
+        0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+    };
+
+    tex->name = filename;
+    if (!mapFile(filename, &tex->file)) {
+        printf("Cannot read %s\n", filename);
+        return false;
+    }
+    auto fail = [tex, filename](const char *why) {
+        printf("%s: %s\n", filename, why);
+        unmapFile(tex->file);
+        tex->file = MappedFile();
+        return false;
+    };
+    const char *data = (const char *) tex->file.data;
+    const size_t size = tex->file.size;
+
+    Header header;
+    if (size < sizeof(header))
+        return fail("not a KTX2 file");
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.identifier, identifier, sizeof(identifier)) != 0)
+        return fail("not a KTX2 file");
+    if (header.supercompressionScheme != 0)
+        return fail("supercompressed textures are not supported");
+    if (header.pixelWidth == 0 || header.pixelHeight == 0
+     || header.pixelDepth != 0 || header.layerCount > 1
+     || header.faceCount != 1)
+        return fail("only 2D textures are supported");
+    const uint32_t maxDimension = devInfo.properties.limits.maxImageDimension2D;
+    if (header.pixelWidth > maxDimension || header.pixelHeight > maxDimension)
+        return fail("too large for the device");
+
+    // Basis Universal textures have an undefined format, we don't transcode
+    tex->format = (VkFormat) header.vkFormat;
+    if (!textureBlock(tex->format, tex))
+        return fail("unsupported format");
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(devInfo.device, tex->format, &props);
+    const VkFormatFeatureFlags features =
+                        VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+                        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    if ((props.optimalTilingFeatures & features) != features)
+        return fail("format not supported by the device");
+
+    // No levels means they are to be generated, we don't
+    const uint32_t levelCount = max(1U, header.levelCount);
+    uint32_t fullChain = 1;
+    while ((max(header.pixelWidth, header.pixelHeight) >> fullChain) != 0)
+        ++fullChain;
+    if (levelCount > fullChain)
+        return fail("more levels than the mip chain has");
+    if (size < sizeof(header) + levelCount * sizeof(LevelIndex))
+        return fail("truncated level index");
+    tex->levels.resize(levelCount);
+    for (uint32_t i = 0; i < levelCount; ++i) {
+        LevelIndex index;
+        memcpy(&index, data + sizeof(header) + i * sizeof(index),
+               sizeof(index));
+        TextureLevel& level = tex->levels[i];
+        level.width = max(1U, header.pixelWidth >> i);
+        level.height = max(1U, header.pixelHeight >> i);
+        const VkDeviceSize expected =
+              (VkDeviceSize) ((level.width + tex->blockWidth - 1) /
+                              tex->blockWidth) *
+              ((level.height + tex->blockHeight - 1) / tex->blockHeight) *
+              tex->blockBytes;
+        if (index.byteLength != expected || index.byteOffset > size
+         || index.byteLength > size - index.byteOffset)
+            return fail("bad level index");
+        level.offset = index.byteOffset;
+        level.size = index.byteLength;
+    }
+    tex->data = data;
+    return true;
+}
+
+bool VulkanApp::textureBlock(VkFormat format, Texture *tex)
+{
+    struct Block {
+        VkFormat format;
+        uint8_t width;
+        uint8_t height;
+        uint8_t bytes;
+    };
+    static const Block blocks[] = {
+        {VK_FORMAT_R8G8B8A8_UNORM, 1, 1, 4},
+        {VK_FORMAT_R8G8B8A8_SRGB, 1, 1, 4},
+        {VK_FORMAT_B8G8R8A8_UNORM, 1, 1, 4},
+        {VK_FORMAT_B8G8R8A8_SRGB, 1, 1, 4},
+        {VK_FORMAT_BC1_RGB_UNORM_BLOCK, 4, 4, 8},
+        {VK_FORMAT_BC1_RGB_SRGB_BLOCK, 4, 4, 8},
+        {VK_FORMAT_BC1_RGBA_UNORM_BLOCK, 4, 4, 8},
+        {VK_FORMAT_BC1_RGBA_SRGB_BLOCK, 4, 4, 8},
+        {VK_FORMAT_BC2_UNORM_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC2_SRGB_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC3_UNORM_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC3_SRGB_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC4_UNORM_BLOCK, 4, 4, 8},
+        {VK_FORMAT_BC4_SNORM_BLOCK, 4, 4, 8},
+        {VK_FORMAT_BC5_UNORM_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC5_SNORM_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC6H_UFLOAT_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC6H_SFLOAT_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC7_UNORM_BLOCK, 4, 4, 16},
+        {VK_FORMAT_BC7_SRGB_BLOCK, 4, 4, 16},
+        {VK_FORMAT_ASTC_4x4_UNORM_BLOCK, 4, 4, 16},
+        {VK_FORMAT_ASTC_4x4_SRGB_BLOCK, 4, 4, 16},
+        {VK_FORMAT_ASTC_5x4_UNORM_BLOCK, 5, 4, 16},
+        {VK_FORMAT_ASTC_5x4_SRGB_BLOCK, 5, 4, 16},
+        {VK_FORMAT_ASTC_5x5_UNORM_BLOCK, 5, 5, 16},
+        {VK_FORMAT_ASTC_5x5_SRGB_BLOCK, 5, 5, 16},
+        {VK_FORMAT_ASTC_6x5_UNORM_BLOCK, 6, 5, 16},
+        {VK_FORMAT_ASTC_6x5_SRGB_BLOCK, 6, 5, 16},
+        {VK_FORMAT_ASTC_6x6_UNORM_BLOCK, 6, 6, 16},
+        {VK_FORMAT_ASTC_6x6_SRGB_BLOCK, 6, 6, 16},
+        {VK_FORMAT_ASTC_8x5_UNORM_BLOCK, 8, 5, 16},
+        {VK_FORMAT_ASTC_8x5_SRGB_BLOCK, 8, 5, 16},
+        {VK_FORMAT_ASTC_8x6_UNORM_BLOCK, 8, 6, 16},
+        {VK_FORMAT_ASTC_8x6_SRGB_BLOCK, 8, 6, 16},
+        {VK_FORMAT_ASTC_8x8_UNORM_BLOCK, 8, 8, 16},
+        {VK_FORMAT_ASTC_8x8_SRGB_BLOCK, 8, 8, 16},
+        {VK_FORMAT_ASTC_10x5_UNORM_BLOCK, 10, 5, 16},
+        {VK_FORMAT_ASTC_10x5_SRGB_BLOCK, 10, 5, 16},
+        {VK_FORMAT_ASTC_10x6_UNORM_BLOCK, 10, 6, 16},
+        {VK_FORMAT_ASTC_10x6_SRGB_BLOCK, 10, 6, 16},
+        {VK_FORMAT_ASTC_10x8_UNORM_BLOCK, 10, 8, 16},
+        {VK_FORMAT_ASTC_10x8_SRGB_BLOCK, 10, 8, 16},
+        {VK_FORMAT_ASTC_10x10_UNORM_BLOCK, 10, 10, 16},
+        {VK_FORMAT_ASTC_10x10_SRGB_BLOCK, 10, 10, 16},
+        {VK_FORMAT_ASTC_12x10_UNORM_BLOCK, 12, 10, 16},
+        {VK_FORMAT_ASTC_12x10_SRGB_BLOCK, 12, 10, 16},
+        {VK_FORMAT_ASTC_12x12_UNORM_BLOCK, 12, 12, 16},
+        {VK_FORMAT_ASTC_12x12_SRGB_BLOCK, 12, 12, 16},
+    };
+    for (const auto& block : blocks) {
+        if (block.format == format) {
+            tex->blockWidth = block.width;
+            tex->blockHeight = block.height;
+            tex->blockBytes = block.bytes;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t VulkanApp::wantedTextureLevel(const Texture& tex) const
+{
+    // The mesh is a unit wide and NDC two, so that's how many pixels an
+    // instance spans.  Mips with more than one texel per pixel would only
+    // be filtered away.
+    const float pixels = mesh.instanceScale * camera.zoom *
+                         renderExtent().width * 0.5f;
+    const float ratio = tex.levels[0].width / max(pixels, 1.0f);
+    const uint32_t level = ratio > 1.0f ? (uint32_t) log2(ratio) : 0;
+    return min<uint32_t>(level, tex.levels.size() - 1);
+}
+
+bool VulkanApp::setResidency(Texture *tex, uint32_t base)
+{
+    // A new image with levels [base, end), the old one goes once the frames
+    // using it are done.  The levels the old image has are copied over on
+    // the transfer queue, only the missing ones come from the mapped file.
+    const TextureLevel& top = tex->levels[base];
+    const uint32_t levelCount = tex->levels.size() - base;
+    const vector<uint32_t> families = bufferFamilies();
+    VkImageCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    info.imageType = VK_IMAGE_TYPE_2D;
+    info.format = tex->format;
+    info.extent.width = top.width;
+    info.extent.height = top.height;
+    info.extent.depth = 1;
+    info.mipLevels = levelCount;
+    info.arrayLayers = 1;
+    info.samples = VK_SAMPLE_COUNT_1_BIT;
+    info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                 VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    // Written by the transfer queue, same as the buffers
+    info.sharingMode = families.size() > 1 ? VK_SHARING_MODE_CONCURRENT
+                                           : VK_SHARING_MODE_EXCLUSIVE;
+    info.queueFamilyIndexCount = families.size();
+    info.pQueueFamilyIndices = families.data();
+    info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkImage image;
+    DeviceAllocator::Allocation memory;
+    VkImageView view;
+    VkDescriptorSet set;
+    if (!allocator.createImage(info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                               &image, &memory))
+        return false;
+    if (!uploadTexture(*tex, image, base)
+     || !createView(image, tex->format, VK_IMAGE_ASPECT_COLOR_BIT, &view,
+                    levelCount)) {
+        allocator.destroyImage(image, memory);
+        return false;
+    }
+    if (!descriptors.cachedImageSet(streamer.setLayout, view,
+                                    streamer.sampler, &set)) {
+        vkDestroyImageView(device, view, nullptr);
+        allocator.destroyImage(image, memory);
+        return false;
+    }
+
+    if (tex->image != VK_NULL_HANDLE) {
+        const VkImage oldImage = tex->image;
+        const DeviceAllocator::Allocation oldMemory = tex->memory;
+        const VkImageView oldView = tex->view;
+        deferDestroyAfterUploads([this, oldImage, oldMemory, oldView]() {
+            descriptors.forget(oldView);
+            vkDestroyImageView(device, oldView, nullptr);
+            allocator.destroyImage(oldImage, oldMemory);
+        });
+    }
+    VkDeviceSize bytes = 0;
+    for (uint32_t i = base; i < tex->levels.size(); ++i)
+        bytes += tex->levels[i].size;
+    streamer.residentBytes += bytes - tex->residentBytes;
+    tex->residentBytes = bytes;
+    tex->residentBase = base;
+    tex->image = image;
+    tex->memory = memory;
+    tex->view = view;
+    tex->set = set;
+    nameObject(VK_OBJECT_TYPE_IMAGE, image, tex->name);
+    return true;
+}
+
+bool VulkanApp::uploadTexture(const Texture& tex, VkImage image,
+                              uint32_t base)
+{
+    // Levels from base to the old resident base, if any, are read from the
+    // file, the others copied from the old image
+    if (!beginUploadBatch())
+        return false;
+    const bool hasOld = tex.image != VK_NULL_HANDLE;
+    const uint32_t fileEnd = hasOld ? min<uint32_t>(tex.residentBase,
+                                                    tex.levels.size())
+                                    : tex.levels.size();
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = tex.levels.size() - base;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(staging.recording.cmd,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+
+    // Like uploadBuffer(), levels bigger than a chunk are streamed through
+    // the ring, in copies of whole rows of blocks
+    const VkDeviceSize maxChunk = StagingRing::size / 4;
+    const VkDeviceSize alignment = max<VkDeviceSize>(
+        max<VkDeviceSize>(4, tex.blockBytes),
+        devInfo.properties.limits.optimalBufferCopyOffsetAlignment);
+    for (uint32_t i = base; i < fileEnd; ++i) {
+        const TextureLevel& level = tex.levels[i];
+        const VkDeviceSize rowBytes =
+                  (VkDeviceSize) (level.width + tex.blockWidth - 1) /
+                  tex.blockWidth * tex.blockBytes;
+        const uint32_t rows = (level.height + tex.blockHeight - 1) /
+                              tex.blockHeight;
+        const uint32_t rowsPerChunk = (uint32_t) max<VkDeviceSize>(1,
+                                                       maxChunk / rowBytes);
+        for (uint32_t row = 0; row < rows; row += rowsPerChunk) {
+            const uint32_t n = min(rowsPerChunk, rows - row);
+            VkDeviceSize offset;
+            if (!reserveUpload(n * rowBytes, alignment, &offset))
+                return false;
+            memcpy((char *) staging.memory.mapped + offset,
+                   tex.data + level.offset + row * rowBytes, n * rowBytes);
+
+            VkBufferImageCopy region = {};
+            region.bufferOffset = offset;
+            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.imageSubresource.mipLevel = i - base;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset.y = row * tex.blockHeight;
+            region.imageExtent.width = level.width;
+            region.imageExtent.height = min(n * tex.blockHeight,
+                                            level.height -
+                                            row * tex.blockHeight);
+            region.imageExtent.depth = 1;
+            vkCmdCopyBufferToImage(staging.recording.cmd, staging.buffer,
+                                   image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                   1, &region);
+        }
+    }
+
+    if (hasOld)
+        copyTextureLevels(tex, image, base);
+
+    // The semaphore the graphics queue waits on makes the writes visible.
+    // Sampled in the general layout: the next residency change copies from
+    // the image while frames in flight still sample it, and there is no
+    // layout both allow.
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    vkCmdPipelineBarrier(staging.recording.cmd,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+    return true;
+}
+
+void VulkanApp::copyTextureLevels(const Texture& tex, VkImage image,
+                                  uint32_t base)
+{
+    // The resident levels from max(base, residentBase) on, from the current
+    // image.  Its upload was an earlier transfer, possibly in this batch.
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = tex.image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = tex.levels.size() - tex.residentBase;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(staging.recording.cmd,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+
+    vector<VkImageCopy> regions;
+    for (uint32_t i = max(base, tex.residentBase); i < tex.levels.size(); ++i) {
+        VkImageCopy region = {};
+        region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.srcSubresource.mipLevel = i - tex.residentBase;
+        region.srcSubresource.layerCount = 1;
+        region.dstSubresource = region.srcSubresource;
+        region.dstSubresource.mipLevel = i - base;
+        region.extent.width = tex.levels[i].width;
+        region.extent.height = tex.levels[i].height;
+        region.extent.depth = 1;
+        regions.push_back(region);
+    }
+    vkCmdCopyImage(staging.recording.cmd, tex.image, VK_IMAGE_LAYOUT_GENERAL,
+                   image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regions.size(),
+                   regions.data());
+}
+
+bool VulkanApp::streamTextures()
+{
+    // Mark what the current view samples and find the texture missing the
+    // most levels
+    Texture *promote = nullptr;
+    uint32_t missing = 0;
+    for (auto& tex : streamer.textures) {
+        const uint32_t wanted = wantedTextureLevel(tex);
+        for (uint32_t i = wanted; i < tex.levels.size(); ++i)
+            tex.levels[i].lastUsed = frameNumber;
+        if (wanted < tex.residentBase && tex.residentBase - wanted > missing) {
+            promote = &tex;
+            missing = tex.residentBase - wanted;
+        }
+    }
+    if (!promote)
+        return true;
+
+    // One level per frame keeps the uploads of a frame small: that level is
+    // all that goes through the ring, the others and the evictions are
+    // copies between images.  Rather than stalling on a full ring, wait for
+    // what is queued, uploads of this frame included, to drain; a level
+    // larger than the ring waits for it to be empty.
+    const uint32_t base = promote->residentBase - 1;
+    const VkDeviceSize needed = promote->levels[base].size;
+    const VkDeviceSize ringSize = StagingRing::size;
+    if (staging.used + min(needed, ringSize) > ringSize)
+        return true;
+
+    // Make room by dropping the finest level of the textures whose finest
+    // level was the least recently wanted.  Levels wanted by this frame
+    // are never evicted: then we stay at the current resolution.
+    bool changed = false;
+    bool fits = true;
+    while (streamer.residentBytes + needed > streamer.budget) {
+        Texture *victim = nullptr;
+        for (auto& tex : streamer.textures) {
+            if (&tex == promote || tex.residentBase + 1 >= tex.levels.size())
+                continue;
+            const uint64_t lastUsed = tex.levels[tex.residentBase].lastUsed;
+            if (lastUsed < frameNumber
+             && (!victim
+              || lastUsed < victim->levels[victim->residentBase].lastUsed))
+                victim = &tex;
+        }
+        if (!victim) {
+            fits = false;
+            break;
+        }
+        if (!setResidency(victim, victim->residentBase + 1))
+            return false;
+        ++streamer.evicted;
+        changed = true;
+    }
+    if (fits) {
+        if (!setResidency(promote, base))
+            return false;
+        ++streamer.streamedIn;
+        changed = true;
+    }
+    if (!changed)
+        return true;
+    // Static command buffers have the descriptor sets baked in, renderFrame
+    // records each slot again before submitting it
+    return flushUploads();
+}
+
+void VulkanApp::destroyTextures()
+{
+    // Called once idle, the descriptor sets go with their pools
+    for (const auto& tex : streamer.textures) {
+        vkDestroyImageView(device, tex.view, nullptr);
+        allocator.destroyImage(tex.image, tex.memory);
+        unmapFile(tex.file);
+    }
+    vkDestroySampler(device, streamer.sampler, nullptr);
+    streamer.textures.clear();
+    streamer.sampler = VK_NULL_HANDLE;
+}
+
+bool VulkanApp::createCommandBuffers()
+{
+    // Command buffers
+    recordSlots.resize(settings.dynamicRecording ? frames.size()
+                                                 : swapChain.size());
+    if (recordSlots.size() > uniforms.regionCount) {
+        // Only grows, when the swap chain gets more images
+        const UniformRing old = uniforms;
+        deferDestroy([this, old]() { destroyUniformRing(old); });
+        if (!createUniformRing(recordSlots.size()))
+            return false;
+    }
+    for (uint32_t i = 0; i < recordSlots.size(); ++i) {
+        RecordSlot& slot = recordSlots[i];
+        slot.uniformOffset = i * uniforms.regionSize;
+        if (settings.dynamicRecording) {
+            VkCommandPoolCreateInfo poolInfo = {};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.queueFamilyIndex = devInfo.families[0];
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            VkResult vkRet = vkCreateCommandPool(device, &poolInfo, nullptr,
+                                                 &slot.pool);
+            if (vkRet != VK_SUCCESS) {
+                printf("vkCreateCommandPool failed with %d\n", vkRet);
+                return false;
+            }
+        }
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = settings.dynamicRecording ? slot.pool
+                                                          : commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        VkResult vkRet = vkAllocateCommandBuffers(device, &allocInfo,
+                                                  &slot.cmd);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkAllocateCommandBuffers failed with %d\n", vkRet);
+            return false;
+        }
+        if (!createTimingSlot(&slot) || !createWorkerBuffers(&slot)
+         || (settings.simulate && !createSimBuffer(&slot))
+         || (settings.gpuDriven && !createCullBuffers(&slot)))
+            return false;
+    }
+    return true;
+}
+
+bool VulkanApp::createUniformRing(uint32_t regionCount)
+{
+    // Dynamic offsets must be aligned for both kinds of buffers
+    const VkPhysicalDeviceLimits& limits = devInfo.properties.limits;
+    const VkDeviceSize align = max(limits.minUniformBufferOffsetAlignment,
+                                   limits.minStorageBufferOffsetAlignment);
+    auto alignUp = [align](VkDeviceSize size) {
+        return (size + align - 1) / align * align;
+    };
+    uniforms = UniformRing();
+    uniforms.drawOffset = alignUp(sizeof(FrameUniforms));
+    uniforms.regionSize = uniforms.drawOffset +
+                          alignUp(drawUniforms.size() * sizeof(DrawUniforms));
+    uniforms.regionCount = regionCount;
+
+    // Device local too if there is such a heap, resizable BAR or UMA
+    if (!allocator.createBuffer(uniforms.regionSize * regionCount,
+                                VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                &uniforms.buffer, &uniforms.memory))
+        return false;
+    nameObject(VK_OBJECT_TYPE_BUFFER, uniforms.buffer, "uniform ring");
+
+    // Both point at the first region, the dynamic offsets pick the slot's
+    return descriptors.cachedSet(frameSetLayout, {
+        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, uniforms.buffer, 0,
+         sizeof(FrameUniforms)},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, uniforms.buffer, 0,
+         drawUniforms.size() * sizeof(DrawUniforms)}
+    }, &uniforms.set);
+}
+
+void VulkanApp::destroyUniformRing(const UniformRing& ring)
+{
+    if (ring.buffer == VK_NULL_HANDLE)
+        return;
+    descriptors.forget(ring.buffer);
+    allocator.destroyBuffer(ring.buffer, ring.memory);
+}
+
+void VulkanApp::writeUniforms(const RecordSlot& slot)
+{
+    // The slot's previous submission has completed
+    char *region = (char *) uniforms.memory.mapped + slot.uniformOffset;
+    FrameUniforms frame;
+    frame.pan[0] = camera.pan[0];
+    frame.pan[1] = camera.pan[1];
+    frame.zoom = camera.zoom;
+    frame.time = chrono::duration<float>(chrono::steady_clock::now() -
+                                         startTime).count();
+    memcpy(region, &frame, sizeof(frame));
+    memcpy(region + uniforms.drawOffset, drawUniforms.data(),
+           drawUniforms.size() * sizeof(DrawUniforms));
+}
+
+bool VulkanApp::calibrateTimestamps()
+{
+    if (devInfo.timestampValidBits == 0)
+        return true;
+
+    VkQueryPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = 1;
+    VkQueryPool queryPool;
+    VkResult vkRet = vkCreateQueryPool(device, &poolInfo, nullptr,
+                                       &queryPool);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateQueryPool failed with %d\n", vkRet);
+        return false;
+    }
+
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+    VkCommandBuffer b;
+    vkRet = vkAllocateCommandBuffers(device, &allocInfo, &b);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkAllocateCommandBuffers failed with %d\n", vkRet);
+        vkDestroyQueryPool(device, queryPool, nullptr);
+        return false;
+    }
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(b, &beginInfo);
+    vkCmdResetQueryPool(b, queryPool, 0, 1);
+    vkCmdWriteTimestamp(b, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+    vkEndCommandBuffer(b);
+
+    // Nothing else runs on the queue yet, so the timestamp is written
+    // between the submission and the wait returning: the middle of that is
+    // off by a fraction of a millisecond at most.
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &b;
+    const auto before = chrono::steady_clock::now();
+    vkRet = vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+    if (vkRet == VK_SUCCESS)
+        vkRet = vkQueueWaitIdle(graphicsQueue);
+    const auto after = chrono::steady_clock::now();
+    if (vkRet == VK_SUCCESS) {
+        vkRet = vkGetQueryPoolResults(device, queryPool, 0, 1,
+                                      sizeof(calibration.gpu),
+                                      &calibration.gpu, sizeof(uint64_t),
+                                      VK_QUERY_RESULT_64_BIT |
+                                      VK_QUERY_RESULT_WAIT_BIT);
+    }
+    calibration.cpu = before + (after - before) / 2;
+    vkFreeCommandBuffers(device, commandPool, 1, &b);
+    vkDestroyQueryPool(device, queryPool, nullptr);
+    if (vkRet != VK_SUCCESS) {
+        printf("Timestamp calibration failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+bool VulkanApp::createTimingSlot(RecordSlot *slot)
+{
+    if (devInfo.timestampValidBits == 0)
+        return true;
+
+    VkQueryPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    poolInfo.queryCount = TS_COUNT;
+    VkResult vkRet = vkCreateQueryPool(device, &poolInfo, nullptr,
+                                       &slot->timing.queryPool);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateQueryPool failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+bool VulkanApp::createWorkerBuffers(RecordSlot *slot)
+{
+    // Pools are externally synchronized: every worker records from its own
+    const uint32_t workers = recordJobs.size();
+    slot->workerPools.resize(workers, VK_NULL_HANDLE);
+    slot->secondaries.resize(workers, VK_NULL_HANDLE);
+    for (uint32_t i = 0; i < workers; ++i) {
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.queueFamilyIndex = devInfo.families[0];
+        poolInfo.flags = settings.dynamicRecording
+                       ? VK_COMMAND_POOL_CREATE_TRANSIENT_BIT : 0;
+        VkResult vkRet = vkCreateCommandPool(device, &poolInfo, nullptr,
+                                             &slot->workerPools[i]);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateCommandPool failed with %d\n", vkRet);
+            return false;
+        }
+
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = slot->workerPools[i];
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        allocInfo.commandBufferCount = 1;
+        vkRet = vkAllocateCommandBuffers(device, &allocInfo,
+                                         &slot->secondaries[i]);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkAllocateCommandBuffers failed with %d\n", vkRet);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VulkanApp::createComputePipeline(const uint32_t *code, size_t codeSize,
+                                      const char *file, uint32_t bindingCount,
+                                      uint32_t pushConstantsSize,
+                                      VkShaderModule *shader,
+                                      VkDescriptorSetLayout *setLayout,
+                                      VkPipelineLayout *layout,
+                                      VkPipeline *pipeline,
+                                      VkDescriptorSetLayout extraSetLayout)
+{
+    // A set of bindingCount storage buffers, optionally followed by
+    // extraSetLayout, and push constants.  The shader comes from
+    // --shader-dir if set, like the graphics ones.
+    if (settings.shaderDir) {
+        if (!createShaderModule((string(settings.shaderDir) + "/" +
+                                 file).c_str(), shader))
+            return false;
+    }
+    else if (!createShaderModule(code, codeSize, shader)) {
+        return false;
+    }
+
+    vector<VkDescriptorSetLayoutBinding> bindings(bindingCount);
+    for (uint32_t i = 0; i < bindingCount; ++i) {
+        bindings[i] = {};
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = {};
+    setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    setLayoutInfo.bindingCount = bindingCount;
+    setLayoutInfo.pBindings = bindings.data();
+    VkResult vkRet = vkCreateDescriptorSetLayout(device, &setLayoutInfo,
+                                                 nullptr, setLayout);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateDescriptorSetLayout failed with %d\n", vkRet);
+        return false;
+    }
+
+    VkPushConstantRange pushRange = {};
+    pushRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushRange.size = pushConstantsSize;
+    const VkDescriptorSetLayout setLayouts[2] = {*setLayout, extraSetLayout};
+    VkPipelineLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layoutInfo.setLayoutCount = extraSetLayout != VK_NULL_HANDLE ? 2 : 1;
+    layoutInfo.pSetLayouts = setLayouts;
+    layoutInfo.pushConstantRangeCount = 1;
+    layoutInfo.pPushConstantRanges = &pushRange;
+    vkRet = vkCreatePipelineLayout(device, &layoutInfo, nullptr, layout);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreatePipelineLayout failed with ret %d\n", vkRet);
+        return false;
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType =
+                         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = *shader;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = *layout;
+    vkRet = vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo,
+                                     nullptr, pipeline);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateComputePipelines failed with %d\n", vkRet);
+        return false;
+    }
+    return true;
+}
+
+bool VulkanApp::createStorageSet(VkDescriptorSetLayout setLayout,
+                                 const vector<VkBuffer>& buffers,
+                                 VkDescriptorSet *set)
+{
+    // Binding i is the whole of buffers[i]
+    vector<DescriptorAllocator::BufferBinding> bindings;
+    for (VkBuffer buffer : buffers) {
+        bindings.push_back({VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, buffer, 0,
+                            VK_WHOLE_SIZE});
+    }
+    return descriptors.cachedSet(setLayout, bindings, set);
+}
+
+bool VulkanApp::createSimulation()
+{
+    // Binding 0 is mesh.instanceBuffer, 1 the slot's animated instances
+    if (!createComputePipeline(computeSpirv, sizeof(computeSpirv),
+                               "compute.spv", 2, sizeof(SimPushConstants),
+                               &sim.shader, &sim.setLayout, &sim.layout,
+                               &sim.pipeline))
+        return false;
+    nameObject(VK_OBJECT_TYPE_PIPELINE, sim.pipeline, "simulation");
+
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = devInfo.computeFamily;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                     VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VkResult vkRet = vkCreateCommandPool(device, &poolInfo, nullptr,
+                                         &sim.commandPool);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkCreateCommandPool failed with %d\n", vkRet);
+        return false;
+    }
+    for (auto& frame : frames) {
+        VkCommandBufferAllocateInfo allocInfo = {};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = sim.commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        vkRet = vkAllocateCommandBuffers(device, &allocInfo, &frame.computeCmd);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkAllocateCommandBuffers failed with %d\n", vkRet);
+            return false;
+        }
+        // Signaled on timeline.compute otherwise
+        if (timeline.enabled)
+            continue;
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        vkRet = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+                                  &frame.computeFinishedSem);
+        if (vkRet != VK_SUCCESS) {
+            printf("vkCreateSemaphore failed with %d\n", vkRet);
+            return false;
+        }
+    }
+    sim.start = chrono::steady_clock::now();
+    printf("Simulating %u instances on the %s queue\n", mesh.instanceCount,
+           devInfo.hasComputeFamily() ? "compute" : "graphics");
+    return true;
+}
 
-    VkPipelineColorBlendStateCreateInfo colorBlending = {};
-    colorBlending.sType =
-                      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlending.logicOpEnable = VK_FALSE;
-    colorBlending.logicOp = VK_LOGIC_OP_COPY;
-    colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &colorBlendAttachment;
-    colorBlending.blendConstants[0] = 0.0f;
-    colorBlending.blendConstants[1] = 0.0f;
-    colorBlending.blendConstants[2] = 0.0f;
-    colorBlending.blendConstants[3] = 0.0f;
+bool VulkanApp::createSimBuffer(RecordSlot *slot)
+{
+    const VkDeviceSize size = mesh.instanceCount * sizeof(Instance);
+    if (!allocator.createBuffer(size,
+                                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                                &slot->simBuffer, &slot->simMemory,
+                                bufferFamilies()))
+        return false;
 
-    // vulkan dynamic states - XXX resizing
-    // VkPipelineDynamicStateCreateInfo dynamicState = {};
+    return createStorageSet(sim.setLayout,
+                            {mesh.instanceBuffer, slot->simBuffer},
+                            &slot->simSet);
+}
 
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-    pipelineLayoutInfo.sType =
-                            VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 0;
-    pipelineLayoutInfo.pSetLayouts = nullptr;
-    pipelineLayoutInfo.pushConstantRangeCount = 0;
-    pipelineLayoutInfo.pPushConstantRanges = 0;
+bool VulkanApp::submitSimulation(FrameContext& frame, const RecordSlot& slot)
+{
+    // The frame's previous pass completed before its frame did
+    VkCommandBuffer b = frame.computeCmd;
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(b, &beginInfo);
+    beginLabel(b, "simulation");
+
+    SimPushConstants params;
+    params.time = chrono::duration<float>(chrono::steady_clock::now() -
+                                          sim.start).count();
+    params.count = mesh.instanceCount;
+    vkCmdBindPipeline(b, VK_PIPELINE_BIND_POINT_COMPUTE, sim.pipeline);
+    vkCmdBindDescriptorSets(b, VK_PIPELINE_BIND_POINT_COMPUTE, sim.layout, 0,
+                            1, &slot.simSet, 0, nullptr);
+    vkCmdPushConstants(b, sim.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(params), &params);
+    vkCmdDispatch(b, (params.count + computeGroupSize - 1) / computeGroupSize,
+                  1, 1);
+    endLabel(b);
+
+    VkResult vkRet = vkEndCommandBuffer(b);
+    if (vkRet != VK_SUCCESS) {
+        printf("vkEndCommandBuffer failed with %d\n", vkRet);
+        return false;
+    }
 
-    VkResult vkRet = vkCreatePipelineLayout(device, &pipelineLayoutInfo,
-                                            nullptr, &pipelineLayout);
+    // The semaphore signal makes the writes visible to the graphics queue.
+    // The timeline value is the number of the frame about to be submitted.
+    SubmitSync sync;
+    waitForUploads(&sync, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+    if (timeline.enabled)
+        sync.signal(timeline.compute, frameNumber + 1);
+    else
+        sync.signal(frame.computeFinishedSem);
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &b;
+    sync.apply(&submitInfo);
+    vkRet = vkQueueSubmit(computeQueue, 1, &submitInfo, VK_NULL_HANDLE);
     if (vkRet != VK_SUCCESS) {
-       printf("vkCreatePipelineLayout failed with ret %d\n", vkRet);
-       return false;
+        printf("vkQueueSubmit failed with %d\n", vkRet);
+        return false;
     }
+    return true;
+}
 
-    VkGraphicsPipelineCreateInfo pipelineInfo = {};
-    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages = shaderStages;
-    pipelineInfo.pVertexInputState = &vertexInputInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssembly;
-    pipelineInfo.pViewportState = &viewportState;
-    pipelineInfo.pRasterizationState = &rasterizer;
-#ifdef MSAA
-    pipelineInfo.pMultisampleState = &multisampling;
-#else
-    pipelineInfo.pMultisampleState = nullptr;
-#endif
-    pipelineInfo.pDepthStencilState = nullptr;
-    pipelineInfo.pColorBlendState = &colorBlending;
-    pipelineInfo.pDynamicState = nullptr;
-    pipelineInfo.layout = pipelineLayout;
-    pipelineInfo.renderPass = renderPass;
-    pipelineInfo.subpass = 0;
-    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
-    pipelineInfo.basePipelineIndex = -1;
+void VulkanApp::destroySimulation()
+{
+    for (auto& frame : frames)
+        vkDestroySemaphore(device, frame.computeFinishedSem, nullptr);
+    // Destroying the pool frees the command buffers
+    vkDestroyCommandPool(device, sim.commandPool, nullptr);
+    vkDestroyPipeline(device, sim.pipeline, nullptr);
+    vkDestroyPipelineLayout(device, sim.layout, nullptr);
+    vkDestroyDescriptorSetLayout(device, sim.setLayout, nullptr);
+    vkDestroyShaderModule(device, sim.shader, nullptr);
+    sim = Simulation();
+}
 
-    vkRet = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo,
-                                      nullptr, &graphicsPipeline);
-    if (vkRet != VK_SUCCESS) {
-       printf("vkCreateGraphicsPipelines failed with ret %d\n", vkRet);
-       return false;
+bool VulkanApp::createCulling()
+{
+    // The indirect draw is done with the first draw's descriptor sets
+    if (streamer.textures.size() > 1) {
+        puts("--gpu-driven only supports a single texture");
+        return false;
     }
+    // Binding 0 is the instances, 1 the visible ones and 2 the draw.  Set 1
+    // is the frame set, for the camera.
+    if (!createComputePipeline(cullSpirv, sizeof(cullSpirv), "cull.spv", 3,
+                               sizeof(CullPushConstants), &cull.shader,
+                               &cull.setLayout, &cull.layout, &cull.pipeline,
+                               frameSetLayout))
+        return false;
+    nameObject(VK_OBJECT_TYPE_PIPELINE, cull.pipeline, "culling");
+    printf("GPU driven: culling %u instances\n", mesh.instanceCount);
     return true;
 }
 
-bool VulkanApp::createFrameBuffers()
+bool VulkanApp::createCullBuffers(RecordSlot *slot)
 {
-    frameBuffers.resize(swapChain.size());
-    for (unsigned i = 0; i != swapChain.size(); ++i) {
-#ifdef MSAA
-        VkImageView attachments[] = {swapChain[i].msaaView,
-                                     swapChain[i].view };
-#else
-        VkImageView attachments[] = {swapChain[i].view };
-#endif
-        VkFramebufferCreateInfo framebufferInfo = {};
-        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebufferInfo.renderPass = renderPass;
-        framebufferInfo.attachmentCount = sizeof(attachments)/
-                                          sizeof(*attachments);
-        framebufferInfo.pAttachments = attachments;
-        framebufferInfo.width = devInfo.extent.width;
-        framebufferInfo.height = devInfo.extent.height;
-        framebufferInfo.layers = 1;
+    // Room for every instance, the draw is reset by a transfer
+    if (!allocator.createBuffer(mesh.instanceCount * sizeof(Instance),
+                                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                                &slot->visibleBuffer, &slot->visibleMemory)
+     || !allocator.createBuffer(sizeof(VkDrawIndexedIndirectCommand),
+                                VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                                &slot->drawBuffer, &slot->drawMemory))
+        return false;
 
-        VkResult vkRet = vkCreateFramebuffer(device, &framebufferInfo,
-                                             nullptr, &frameBuffers[i]);
+    // Culls what gets drawn, the animated instances if simulating
+    const VkBuffer instances = slot->simBuffer != VK_NULL_HANDLE
+                             ? slot->simBuffer : mesh.instanceBuffer;
+    return createStorageSet(cull.setLayout,
+                            {instances, slot->visibleBuffer, slot->drawBuffer},
+                            &slot->cullSet);
+}
+
+void VulkanApp::recordCulling(VkCommandBuffer b, const RecordSlot& slot)
+{
+    // Recorded before the render pass, in the graphics queue
+    CullPushConstants params;
+    params.count = mesh.instanceCount;
+    params.radius = mesh.radius;
+
+    // Every visible instance adds itself to the draw
+    VkDrawIndexedIndirectCommand draw = {};
+    draw.indexCount = mesh.indexCount;
+    vkCmdUpdateBuffer(b, slot.drawBuffer, 0, sizeof(draw), &draw);
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                            VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(b, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         1, &barrier, 0, nullptr, 0, nullptr);
+    vkCmdBindPipeline(b, VK_PIPELINE_BIND_POINT_COMPUTE, cull.pipeline);
+    const uint32_t offsets[2] = {
+        (uint32_t) slot.uniformOffset,
+        (uint32_t) (slot.uniformOffset + uniforms.drawOffset)
+    };
+    const VkDescriptorSet sets[2] = {slot.cullSet, uniforms.set};
+    vkCmdBindDescriptorSets(b, VK_PIPELINE_BIND_POINT_COMPUTE, cull.layout, 0,
+                            2, sets, 2, offsets);
+    vkCmdPushConstants(b, cull.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(params), &params);
+    vkCmdDispatch(b, (params.count + computeGroupSize - 1) / computeGroupSize,
+                  1, 1);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                            VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    vkCmdPipelineBarrier(b, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+                         1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void VulkanApp::destroyCulling()
+{
+    vkDestroyPipeline(device, cull.pipeline, nullptr);
+    vkDestroyPipelineLayout(device, cull.layout, nullptr);
+    vkDestroyDescriptorSetLayout(device, cull.setLayout, nullptr);
+    vkDestroyShaderModule(device, cull.shader, nullptr);
+    cull = Culling();
+}
+
+void VulkanApp::destroyRecordSlots(const vector<RecordSlot>& slots)
+{
+    for (auto& slot : slots) {
+        if (slot.pool != VK_NULL_HANDLE)
+            vkDestroyCommandPool(device, slot.pool, nullptr);
+        else if (slot.cmd != VK_NULL_HANDLE)
+            vkFreeCommandBuffers(device, commandPool, 1, &slot.cmd);
+        // Destroying the pools frees the secondaries
+        for (VkCommandPool pool : slot.workerPools)
+            vkDestroyCommandPool(device, pool, nullptr);
+        vkDestroyQueryPool(device, slot.timing.queryPool, nullptr);
+        // Along with the sets using them
+        if (slot.simBuffer != VK_NULL_HANDLE) {
+            descriptors.forget(slot.simBuffer);
+            allocator.destroyBuffer(slot.simBuffer, slot.simMemory);
+        }
+        if (slot.drawBuffer != VK_NULL_HANDLE) {
+            descriptors.forget(slot.drawBuffer);
+            allocator.destroyBuffer(slot.visibleBuffer, slot.visibleMemory);
+            allocator.destroyBuffer(slot.drawBuffer, slot.drawMemory);
+        }
+    }
+}
+
+void VulkanApp::readTimestamps(int32_t slotIndex)
+{
+    // Only called once the submission using the slot has completed, so
+    // nothing here ever waits.
+    if (slotIndex < 0)
+        return;
+    TimingSlot& slot = recordSlots[slotIndex].timing;
+    if (!slot.pending)
+        return;
+
+    if (slot.queryPool != VK_NULL_HANDLE) {
+        uint64_t ts[TS_COUNT];
+        VkResult vkRet = vkGetQueryPoolResults(device, slot.queryPool, 0,
+                                               TS_COUNT, sizeof(ts), ts,
+                                               sizeof(uint64_t),
+                                               VK_QUERY_RESULT_64_BIT);
+        if (vkRet == VK_NOT_READY)
+            return;
         if (vkRet != VK_SUCCESS) {
-            printf("vkCreateFramebuffer failed with %d\n", vkRet);
-            return false;
+            printf("vkGetQueryPoolResults failed with %d\n", vkRet);
+            slot.pending = false;
+            return;
+        }
+        const uint64_t mask = devInfo.timestampValidBits >= 64
+                            ? ~0ULL
+                            : (1ULL << devInfo.timestampValidBits) - 1;
+        const double toMs = devInfo.properties.limits.timestampPeriod * 1e-6;
+        auto elapsed = [&](int from, int to) {
+            return ((ts[to] - ts[from]) & mask) * toMs;
+        };
+        slot.sample.gpuFrame = elapsed(TS_FRAME_BEGIN, TS_FRAME_END);
+        slot.sample.renderPass = elapsed(TS_RENDER_PASS_BEGIN,
+                                         TS_RENDER_PASS_END);
+
+        // The counter may wrap with fewer than 64 valid bits: the frame
+        // ends after it started, sooner than a wrap later
+        const double sinceCalibration = chrono::duration<double, milli>(
+                                    slot.started - calibration.cpu).count();
+        double endMs = ((ts[TS_FRAME_END] - calibration.gpu) & mask) * toMs;
+        if (mask != ~0ULL) {
+            const double wrapMs = (mask + 1.0) * toMs;
+            endMs += ceil((sinceCalibration - endMs) / wrapMs) * wrapMs;
         }
+        slot.sample.latency = endMs - sinceCalibration;
+        if (settings.dynamicResolution > 0.0)
+            updateRenderScale(slot.sample.gpuFrame);
+    }
+    frameStats.add(slot.sample);
+    slot.pending = false;
+}
+
+bool VulkanApp::setupCommandBuffers()
+{
+    // Dynamic command buffers are recorded by renderFrame()
+    if (settings.dynamicRecording)
+        return true;
+
+    // Setup command buffers
+    for (uint32_t i = 0; i < recordSlots.size(); ++i) {
+        if (!recordSlot(i, i))
+            return false;
     }
     return true;
 }
 
-bool VulkanApp::createCommandBuffers()
+uint32_t VulkanApp::recordSlotIndex(uint32_t frameIndex,
+                                    uint32_t imageIndex) const
 {
-    VkCommandPoolCreateInfo poolInfo = {};
-    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    poolInfo.queueFamilyIndex = devInfo.families[0];
-    poolInfo.flags = 0;
+    return settings.dynamicRecording ? frameIndex : imageIndex;
+}
 
-    VkResult vkRet = vkCreateCommandPool(device, &poolInfo, nullptr,
-                                         &commandPool);
+bool VulkanApp::texturesChanged(const RecordSlot& slot) const
+{
+    for (uint32_t i = 0; i < slot.textureSets.size(); ++i) {
+        if (slot.textureSets[i] != streamer.textures[i].set)
+            return true;
+    }
+    return false;
+}
+
+bool VulkanApp::recordSlot(uint32_t slotIndex, uint32_t imageIndex)
+{
+    RecordSlot& slot = recordSlots[slotIndex];
+    // Static command buffers are submitted once per use of their image,
+    // which waits for the frame that last rendered to it: never pending.
+    const VkCommandBufferUsageFlags usage = settings.dynamicRecording
+                                   ? VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+                                   : 0;
+
+    // Resetting the whole pool is cheaper than resetting the buffers one by
+    // one, and lets the driver recycle the memory.  The slot's previous
+    // submission has completed.
+    if (slot.pool != VK_NULL_HANDLE)
+        vkResetCommandPool(device, slot.pool, 0);
+    else
+        vkResetCommandBuffer(slot.cmd, 0);
+
+    slot.textureSets.clear();
+    for (const auto& tex : streamer.textures)
+        slot.textureSets.push_back(tex.set);
+
+    // Workers record their share of the draws first, the primary command
+    // buffer then only has to execute them.
+    const bool secondaries = !slot.secondaries.empty();
+    if (secondaries) {
+        bool ok = true;
+        mutex okLock;
+        recordJobs.runOnAll([&](uint32_t worker) {
+            if (!recordSecondary(slot, imageIndex, worker)) {
+                lock_guard<mutex> guard(okLock);
+                ok = false;
+            }
+        });
+        if (!ok)
+            return false;
+    }
+
+    VkCommandBuffer b = slot.cmd;
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = usage;
+    beginInfo.pInheritanceInfo = nullptr;
+
+    vkBeginCommandBuffer(b, &beginInfo);
+
+    const VkQueryPool queryPool = slot.timing.queryPool;
+    if (queryPool != VK_NULL_HANDLE) {
+        vkCmdResetQueryPool(b, queryPool, 0, TS_COUNT);
+        vkCmdWriteTimestamp(b, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            queryPool, TS_FRAME_BEGIN);
+    }
+    if (settings.gpuDriven) {
+        beginLabel(b, "culling");
+        recordCulling(b, slot);
+        endLabel(b);
+    }
+    if (queryPool != VK_NULL_HANDLE) {
+        // Top of pipe doesn't wait for anything, the compute stage waits
+        // for the culling
+        vkCmdWriteTimestamp(b, settings.gpuDriven
+                             ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                             : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            queryPool, TS_RENDER_PASS_BEGIN);
+    }
+
+    VkRenderPassBeginInfo renderPassInfo = {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = renderPass;
+    renderPassInfo.framebuffer = frameBuffers[imageIndex];
+    renderPassInfo.renderArea.offset = {0, 0};
+    renderPassInfo.renderArea.extent = renderExtent();
+
+    // Indexed by attachment, the resolve one has none
+    VkClearValue clearValues[3] = {};
+    clearValues[0].color.float32[0] = 0.0f;
+    clearValues[0].color.float32[1] = 0.0f;
+    clearValues[0].color.float32[2] = 0.0f;
+    clearValues[0].color.float32[3] = 1.0f;
+    const uint32_t depthIndex = msaaSamples != VK_SAMPLE_COUNT_1_BIT ? 2 : 1;
+    clearValues[depthIndex].depthStencil.depth = 1.0f;
+    renderPassInfo.clearValueCount = depthIndex + 1;
+    renderPassInfo.pClearValues = clearValues;
+
+    beginLabel(b, "scene");
+    if (secondaries) {
+        vkCmdBeginRenderPass(b, &renderPassInfo,
+                             VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        vkCmdExecuteCommands(b, slot.secondaries.size(),
+                             slot.secondaries.data());
+    }
+    else {
+        vkCmdBeginRenderPass(b, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        recordDraws(b, slot, 0, drawList.size());
+    }
+
+    vkCmdEndRenderPass(b);
+    endLabel(b);
+
+    if (queryPool != VK_NULL_HANDLE) {
+        vkCmdWriteTimestamp(b, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            queryPool, TS_RENDER_PASS_END);
+    }
+    if (settings.dynamicResolution > 0.0) {
+        beginLabel(b, "upscale");
+        recordUpscale(b, imageIndex);
+        endLabel(b);
+    }
+    if (queryPool != VK_NULL_HANDLE) {
+        vkCmdWriteTimestamp(b, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            queryPool, TS_FRAME_END);
+    }
+
+    VkResult vkRet = vkEndCommandBuffer(b);
     if (vkRet != VK_SUCCESS) {
-        printf("vkCreateCommandPool failed with %d\n", vkRet);
+        printf("vkEndCommandBuffer failed with %d\n", vkRet);
         return false;
     }
+    return true;
+}
 
-    // Command buffers
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool = commandPool;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = swapChain.size();
+void VulkanApp::recordUpscale(VkCommandBuffer b, uint32_t imageIndex)
+{
+    // The render pass left the scene target ready to be read.  The swap
+    // chain image contents are discarded, the acquire semaphore is waited
+    // for by the transfer stage.
+    const VkImageLayout presentLayout = settings.headless
+                                      ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                      : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = swapChain[imageIndex].image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(b, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+
+    const VkExtent2D extent = renderExtent();
+    VkImageBlit blit = {};
+    blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    blit.srcSubresource.layerCount = 1;
+    blit.srcOffsets[1] = {(int32_t) extent.width, (int32_t) extent.height, 1};
+    blit.dstSubresource = blit.srcSubresource;
+    blit.dstOffsets[1] = {(int32_t) devInfo.extent.width,
+                          (int32_t) devInfo.extent.height, 1};
+    vkCmdBlitImage(b, sceneTarget.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                   swapChain[imageIndex].image,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                   VK_FILTER_LINEAR);
+
+    // Presentation engine accesses need no visibility
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = presentLayout;
+    vkCmdPipelineBarrier(b, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &barrier);
+}
 
-    commandBuffers.resize(swapChain.size());
-    vkRet = vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data());
+bool VulkanApp::recordSecondary(const RecordSlot& slot, uint32_t imageIndex,
+                                uint32_t worker)
+{
+    // Runs on a worker thread: only touch what this worker owns
+    const uint32_t workers = slot.secondaries.size();
+    const uint32_t drawCount = drawList.size();
+    const uint32_t firstDraw = drawCount * worker / workers;
+    const uint32_t endDraw = drawCount * (worker + 1) / workers;
+
+    VkCommandBufferInheritanceInfo inheritance = {};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.renderPass = renderPass;
+    inheritance.subpass = 0;
+    inheritance.framebuffer = frameBuffers[imageIndex];
+
+    // Static secondaries are recorded again too when their textures get
+    // streamed, the slot's previous submission has completed either way
+    vkResetCommandPool(device, slot.workerPools[worker], 0);
+
+    VkCommandBuffer b = slot.secondaries[worker];
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    // Only executed by the slot's primary, which is never pending twice
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+                      (settings.dynamicRecording
+                     ? VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT : 0);
+    beginInfo.pInheritanceInfo = &inheritance;
+    vkBeginCommandBuffer(b, &beginInfo);
+
+    // Nothing is inherited but the render pass, every secondary sets up
+    // its own state even when it has no draw.
+    recordDraws(b, slot, firstDraw, endDraw);
+
+    VkResult vkRet = vkEndCommandBuffer(b);
     if (vkRet != VK_SUCCESS) {
-        printf("vkCreateCommandPool failed with %d\n", vkRet);
+        printf("vkEndCommandBuffer failed with %d\n", vkRet);
         return false;
     }
     return true;
 }
 
-bool VulkanApp::setupCommandBuffers()
+void VulkanApp::recordDraws(VkCommandBuffer b, const RecordSlot& slot,
+                            uint32_t firstDraw, uint32_t endDraw)
 {
-    // Setup command buffers
-    for (unsigned i = 0; i < commandBuffers.size(); ++i) {
-        VkCommandBuffer& b = commandBuffers[i];
-        VkCommandBufferBeginInfo beginInfo = {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-        beginInfo.pInheritanceInfo = nullptr;
-
-        vkBeginCommandBuffer(b, &beginInfo);
-
-        VkRenderPassBeginInfo renderPassInfo = {};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = renderPass;
-        renderPassInfo.framebuffer = frameBuffers[i];
-        renderPassInfo.renderArea.offset = {0, 0};
-        renderPassInfo.renderArea.extent = devInfo.extent;
-
-        VkClearValue clearColor = {};
-        clearColor.color.float32[0] = 0.0f;
-        clearColor.color.float32[1] = 0.0f;
-        clearColor.color.float32[2] = 0.0f;
-        clearColor.color.float32[3] = 1.0f;
-        renderPassInfo.clearValueCount = 1;
-        renderPassInfo.pClearValues = &clearColor;
+    vkCmdBindPipeline(b, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
 
-        vkCmdBeginRenderPass(b, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-        vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          graphicsPipeline);
-        vkCmdDraw(b, 3, 1, 0, 0);
+    const VkExtent2D extent = renderExtent();
+    VkViewport viewport = {};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float) extent.width;
+    viewport.height = (float) extent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(b, 0, 1, &viewport);
 
-        vkCmdEndRenderPass(b);
+    VkRect2D scissor = {};
+    scissor.offset = {0, 0};
+    scissor.extent = extent;
+    vkCmdSetScissor(b, 0, 1, &scissor);
+
+    const uint32_t bindingCount = vertexBindingCount();
+    VkBuffer vertexBuffers[3] = {mesh.vertexBuffer, mesh.vertexBuffer};
+    VkDeviceSize offsets[3] = {mesh.streamOffsets[0],
+                               mesh.streamOffsets[1]};
+    // The culling pass compacts whichever of the others is drawn
+    vertexBuffers[bindingCount - 1] = slot.visibleBuffer != VK_NULL_HANDLE
+                                    ? slot.visibleBuffer
+                                    : slot.simBuffer != VK_NULL_HANDLE
+                                    ? slot.simBuffer : mesh.instanceBuffer;
+    offsets[bindingCount - 1] = 0;
+    vkCmdBindVertexBuffers(b, 0, bindingCount, vertexBuffers, offsets);
+    vkCmdBindIndexBuffer(b, mesh.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+
+    const uint32_t uniformOffsets[2] = {
+        (uint32_t) slot.uniformOffset,
+        (uint32_t) (slot.uniformOffset + uniforms.drawOffset)
+    };
+    vkCmdBindDescriptorSets(b, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipelineLayout, 0, 1, &uniforms.set, 2,
+                            uniformOffsets);
+
+    if (settings.gpuDriven) {
+        // Everything in one call, made by whoever records the first draw,
+        // with the data of the first draw
+        if (firstDraw != 0)
+            return;
+        vkCmdBindDescriptorSets(b, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                pipelineLayout, 1, 1,
+                                &streamer.textures[0].set, 0, nullptr);
+        const DrawPushConstants push = {0};
+        vkCmdPushConstants(b, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                           sizeof(push), &push);
+        vkCmdDrawIndexedIndirect(b, slot.drawBuffer, 0, 1,
+                                 sizeof(VkDrawIndexedIndirectCommand));
+        return;
+    }
 
-        VkResult vkRet = vkEndCommandBuffer(b);
-        if (vkRet != VK_SUCCESS) {
-            printf("vkEndCommandBuffer failed with %d\n", vkRet);
-            return false;
+    // With the default single draw, the CPU cost doesn't depend on the
+    // object count
+    VkDescriptorSet boundTexture = VK_NULL_HANDLE;
+    for (uint32_t i = firstDraw; i < endDraw; ++i) {
+        const DrawItem& draw = drawList[i];
+        // Round robin over the textures
+        const VkDescriptorSet texture =
+                         streamer.textures[i % streamer.textures.size()].set;
+        if (texture != boundTexture) {
+            vkCmdBindDescriptorSets(b, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    pipelineLayout, 1, 1, &texture, 0,
+                                    nullptr);
+            boundTexture = texture;
         }
+        const DrawPushConstants push = {i};
+        vkCmdPushConstants(b, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                           sizeof(push), &push);
+        vkCmdDrawIndexed(b, mesh.indexCount, draw.instanceCount, 0, 0,
+                         draw.firstInstance);
     }
-    return true;
 }
 
 bool VulkanApp::renderFrame(uint32_t renderCount)
 {
     // Draw
-    const uint32_t idx = renderCount % swapChain.size();
-
-    vkWaitForFences(device, 1, &swapChain[idx].fence, VK_TRUE, UINT64_MAX);
-    vkResetFences(device, 1, &swapChain[idx].fence);
+    const uint32_t frameIndex = renderCount % frames.size();
+    FrameContext& frame = frames[frameIndex];
+    using Clock = chrono::steady_clock;
+    auto msSince = [](Clock::time_point start) {
+        return chrono::duration<double, milli>(Clock::now() - start).count();
+    };
+    const Clock::time_point frameStart = Clock::now();
+    FrameStats::Sample sample;
+    sample.cpuFrame = chrono::duration<double, milli>(
+                                          frameStart - lastFrameStart).count();
+    lastFrameStart = frameStart;
+
+    waitForFrame(frame.fenceFrame);
+    readTimestamps(frame.timingSlot);
+    frame.timingSlot = -1;
+    descriptors.beginFrame(frameIndex);
+    collectGarbage();
+
+    // Frame pacing goes before acquiring: that's when the next image would
+    // block us with FIFO anyway, and input sampled after the sleep is as
+    // fresh as it gets.
+    sample.sleep = paceFrame();
+    const Clock::time_point inputTime = Clock::now();
+    if (!settings.headless)
+        drainInput();
 
     VkResult vkRet;
     uint32_t imageIndex;
-    vkRet = vkAcquireNextImageKHR(device, vkSwapChain, ULONG_MAX,
-                                  swapChain[idx].imageAvailableSem,
-                                  VK_NULL_HANDLE, &imageIndex);
-    if (vkRet != VK_SUCCESS) {
-        // XXX Handle VK_SUBOPTIMAL_KHR VK_ERROR_OUT_OF_DATE_KHR
-        printf("vkAcquireNextImageKHR returned %d\n", vkRet);
+    Clock::time_point start = inputTime;
+    if (settings.headless) {
+        // Offscreen images are simply used round robin
+        imageIndex = frameNumber % swapChain.size();
+    }
+    else {
+        vkRet = vkAcquireNextImageKHR(device, vkSwapChain, ULONG_MAX,
+                                      frame.imageAvailableSem,
+                                      VK_NULL_HANDLE, &imageIndex);
+        if (vkRet == VK_ERROR_OUT_OF_DATE_KHR) {
+            // No image and the semaphore is left alone: skip this frame
+            swapChainDirty = swapChainOutOfDate = true;
+            return true;
+        }
+        if (vkRet == VK_SUBOPTIMAL_KHR) {
+            // Still presentable, recreate when convenient
+            swapChainDirty = true;
+        }
+        else if (vkRet != VK_SUCCESS) {
+            printf("vkAcquireNextImageKHR failed with %d\n", vkRet);
+            return false;
+        }
+    }
+    sample.acquire = msSince(start);
+
+    // The image may be handed back before the frame that last rendered to
+    // it has completed when there are more images than frames in flight.
+    SwapChainEntry& swpe = swapChain[imageIndex];
+    waitForFrame(swpe.inFlightFrame);
+    swpe.inFlightFrame = frameNumber + 1;
+    // The previous results of the slot are about to be overwritten
+    const uint32_t slotIndex = recordSlotIndex(frameIndex, imageIndex);
+    readTimestamps(slotIndex);
+    for (auto& other : frames) {
+        if (other.timingSlot == (int32_t) slotIndex)
+            other.timingSlot = -1;
+    }
+    if (frame.fence != VK_NULL_HANDLE)
+        vkResetFences(device, 1, &frame.fence);
+    writeUniforms(recordSlots[slotIndex]);
+
+    if (settings.dynamicRecording || texturesChanged(recordSlots[slotIndex])) {
+        start = Clock::now();
+        if (!recordSlot(slotIndex, imageIndex))
+            return false;
+        sample.record = msSince(start);
     }
 
     VkSubmitInfo submitInfo = {};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-    VkSemaphore waitSemaphores[] = {swapChain[idx].imageAvailableSem};
-    VkPipelineStageFlags waitStages[] = {
-                                VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = waitSemaphores;
-    submitInfo.pWaitDstStageMask = waitStages;
+    // Wait for the image and for whatever got uploaded since last frame.
+    // There is neither acquire nor present when headless.  The simulation
+    // reads the uploaded instances so it is the one waiting on the uploads,
+    // rendering then waits on the simulation.
+    SubmitSync sync;
+    if (!settings.headless) {
+        // The upscale is what writes to the image with dynamic resolution
+        sync.wait(frame.imageAvailableSem,
+                  settings.dynamicResolution > 0.0
+                ? VK_PIPELINE_STAGE_TRANSFER_BIT
+                : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+    }
+    // The culling pass reads the instances before the vertex input does.
+    const VkPipelineStageFlags instanceStages =
+                   VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                   (settings.gpuDriven ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                                       : 0);
+    if (settings.simulate) {
+        if (!submitSimulation(frame, recordSlots[slotIndex]))
+            return false;
+        if (timeline.enabled)
+            sync.wait(timeline.compute, instanceStages, frameNumber + 1);
+        else
+            sync.wait(frame.computeFinishedSem, instanceStages);
+    }
+    else {
+        waitForUploads(&sync, instanceStages);
+    }
+    if (!settings.headless)
+        sync.signal(frame.renderFinishedSem);
+    if (timeline.enabled)
+        sync.signal(timeline.frames, frameNumber + 1);
+    sync.apply(&submitInfo);
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+    submitInfo.pCommandBuffers = &recordSlots[slotIndex].cmd;
 
-    VkSemaphore signalSemaphores[] = {swapChain[idx].renderFinishedSem};
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = signalSemaphores;
-
-    vkRet = vkQueueSubmit(graphicsQueue, 1, &submitInfo, swapChain[idx].fence);
+    start = Clock::now();
+    vkRet = vkQueueSubmit(graphicsQueue, 1, &submitInfo, frame.fence);
+    sample.submit = msSince(start);
     if (vkRet != VK_SUCCESS) {
         printf("vkQueueSubmit failed with %d\n", vkRet);
         return false;
     }
+    frame.fenceFrame = ++frameNumber;
+    for (UploadBatch *batch : staging.pendingBatches)
+        batch->waitFrame = frameNumber;
+    staging.pendingWaits.clear();
+    staging.pendingValue = 0;
+    staging.pendingBatches.clear();
+    retireUploads(false);
+
+    if (settings.headless) {
+        finishTiming(frame, slotIndex, sample, inputTime);
+        return true;
+    }
 
     VkPresentInfoKHR presentInfo = {};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 
     presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = signalSemaphores;
+    presentInfo.pWaitSemaphores = &frame.renderFinishedSem;
     VkSwapchainKHR swapChains[] = {vkSwapChain};
     presentInfo.swapchainCount = 1;
     presentInfo.pSwapchains = swapChains;
     presentInfo.pImageIndices = &imageIndex;
     presentInfo.pResults = nullptr;
 
+    start = Clock::now();
     vkRet = vkQueuePresentKHR(presentationQueue, &presentInfo);
-    if (vkRet != VK_SUCCESS) {
-        // XXX Handle VK_SUBOPTIMAL_KHR VK_ERROR_OUT_OF_DATE_KHR
-        printf("vkQueuePresentKHR returned %d\n", vkRet);
+    sample.present = msSince(start);
+    if (vkRet == VK_ERROR_OUT_OF_DATE_KHR) {
+        swapChainDirty = swapChainOutOfDate = true;
+    }
+    else if (vkRet == VK_SUBOPTIMAL_KHR) {
+        swapChainDirty = true;
+    }
+    else if (vkRet != VK_SUCCESS) {
+        printf("vkQueuePresentKHR failed with %d\n", vkRet);
+        return false;
     }
 
+    finishTiming(frame, slotIndex, sample, inputTime);
     return true;
 }
 
-bool VulkanApp::recreateSwapChain()
+void VulkanApp::finishTiming(FrameContext& frame, uint32_t slotIndex,
+                             const FrameStats::Sample& sample,
+                             chrono::steady_clock::time_point started)
 {
-    waitForIdle();
+    // Completed by readTimestamps() once the GPU is done with the frame
+    TimingSlot& slot = recordSlots[slotIndex].timing;
+    slot.sample = sample;
+    slot.started = started;
+    slot.sample.frame = frameNumber;
+    slot.pending = true;
+    frame.timingSlot = slotIndex;
+}
+
+bool VulkanApp::updateSwapChain()
+{
+    // Called between frames when the swap chain is dirty
+    const double sinceResize = chrono::duration<double>(
+                        chrono::steady_clock::now() - lastResizeEvent).count();
+    if (sinceResize < resizeDebounce) {
+        // Still resizing.  There's nothing to render when out of date, so
+        // wait for more events rather than spin.
+        if (swapChainOutOfDate)
+            this_thread::sleep_for(chrono::duration<double>(
+                                                resizeDebounce - sinceResize));
+        return true;
+    }
+    if (framebufferWidth == 0 || framebufferHeight == 0) {
+        // Minimized, a swap chain can't be 0 sized
+        const chrono::duration<double> wait(double{resizeDebounce});
+        this_thread::sleep_for(wait);
+        return true;
+    }
+    swapChainDirty = swapChainOutOfDate = false;
+    return recreateSwapChain();
+}
 
+bool VulkanApp::recreateSwapChain()
+{
     updateExtent();
 
-    cleanupSwapChain();
-    if (!createSwapChain()
-     || !loadShaders()
-     || !createRenderPass()
-     || !createPipeline()
+    // Only the extent dependent objects are rebuilt, the render pass and the
+    // pipeline only depend on the surface format and use dynamic viewport
+    // and scissor.  We don't wait for the GPU here: the old swap chain is
+    // handed over to the new one and its resources are destroyed once the
+    // frames using them have completed.
+    VkSwapchainKHR oldSwapChain = vkSwapChain;
+    retireSwapChain();
+    if (!createSwapChain(oldSwapChain)
      || !createFrameBuffers()
      || !createCommandBuffers()
      || !setupCommandBuffers())
@@ -1128,57 +7038,227 @@ bool VulkanApp::recreateSwapChain()
     return true;
 }
 
+void VulkanApp::deferDestroy(function<void()> destroy)
+{
+    // Retired objects may be referenced by any frame submitted so far
+    deletionQueue.push_back({frameNumber, move(destroy)});
+}
+
+void VulkanApp::deferDestroyAfterUploads(function<void()> destroy)
+{
+    // Also read by the uploads not submitted yet, which the next frame
+    // waits on
+    deletionQueue.push_back({frameNumber + 1, move(destroy)});
+}
+
+void VulkanApp::collectGarbage()
+{
+    while (!deletionQueue.empty()
+        && deletionQueue.front().frame <= completedFrame) {
+        deletionQueue.front().destroy();
+        deletionQueue.pop_front();
+    }
+}
+
+void VulkanApp::retireSwapChain()
+{
+    retireFrameBuffers();
+
+    VkSwapchainKHR oldSwapChain = vkSwapChain;
+    vector<SwapChainEntry> oldEntries;
+    oldEntries.swap(swapChain);
+    vkSwapChain = VK_NULL_HANDLE;
+    deferDestroy([this, oldSwapChain, oldEntries]() {
+        destroySwapChain(oldSwapChain, oldEntries);
+    });
+}
+
+bool VulkanApp::retireCommandBuffers()
+{
+    // Re-record the command buffers without touching the frame buffers
+    vector<RecordSlot> oldRecordSlots;
+    oldRecordSlots.swap(recordSlots);
+    for (auto& frame : frames)
+        frame.timingSlot = -1;
+    deferDestroy([this, oldRecordSlots]() {
+        destroyRecordSlots(oldRecordSlots);
+    });
+    return createCommandBuffers() && setupCommandBuffers();
+}
+
+void VulkanApp::retireFrameBuffers()
+{
+    vector<VkFramebuffer> oldFrameBuffers;
+    vector<RecordSlot> oldRecordSlots;
+    oldFrameBuffers.swap(frameBuffers);
+    oldRecordSlots.swap(recordSlots);
+    const RenderTarget oldMsaaTarget = msaaTarget;
+    const RenderTarget oldDepthTarget = depthTarget;
+    const RenderTarget oldSceneTarget = sceneTarget;
+    msaaTarget = RenderTarget();
+    depthTarget = RenderTarget();
+    sceneTarget = RenderTarget();
+    // The timings of the frames still in flight are dropped
+    for (auto& frame : frames)
+        frame.timingSlot = -1;
+
+    deferDestroy([this, oldFrameBuffers, oldRecordSlots, oldMsaaTarget,
+                  oldDepthTarget, oldSceneTarget]() {
+        destroyFrameBuffers(oldFrameBuffers, oldRecordSlots, oldMsaaTarget,
+                            oldDepthTarget, oldSceneTarget);
+    });
+}
+
 void VulkanApp::cleanupSwapChain()
 {
-    vkFreeCommandBuffers(device, commandPool,
-                         static_cast<uint32_t>(commandBuffers.size()),
-                         commandBuffers.data());
-    for (unsigned i = 0; i < swapChain.size(); ++i) {
-        vkDestroyFramebuffer(device, frameBuffers[i], nullptr);
+    destroyFrameBuffers(frameBuffers, recordSlots, msaaTarget, depthTarget,
+                        sceneTarget);
+    destroySwapChain(vkSwapChain, swapChain);
+    swapChain.clear();
+    frameBuffers.clear();
+    recordSlots.clear();
+    msaaTarget = RenderTarget();
+    depthTarget = RenderTarget();
+    sceneTarget = RenderTarget();
+    vkSwapChain = VK_NULL_HANDLE;
+}
+
+void VulkanApp::destroyFrameBuffers(const vector<VkFramebuffer>& buffers,
+                                    const vector<RecordSlot>& slots,
+                                    const RenderTarget& msaa,
+                                    const RenderTarget& depth,
+                                    const RenderTarget& scene)
+{
+    destroyRecordSlots(slots);
+    for (auto fb : buffers) {
+        vkDestroyFramebuffer(device, fb, nullptr);
     }
-    vkDestroyPipeline(device, graphicsPipeline, nullptr);
-    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-    vkDestroyRenderPass(device, renderPass, nullptr);
-    vkDestroyShaderModule(device, fragShader, nullptr);
-    vkDestroyShaderModule(device, vertexShader, nullptr);
-    for (auto& swpe : swapChain) {
-        vkDestroyFence(device, swpe.fence, nullptr);
-        vkDestroySemaphore(device, swpe.imageAvailableSem, nullptr);
-        vkDestroySemaphore(device, swpe.renderFinishedSem, nullptr);
+    destroyRenderTarget(msaa);
+    destroyRenderTarget(depth);
+    destroyRenderTarget(scene);
+}
+
+void VulkanApp::destroySwapChain(VkSwapchainKHR swapChainHandle,
+                                 const vector<SwapChainEntry>& entries)
+{
+    for (auto& swpe : entries) {
         vkDestroyImageView(device, swpe.view, nullptr);
         // Note that the swpe.image is owned by and will be deallocated
-        // through vkSwapChain
-#ifdef MSAA
-        vkDestroyImageView(device, swpe.msaaView, nullptr);
-        vkFreeMemory(device, swpe.msaaMemory, nullptr);
-        vkDestroyImage(device, swpe.msaaImage, nullptr);
-#endif
+        // through vkSwapChain, unless it is an offscreen one
+        if (swpe.memory.memory != VK_NULL_HANDLE)
+            allocator.destroyImage(swpe.image, swpe.memory);
     }
-    vkDestroySwapchainKHR(device, vkSwapChain, nullptr);
+    if (swapChainHandle != VK_NULL_HANDLE)
+        vkDestroySwapchainKHR(device, swapChainHandle, nullptr);
 }
 
 void VulkanApp::cleanup()
 {
+    // Called after waitForIdle(): every retired object can go
+    recordJobs.stop();
+    completedFrame = frameNumber;
+    collectGarbage();
     cleanupSwapChain();
+    destroyUniformRing(uniforms);
+    destroySimulation();
+    destroyCulling();
+    destroyMesh();
+    destroyTextures();
+    destroyStagingRing();
+    for (auto& frame : frames) {
+        vkDestroyFence(device, frame.fence, nullptr);
+        vkDestroySemaphore(device, frame.imageAvailableSem, nullptr);
+        vkDestroySemaphore(device, frame.renderFinishedSem, nullptr);
+    }
+    vkDestroySemaphore(device, timeline.frames, nullptr);
+    vkDestroySemaphore(device, timeline.compute, nullptr);
+    vkDestroySemaphore(device, timeline.uploads, nullptr);
+    timeline = TimelineSync();
+    shaderWatcher.stop();
+    pipelineCompiler.stop();
+    abortShaderReload();
+    destroyPipelines(pipelineVariants);
+    graphicsPipeline = VK_NULL_HANDLE;
+    vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, frameSetLayout, nullptr);
+    vkDestroyDescriptorSetLayout(device, streamer.setLayout, nullptr);
+    vkDestroyRenderPass(device, renderPass, nullptr);
+    vkDestroyShaderModule(device, fragShader, nullptr);
+    vkDestroyShaderModule(device, vertexShader, nullptr);
     vkDestroyCommandPool(device, commandPool, nullptr);
-    vkDestroySurfaceKHR(instance, surface, nullptr);
+    savePipelineCache();
+    vkDestroyPipelineCache(device, pipelineCache, nullptr);
+    descriptors.destroy();
+    allocator.destroy();
+    if (surface != VK_NULL_HANDLE)
+        vkDestroySurfaceKHR(instance, surface, nullptr);
     vkDestroyDevice(device, nullptr);
+#ifdef VULKANTEST_DEBUG
+    destroyDebugUtils();
+#endif
     vkDestroyInstance(instance, nullptr);
-    glfwDestroyWindow(window);
+    if (window) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+}
 
-    glfwTerminate();
+void VulkanApp::pushResize()
+{
+    // Main thread.  Only the latest size matters, so a resize that does not
+    // fit is sent again by pumpEvents() with the size at that time.
+    InputEvent event;
+    event.type = InputEvent::RESIZE;
+    glfwGetFramebufferSize(window, &event.width, &event.height);
+    resizeBacklog = !inputQueue.push(event);
 }
 
 void VulkanApp::onResize(int width, int height)
 {
-    if (width == 0 || height == 0)
+    // Applied by updateSwapChain(), never from the event
+    framebufferWidth = width;
+    framebufferHeight = height;
+    swapChainDirty = true;
+    lastResizeEvent = chrono::steady_clock::now();
+}
+
+void VulkanApp::onKey(int key, int action)
+{
+    if (action != GLFW_PRESS && action != GLFW_REPEAT)
+        return;
+    if (key == GLFW_KEY_ESCAPE)
+        quitRequested = true;
+    // The camera moves while the keys are held, and only goes through the
+    // uniforms
+    const float step = 0.1f / camera.zoom;
+    if (key == GLFW_KEY_LEFT)
+        camera.pan[0] -= step;
+    if (key == GLFW_KEY_RIGHT)
+        camera.pan[0] += step;
+    if (key == GLFW_KEY_UP)
+        camera.pan[1] -= step;
+    if (key == GLFW_KEY_DOWN)
+        camera.pan[1] += step;
+    if (key == GLFW_KEY_EQUAL)
+        camera.zoom *= 1.25f;
+    if (key == GLFW_KEY_MINUS)
+        camera.zoom /= 1.25f;
+    if (key == GLFW_KEY_0)
+        camera = Camera();
+    if (action != GLFW_PRESS)
         return;
-    recreateSwapChain();
+    if (key == GLFW_KEY_M)
+        pendingMsaaSamples = nextSampleCount(pendingMsaaSamples);
+    if (key == GLFW_KEY_P)
+        pendingPresentPolicy = (PresentPolicy) ((pendingPresentPolicy + 1)
+                                                % PRESENT_POLICY_COUNT);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
     VulkanApp app;
+    if (!app.parseArgs(argc, argv))
+        return 1;
     app.run();
 
     return 0;